@@ -29,6 +29,7 @@
 #define	_INCL_UCLUA_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include <ucl.h>
@@ -41,6 +42,9 @@ typedef enum uclua_dump_type {
 	UCLUAD_UCL,
 	UCLUAD_YAML,
 	UCLUAD_LUA,
+	UCLUAD_SNAPSHOT,
+	UCLUAD_NDJSON,
+	UCLUAD_LUAC,
 } uclua_dump_type;
 
 typedef enum uclua_error {
@@ -63,16 +67,132 @@ typedef enum uclua_error {
 	UCLUE_DUMP_EMITFAIL,	/* Failed to emit requested type. */
 	UCLUE_DUMP_NOSPC,		/* No space left in requested file. */
 	UCLUE_DUMP_WRITEFAIL,	/* Generic failure to write to requested file. */
+	/* Added in 1.1; new errors go at the end to keep the values stable. */
+	UCLUE_BUSY,				/* Evaluation already in progress. */
+	UCLUE_CHECKPOINT,		/* Checkpoint already taken. */
+	UCLUE_NOCHECKPOINT,		/* No checkpoint to roll back to. */
+	UCLUE_BADPATH,			/* Malformed lookup path. */
+	UCLUE_NOTFOUND,			/* Nothing at lookup path. */
+	UCLUE_TOODEEP,			/* Tables nested too deeply. */
+	UCLUE_CYCLE,			/* Table refers back to itself. */
+	UCLUE_NOPROFILE,		/* Profiling not enabled. */
+	UCLUE_BADSCHEMA,		/* Schema could not be compiled. */
+	UCLUE_SCHEMA,			/* Schema validation failed. */
+	UCLUE_DUMP_NOSTREAM,	/* Output can't be streamed. */
+	UCLUE_GC_UNSUPPORTED,	/* Collector mode not supported. */
 } uclua_error;
 
+typedef enum uclua_step {
+	UCLUAS_DONE = 0,
+	UCLUAS_AGAIN,
+	UCLUAS_ERROR,
+} uclua_step;
+
+/*
+ * One destination for uclua_dump_outputs(); `status` (0 or an errno) and
+ * `error` are filled in for each.
+ */
+struct uclua_output {
+	uclua_dump_type	 type;
+	FILE		*file;
+	int		 status;
+	uclua_error	 error;
+};
+
+/* uclua_dump_outputs() flags */
+#define	UCLUA_DUMP_THREADED	0x0001	/* Emit outputs in parallel. */
+
+typedef enum uclua_gc_mode {
+	UCLUA_GC_DEFAULT = 0,		/* Leave the mode and parameters be. */
+	UCLUA_GC_INCREMENTAL,
+	UCLUA_GC_GENERATIONAL,		/* Lua 5.4 and later. */
+} uclua_gc_mode;
+
+/* uclua_gc_policy flags */
+#define	UCLUA_GC_PARSE_STOP	0x0001	/* Stop collecting during evaluation. */
+#define	UCLUA_GC_RESET_COLLECT	0x0002	/* Collect fully at uclua_reset(). */
+
+/*
+ * Collector settings for uclua_set_gc_policy(); `pause` and `stepmul` are only
+ * used for UCLUA_GC_INCREMENTAL, where zero keeps the current value.
+ */
+struct uclua_gc_policy {
+	uclua_gc_mode	 mode;
+	int		 pause;
+	int		 stepmul;
+	int		 flags;
+};
+
+/* Flat snapshots, as written by UCLUAD_SNAPSHOT */
+struct uclua_snapshot;
+typedef struct uclua_snapnode uclua_snapnode;
+
+/* Frozen path index over a converted tree */
+struct uclua_index;
+typedef struct uclua_path uclua_path;
+
 lcookie_t *uclua_new(void);
 bool uclua_set_sandbox(lcookie_t *, const char *);
+void uclua_sandbox_flush(lcookie_t *);
+void uclua_set_max_depth(lcookie_t *, unsigned int);
+void uclua_set_profile(lcookie_t *, int);
+void uclua_set_footprint(lcookie_t *, bool);
+void uclua_set_lazy_require(lcookie_t *, bool);
+void uclua_set_module_cache(lcookie_t *, bool);
+void uclua_add_library(lcookie_t *, const char *);
+void uclua_set_threads(lcookie_t *, unsigned int);
+bool uclua_set_gc_policy(lcookie_t *, const struct uclua_gc_policy *);
+bool uclua_set_schema(lcookie_t *, const ucl_object_t *);
+void uclua_set_hash(lcookie_t *, bool);
+const char *uclua_schema_error(lcookie_t *);
 bool uclua_parse_file(lcookie_t *, FILE *);
+bool uclua_parse_begin(lcookie_t *, FILE *);
+uclua_step uclua_parse_step(lcookie_t *, int);
+bool uclua_parse_finish(lcookie_t *);
 ucl_object_t *uclua_ucl(lcookie_t *);
+uclua_step uclua_ucl_step(lcookie_t *, int);
+ucl_object_t *uclua_lookup(lcookie_t *, const char *);
+ucl_object_t *uclua_diff(lcookie_t *, lcookie_t *);
 int uclua_dump(lcookie_t *, uclua_dump_type, FILE *);
+int uclua_dump_ucl(lcookie_t *, const ucl_object_t *, uclua_dump_type, FILE *);
+int uclua_dump_stream(lcookie_t *, uclua_dump_type, FILE *);
+int uclua_dump_outputs(lcookie_t *, const ucl_object_t *, struct uclua_output *,
+    size_t, int);
+bool uclua_checkpoint(lcookie_t *);
+bool uclua_rollback(lcookie_t *);
+ucl_object_t *uclua_profile(lcookie_t *);
+int uclua_profile_folded(lcookie_t *, FILE *);
+ucl_object_t *uclua_footprint(lcookie_t *, unsigned int);
+ucl_object_t *uclua_gc_stats(lcookie_t *);
 void uclua_reset(lcookie_t *);
 void uclua_free(lcookie_t *);
 
+struct uclua_snapshot *uclua_snapshot_open(const char *);
+void uclua_snapshot_close(struct uclua_snapshot *);
+const uclua_snapnode *uclua_snapshot_root(const struct uclua_snapshot *);
+const uclua_snapnode *uclua_snapshot_lookup(const struct uclua_snapshot *,
+    const uclua_snapnode *, const char *);
+const uclua_snapnode *uclua_snapshot_iterate(const struct uclua_snapshot *,
+    const uclua_snapnode *, size_t *, const char **);
+ucl_type_t uclua_snapshot_type(const uclua_snapnode *);
+size_t uclua_snapshot_count(const uclua_snapnode *);
+int64_t uclua_snapshot_toint(const uclua_snapnode *);
+double uclua_snapshot_todouble(const uclua_snapnode *);
+bool uclua_snapshot_toboolean(const uclua_snapnode *);
+const char *uclua_snapshot_tostring(const struct uclua_snapshot *,
+    const uclua_snapnode *, size_t *);
+
+struct uclua_index *uclua_index_new(const ucl_object_t *);
+void uclua_index_free(struct uclua_index *);
+const uclua_path *uclua_path_compile(const struct uclua_index *, const char *);
+const ucl_object_t *uclua_path_object(const uclua_path *);
+ucl_type_t uclua_path_type(const uclua_path *);
+size_t uclua_path_count(const uclua_path *);
+int64_t uclua_path_toint(const uclua_path *);
+double uclua_path_todouble(const uclua_path *);
+bool uclua_path_toboolean(const uclua_path *);
+const char *uclua_path_tostring(const uclua_path *, size_t *);
+
 uclua_error uclua_get_error(lcookie_t *);
 const char *uclua_error_string(uclua_error);
 
@@ -33,6 +33,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <luaconf.h>
@@ -44,6 +45,7 @@
 #include "luclua_internal.h"
 
 #define	LCOOKIE_IDX		"uclua_cookie"
+#define	LTHREAD_IDX		"uclua_thread"
 
 typedef void lualib_modify_fn(lcookie_t *);
 
@@ -56,29 +58,44 @@ static const struct uclua_lualib {
 } dflibs[] = {
 	{ .lib = {"_G", luaopen_base}, .modifier = uclua_modify_base },
 	{ .lib = {LUA_LOADLIBNAME, luaopen_package}, .modifier = uclua_modify_load },
+#if LUA_VERSION_NUM >= 502
+	/* 5.1 opens coroutine as part of the base library. */
 	{ .lib = {LUA_COLIBNAME, luaopen_coroutine} },
+#endif
 	{ .lib = {LUA_TABLIBNAME, luaopen_table} },
 	/* { .lib = {LUA_IOLIBNAME, luaopen_io} }, */
 	/* { .lib = {LUA_OSLIBNAME, luaopen_os} }, */
 	{ .lib = {LUA_STRLIBNAME, luaopen_string} },
 	{ .lib = {LUA_MATHLIBNAME, luaopen_math} },
+#if defined(LUA_UTF8LIBNAME)
 	{ .lib = {LUA_UTF8LIBNAME, luaopen_utf8} },
+#endif
 	/* {LUA_DBLIBNAME, luaopen_debug} }, */
-#if defined(LUA_COMPAT_BITLIB)
+#if defined(LUAJIT_VERSION)
+	{ .lib = {LUA_BITLIBNAME, luaopen_bit} },
+#elif defined(LUA_COMPAT_BITLIB)
 	{ .lib = {LUA_BITLIBNAME, luaopen_bit32} },
 #endif
 /*	{ .lib = {"ucl", luaopen_ucl} }, */
 };
 
+/* Without fload_file, the chunk is read from fload_mem instead. */
 struct uclua_floader {
-	char	 fload_buff[BUFSIZ];
-	FILE	*fload_file;
-	bool	 fload_eof;
-	bool	 fload_error;
+	char		 fload_buff[BUFSIZ];
+	FILE		*fload_file;
+	const char	*fload_mem;
+	size_t		 fload_memlen;
+	size_t		 fload_nbytes;
+	bool		 fload_eof;
+	bool		 fload_error;
 };
 
 static void uclua_init_state(lcookie_t *);
+static int uclua_load_chunk(lcookie_t *, lua_State *, struct uclua_floader *,
+    const char *);
 static const char *uclua_read_file(lua_State *, void *, size_t *);
+static void uclua_required_add(lua_State *, const char *);
+static void uclua_required_reset(lcookie_t *);
 
 lcookie_t *
 uclua_new(void)
@@ -97,7 +114,9 @@ uclua_new(void)
 
 	lcook->L = L;
 	lcook->dirfd = -1;
+	lcook->max_depth = UCLUA_DEFAULT_MAX_DEPTH;
 	uclua_init_state(lcook);
+	uclua_gc_init(lcook);
 
 	*(lcookie_t **)lua_newuserdata(L, sizeof(lcook)) = lcook;
 	lua_setfield(L, LUA_REGISTRYINDEX, LCOOKIE_IDX);
@@ -126,30 +145,52 @@ uclua_set_sandbox(lcookie_t *lcook, const char *dirname)
 			return (uclua_set_error(lcook, UCLUE_SANDBOX_FAILURE));
 		}
 	}
-	if (lcook->dirfd != -1)
+	if (lcook->dirfd != -1) {
+		uclua_sandbox_flush(lcook);
 		close(lcook->dirfd);
+	}
 	lcook->dirfd = fd;
 	return (true);
 }
 
-static int
-uclua_load_file(lcookie_t *lcook, FILE *f, const char *name)
+void
+uclua_set_max_depth(lcookie_t *lcook, unsigned int depth)
+{
+
+	lcook->max_depth = depth;
+}
+
+/*
+ * Load onto the given thread rather than lcook->L; require() may be called from
+ * within the coroutine running a document.
+ */
+int
+uclua_load_file(lcookie_t *lcook, lua_State *L, FILE *f, const char *name)
 {
 	struct uclua_floader fload;
-	lua_State *L;
-	int lerr;
 
-	L = lcook->L;
 	fload.fload_file = f;
 	fload.fload_eof = fload.fload_error = false;
+	return (uclua_load_chunk(lcook, L, &fload, name));
+}
+
+static int
+uclua_load_chunk(lcookie_t *lcook, lua_State *L, struct uclua_floader *fload,
+    const char *name)
+{
+	int lerr;
 
-	lerr = lua_load(L, uclua_read_file, &fload, name, NULL);
+	UCLUA_PROBE1(load_start, name);
+	fload->fload_nbytes = 0;
+	lerr = uclua_load(L, uclua_read_file, fload, name);
+	UCLUA_PROBE3(load_done, name, fload->fload_nbytes,
+	    lerr == LUA_OK && !fload->fload_error);
 	if (lerr != LUA_OK) {
 		lua_pushnil(L);
 		lua_pushvalue(L, -2);
 		(void)uclua_set_error(lcook, UCLUE_LUA_ERROR);
 		return (2);
-	} else if (fload.fload_error) {
+	} else if (fload->fload_error) {
 		lua_pushnil(L);
 		lua_pushstring(L, "i/o error");
 		(void)uclua_set_error(lcook, UCLUE_IO_ERROR);
@@ -157,7 +198,7 @@ uclua_load_file(lcookie_t *lcook, FILE *f, const char *name)
 	}
 
 	lua_getfield(L, LUA_REGISTRYINDEX, LENV_IDX);
-	lua_setupvalue(L, -2, 1);
+	uclua_setenv(L, -2);
 
 	return (1);
 }
@@ -165,32 +206,230 @@ uclua_load_file(lcookie_t *lcook, FILE *f, const char *name)
 bool
 uclua_parse_file(lcookie_t *lcook, FILE *f)
 {
-	lua_State *L;
+
+	if (!uclua_parse_begin(lcook, f))
+		return (false);
+	return (uclua_parse_finish(lcook));
+}
+
+static char *
+uclua_slurp(lcookie_t *lcook, FILE *f, size_t *lenp)
+{
+	char *buf, *nbuf;
+	size_t cap, len, nb;
+
+	buf = NULL;
+	cap = len = 0;
+	do {
+		if (len == cap) {
+			cap = cap == 0 ? BUFSIZ : cap * 2;
+			nbuf = realloc(buf, cap);
+			if (nbuf == NULL) {
+				free(buf);
+				(void)uclua_set_error(lcook, UCLUE_NOMEM);
+				return (NULL);
+			}
+			buf = nbuf;
+		}
+
+		nb = fread(buf + len, 1, cap - len, f);
+		len += nb;
+	} while (nb != 0);
+
+	if (ferror(f)) {
+		free(buf);
+		fprintf(stderr, "i/o error\n");
+		(void)uclua_set_error(lcook, UCLUE_IO_ERROR);
+		return (NULL);
+	}
+
+	*lenp = len;
+	return (buf);
+}
+
+/*
+ * Load the chunk and park it in a fresh coroutine, anchored in the registry
+ * so that it survives until uclua_parse_step() runs it to completion.  Chunks
+ * that only assign literals are evaluated right here instead.
+ */
+bool
+uclua_parse_begin(lcookie_t *lcook, FILE *f)
+{
+	struct uclua_floader fload;
+	lua_State *L, *co;
+	char *buf;
+	size_t len;
 	int lerr;
 
+	if (lcook->co != NULL) {
+		(void)uclua_set_error(lcook, UCLUE_BUSY);
+		return (false);
+	}
+
 	L = lcook->L;
 
 	lua_settop(L, 0);
-	lerr = uclua_load_file(lcook, f, "cfgfile");
+	uclua_gc_parse(lcook, true);
+	if ((buf = uclua_slurp(lcook, f, &len)) == NULL) {
+		uclua_gc_parse(lcook, false);
+		return (false);
+	}
+
+	/* As in uclua_parse_step(), we're about to change the environment. */
+	uclua_ucl_abort(lcook);
+	switch (uclua_literal_load(lcook, buf, len)) {
+	case 1:
+		free(buf);
+		lcook->dirty = true;
+		uclua_gc_parse(lcook, false);
+		return (true);
+	case -1:
+		free(buf);
+		uclua_gc_parse(lcook, false);
+		return (false);
+	}
+
+	fload.fload_file = NULL;
+	fload.fload_mem = buf;
+	fload.fload_memlen = len;
+	fload.fload_eof = fload.fload_error = false;
+	lerr = uclua_load_chunk(lcook, L, &fload, "cfgfile");
+	free(buf);
 	assert(lerr > 0);
-	if (lua_isnil(L, 1)) {
+	if (lua_isnil(L, -lerr)) {
 		assert(lerr > 1);
 		/* XXX Stuff lua errors into lcook. */
 		fprintf(stderr, "%s\n", luaL_tolstring(L, -1, NULL));
+		lua_settop(L, 0);
+		uclua_gc_parse(lcook, false);
 		return (false);
 	}
 
-	lerr = lua_pcall(L, 0, 0, 0);
-	if (lerr != LUA_OK) {
+	co = lua_newthread(L);
+	lua_insert(L, -2);
+	lua_xmove(L, co, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LTHREAD_IDX);
+	lcook->co = co;
+
+	return (true);
+}
+
+static lcookie_t *
+uclua_cookie(lua_State *L)
+{
+	lcookie_t *lcook;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, LCOOKIE_IDX);
+	lcook = *(lcookie_t **)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return (lcook);
+}
+
+/*
+ * Count hook for budgeted evaluation and profiling.  Coroutines the document
+ * creates inherit the hook, but only the document's own coroutine may be
+ * yielded: yielding one of the others would hand whoever resumed it nothing,
+ * e.g. end a generic for early.  Neither can we yield from within a require()d
+ * module being loaded through a C function.  Either way the budget simply
+ * overruns, and we yield on the first count once we're back in lcook->co.
+ */
+static void
+uclua_step_hook(lua_State *L, lua_Debug *ar __unused)
+{
+	lcookie_t *lcook;
+
+	lcook = uclua_cookie(L);
+	if (lcook->prof_interval > 0)
+		uclua_profile_sample(lcook, L);
+
+	if (!lcook->budgeted)
+		return;
+	if (lcook->budget > 0)
+		lcook->budget -= lcook->hook_count;
+	if (lcook->budget <= 0 && L == lcook->co && lua_isyieldable(L))
+		(void)lua_yield(L, 0);
+}
+
+static void
+uclua_parse_release(lcookie_t *lcook)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LTHREAD_IDX);
+	lcook->co = NULL;
+	uclua_gc_parse(lcook, false);
+}
+
+/*
+ * Run the in-flight chunk for roughly `budget` VM instructions; a budget of
+ * zero or less runs it to completion.
+ */
+uclua_step
+uclua_parse_step(lcookie_t *lcook, int budget)
+{
+	lua_State *co;
+	int lerr;
+
+	co = lcook->co;
+	if (co == NULL)
+		return (UCLUAS_DONE);
+
+	/* Any partial conversion would be traversing a table we may mutate. */
+	uclua_ucl_abort(lcook);
+
+	lcook->budget = budget;
+	lcook->budgeted = budget > 0;
+	if (lcook->prof_interval > 0 && (budget <= 0 ||
+	    lcook->prof_interval < budget))
+		lcook->hook_count = lcook->prof_interval;
+	else
+		lcook->hook_count = budget;
+
+	if (lcook->hook_count > 0) {
+		lua_sethook(co, uclua_step_hook, LUA_MASKCOUNT,
+		    lcook->hook_count);
+	} else {
+		lua_sethook(co, NULL, 0, 0);
+	}
+
+	if (lcook->prof_interval > 0)
+		uclua_profile_resume(lcook);
+
+	UCLUA_PROBE(eval_start);
+	lerr = uclua_resume(co, lcook->L, 0);
+	switch (lerr) {
+	case LUA_YIELD:
+		/* Nothing is passed back in from a yield. */
+		lua_settop(co, 0);
+		UCLUA_PROBE1(eval_done, UCLUAS_AGAIN);
+		return (UCLUAS_AGAIN);
+	case LUA_OK:
+		uclua_parse_release(lcook);
+		lcook->dirty = true;
+		UCLUA_PROBE1(eval_done, UCLUAS_DONE);
+		return (UCLUAS_DONE);
+	default:
 		/* XXX Stuff lua errors into lcook. */
-		fprintf(stderr, "pcall error %s\n", luaL_checkstring(L, -1));
+		fprintf(stderr, "pcall error %s\n",
+		    luaL_tolstring(co, -1, NULL));
+		uclua_parse_release(lcook);
 		(void)uclua_set_error(lcook, UCLUE_LUA_ERROR);
-		return (false);
+		UCLUA_PROBE1(eval_done, UCLUAS_ERROR);
+		return (UCLUAS_ERROR);
 	}
+}
 
-	lcook->dirty = true;
+bool
+uclua_parse_finish(lcookie_t *lcook)
+{
+	uclua_step status;
 
-	return (true);
+	while ((status = uclua_parse_step(lcook, 0)) == UCLUAS_AGAIN)
+		continue;
+
+	return (status == UCLUAS_DONE);
 }
 
 void
@@ -200,7 +439,16 @@ uclua_free(lcookie_t *lcook)
 	if (lcook == NULL)
 		return;
 
+	uclua_ucl_abort(lcook);
+	uclua_ucl_free(lcook);
+	uclua_checkpoint_free(lcook);
+	uclua_sandbox_flush(lcook);
+	uclua_schema_release(lcook);
+	uclua_hash_clear(lcook);
+	lcook->gc_closing = true;
 	lua_close(lcook->L);
+	if (lcook->dirfd != -1)
+		close(lcook->dirfd);
 	free(lcook);
 }
 
@@ -226,8 +474,66 @@ uclua_reset(lcookie_t *lcook)
 	lua_setmetatable(L, -2);
 	lua_setfield(L, LUA_REGISTRYINDEX, LENV_IDX);
 
+	if (lcook->co != NULL)
+		uclua_parse_release(lcook);
 	lcook->dirty = false;
+	uclua_ucl_abort(lcook);
 	uclua_ucl_free(lcook);
+	uclua_checkpoint_free(lcook);
+	uclua_hash_clear(lcook);
+	uclua_required_reset(lcook);
+	uclua_modcache_reset(lcook);
+	uclua_gc_reset(lcook);
+}
+
+/*
+ * Note a module the sandbox searcher found, so that uclua_reset() can make the
+ * next require() of it load it again.
+ */
+static void
+uclua_required_add(lua_State *L, const char *name)
+{
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LREQUIRED_IDX) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LREQUIRED_IDX);
+	}
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, name);
+	lua_pop(L, 1);
+}
+
+/*
+ * A module's chunk runs in the environment of the document that first required
+ * it, so neither it nor anything it set there may outlive that document.  Only
+ * the standard libraries stay in package.loaded; modules are only kept across
+ * documents by uclua_set_module_cache().
+ */
+static void
+uclua_required_reset(lcookie_t *lcook)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LREQUIRED_IDX) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+	lua_pushnil(L);
+	while (lua_next(L, -3) != 0) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, -4);
+	}
+	lua_pop(L, 2);
+
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LREQUIRED_IDX);
 }
 
 /*
@@ -254,7 +560,8 @@ uclua_searcher_preload(lua_State *L)
 	const char *name;
 
 	name = luaL_checkstring(L, 1);
-	lua_getfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+	/* package.preload; the registry's _PRELOAD is a 5.2+ thing. */
+	lua_getfield(L, lua_upvalueindex(1), "preload");
 	if (lua_getfield(L, -1, name) == LUA_TNIL) {
 		lua_pushfstring(L, " not preloaded\n");
 		return (1);
@@ -268,10 +575,9 @@ static int
 uclua_searcher_dirfd(lua_State *L)
 {
 	const char *name;
-	char *lname;
 	lcookie_t *lcook;
 	FILE *f;
-	int fd, lerr;
+	int fd, lerr, nres;
 
 	name = luaL_checkstring(L, 1);
 	assert(lua_islightuserdata(L, lua_upvalueindex(2)));
@@ -282,20 +588,26 @@ uclua_searcher_dirfd(lua_State *L)
 		return (1);
 	}
 
-	fd = openat(lcook->dirfd, name, O_RDONLY | O_BENEATH);
+	fd = uclua_sandbox_open(lcook, L, name);
+	UCLUA_PROBE2(resolve, name, fd != -1);
 	if (fd == -1) {
-		lname = NULL;
-		if (asprintf(&lname, "%s.lua", name) == -1) {
-			lua_pushfstring(L, "\tout of memory trying to load '%s'", name);
-			return (1);
-		}
-
-		fd = openat(lcook->dirfd, lname, O_RDONLY | O_BENEATH);
-		free(lname);
+		if (errno == ENOMEM)
+			lua_pushfstring(L, "\tout of memory trying to load "
+			    "'%s'", name);
+		else
+			lua_pushfstring(L, "\tnot found in sandbox: '%s'",
+			    name);
+		return (1);
 	}
 
-	if (fd == -1) {
-		lua_pushfstring(L, "\tnot found in sandbox: '%s'", name);
+	uclua_required_add(L, name);
+
+	if (lcook->module_cache &&
+	    (nres = uclua_modcache_search(lcook, L, name, fd)) != -1)
+		return (nres);
+	if (lcook->lazy_require) {
+		close(fd);
+		uclua_lazy_loader(lcook, L);
 		return (1);
 	}
 
@@ -306,7 +618,7 @@ uclua_searcher_dirfd(lua_State *L)
 		return (1);
 	}
 
-	lerr = uclua_load_file(lcook, f, name);
+	lerr = uclua_load_file(lcook, L, f, name);
 	fclose(f);
 	assert(lerr > 0);
 	if (lua_isnil(L, -lerr)) {
@@ -317,6 +629,8 @@ uclua_searcher_dirfd(lua_State *L)
 
 	/* Nothing extra to pass. */
 	lua_insert(L, -lerr);
+	if (lcook->footprint)
+		uclua_footprint_wrap(lcook, L, name);
 	return (1);
 }
 
@@ -343,9 +657,91 @@ uclua_modify_load(lcookie_t *lcook)
 	lua_pushcclosure(L, uclua_searcher_dirfd, 2);
 	lua_rawseti(L, -2, 2);
 
-	lua_setfield(L, -2, "searchers");
+	lua_setfield(L, -2, UCLUA_SEARCHERS);
+}
+
+/*
+ * __index on _G: open one of the deferred libraries on first reference.  The
+ * library lands in _G and package.loaded just as if it had been opened
+ * upfront, so this only ever fires once per library.
+ */
+static int
+uclua_lazy_index(lua_State *L)
+{
+	const luaL_Reg *lib;
+	const char *name;
+
+	if (lua_type(L, 2) != LUA_TSTRING)
+		return (0);
+
+	name = lua_tostring(L, 2);
+	for (size_t i = 0; i < nitems(dflibs); ++i) {
+		lib = &dflibs[i].lib;
+		if (dflibs[i].modifier != NULL || strcmp(lib->name, name) != 0)
+			continue;
+
+		luaL_requiref(L, lib->name, lib->func, 1);
+		return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * The string library also installs the metatable for strings, so method calls
+ * on a string ("x"):upper() need to trigger it too.  Opening it replaces this
+ * metatable with the real one.
+ */
+static int
+uclua_lazy_string(lua_State *L)
+{
+
+	luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 1);
+	lua_pushvalue(L, 2);
+	lua_gettable(L, -2);
+	return (1);
+}
+
+#if LUA_VERSION_NUM >= 504
+/*
+ * As of 5.4, coercing strings to numbers in arithmetic is also left to the
+ * string metatable.  The operator to retry once the library is open is our
+ * upvalue.
+ */
+static int
+uclua_lazy_arith(lua_State *L)
+{
+	int op;
+
+	op = (int)lua_tointeger(L, lua_upvalueindex(1));
+	lua_settop(L, op == LUA_OPUNM ? 1 : 2);
+	luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 1);
+	lua_pop(L, 1);
+	lua_arith(L, op);
+	return (1);
 }
 
+static const struct {
+	const char	*event;
+	int		 op;
+} uclua_lazy_ops[] = {
+	{ "__add", LUA_OPADD },
+	{ "__sub", LUA_OPSUB },
+	{ "__mul", LUA_OPMUL },
+	{ "__mod", LUA_OPMOD },
+	{ "__pow", LUA_OPPOW },
+	{ "__div", LUA_OPDIV },
+	{ "__idiv", LUA_OPIDIV },
+	{ "__unm", LUA_OPUNM },
+};
+#endif
+
+/*
+ * Only libraries that we need to restrict are opened upfront, so that the
+ * sandbox is in place before any chunk runs; the rest are deferred until
+ * something actually references them.  Most configs are plain literals and
+ * never touch them at all.
+ */
 static void
 uclua_init_state(lcookie_t *lcook)
 {
@@ -357,12 +753,47 @@ uclua_init_state(lcookie_t *lcook)
 	for (size_t i = 0; i < nitems(dflibs); ++i) {
 		libinfo = &dflibs[i];
 		lib = &libinfo->lib;
+		if (libinfo->modifier == NULL)
+			continue;
 		luaL_requiref(L, lib->name, lib->func, 1);
-		if (libinfo->modifier != NULL)
-			(*libinfo->modifier)(lcook);
+		(*libinfo->modifier)(lcook);
 		lua_pop(L, 1);
 	}
 
+	/* require() of a deferred library goes through package.preload. */
+	lua_getglobal(L, LUA_LOADLIBNAME);
+	lua_getfield(L, -1, "preload");
+	for (size_t i = 0; i < nitems(dflibs); ++i) {
+		libinfo = &dflibs[i];
+		lib = &libinfo->lib;
+		if (libinfo->modifier != NULL)
+			continue;
+		lua_pushcfunction(L, lib->func);
+		lua_setfield(L, -2, lib->name);
+	}
+	lua_pop(L, 2);
+
+	lua_pushglobaltable(L);
+	lua_newtable(L);
+	lua_pushcfunction(L, uclua_lazy_index);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "");
+	lua_newtable(L);
+	lua_pushcfunction(L, uclua_lazy_string);
+	lua_setfield(L, -2, "__index");
+#if LUA_VERSION_NUM >= 504
+	for (size_t i = 0; i < nitems(uclua_lazy_ops); ++i) {
+		lua_pushinteger(L, uclua_lazy_ops[i].op);
+		lua_pushcclosure(L, uclua_lazy_arith, 1);
+		lua_setfield(L, -2, uclua_lazy_ops[i].event);
+	}
+#endif
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
+
 	uclua_reset(lcook);
 }
 
@@ -377,6 +808,13 @@ uclua_read_file(lua_State *L __unused, void *data, size_t *size)
 	if (fload->fload_eof)
 		return (NULL);
 
+	if (fload->fload_file == NULL) {
+		fload->fload_eof = true;
+		fload->fload_nbytes = fload->fload_memlen;
+		*size = fload->fload_memlen;
+		return (fload->fload_mem);
+	}
+
 	nb = fread(fload->fload_buff, 1, sizeof(fload->fload_buff),
 	    fload->fload_file);
 
@@ -389,6 +827,7 @@ uclua_read_file(lua_State *L __unused, void *data, size_t *size)
 		fload->fload_eof = true;
 	}
 
+	fload->fload_nbytes += nb;
 	*size = nb;
 	return (fload->fload_buff);
 }
@@ -0,0 +1,970 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Checkpoints freeze the current environment as a base and layer a
+ * copy-on-write overlay over it.  The overlay and every base table reached
+ * through it are represented by empty proxy tables whose metatable carries:
+ *
+ *   __base - the frozen base table being shadowed
+ *   __data - the overlay's own writes, with deletions of base keys recorded as
+ *            tombstones
+ *   __ucl  - the base's converted subtree, shared by conversion for any part of
+ *            the base the overlay didn't touch
+ *   __gen  - checkpoint generation that __ucl is valid for
+ *
+ * Rolling back simply swaps in a fresh, empty overlay.
+ *
+ * Whatever else still references the base, be it package.loaded, an upvalue or
+ * the environment of a function defined before the checkpoint, mustn't be able
+ * to change it behind the overlay's back.  Base tables are thus frozen in
+ * place: their contents move to a new base table, and they become proxies over
+ * that with __frozen set, refusing writes.  Proxies already in the tree are
+ * flattened the same way.  Tables we can't freeze, like the standard libraries,
+ * keep their parents from sharing their conversion.  Freezing is undone once
+ * the checkpoint goes away; values cached by the module cache stay frozen.
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "luclua_internal.h"
+
+#define	LBASE_IDX		"uclua_base"
+#define	LCOWMT_IDX		"uclua_cow_meta"
+#define	LFROZEN_IDX		"uclua_frozen"
+
+/* Marks a base key deleted in the overlay. */
+static char uclua_tombstone;
+
+static int uclua_cow_index(lua_State *);
+static int uclua_cow_newindex(lua_State *);
+static int uclua_cow_pairs(lua_State *);
+static int uclua_cow_len(lua_State *);
+
+static const luaL_Reg uclua_cow_meta[] = {
+	{ "__index", uclua_cow_index },
+	{ "__newindex", uclua_cow_newindex },
+	{ "__pairs", uclua_cow_pairs },
+	{ "__len", uclua_cow_len },
+	{ NULL, NULL },
+};
+
+static bool
+uclua_is_tombstone(lua_State *L, int idx)
+{
+
+	return (lua_touserdata(L, idx) == &uclua_tombstone);
+}
+
+/* Push the overlay data and base tables of the proxy at `idx`. */
+static void
+uclua_cow_tables(lua_State *L, int idx)
+{
+
+	lua_getmetatable(L, idx);
+	lua_getfield(L, -1, "__data");
+	lua_getfield(L, -2, "__base");
+	lua_remove(L, -3);
+}
+
+static const ucl_object_t *
+uclua_cow_ucl(lua_State *L, lcookie_t *lcook, int idx)
+{
+	const ucl_object_t *ucl;
+
+	lua_getmetatable(L, idx);
+	lua_getfield(L, -1, "__gen");
+	lua_getfield(L, -2, "__ucl");
+	ucl = NULL;
+	if (lcook->base != NULL && lua_tointeger(L, -2) == lcook->cow_gen)
+		ucl = lua_touserdata(L, -1);
+	lua_pop(L, 3);
+	return (ucl);
+}
+
+/* Find the converted counterpart of the base entry keyed by `kidx`. */
+static const ucl_object_t *
+uclua_cow_ucl_child(lua_State *L, const ucl_object_t *ucl, int kidx)
+{
+	const ucl_object_t *child;
+	lua_Integer cidx;
+
+	if (ucl == NULL)
+		return (NULL);
+
+	switch (ucl_object_type(ucl)) {
+	case UCL_OBJECT:
+		child = ucl_object_lookup(ucl, luaL_tolstring(L, kidx, NULL));
+		lua_pop(L, 1);
+		return (child);
+	case UCL_ARRAY:
+		if (!lua_isinteger(L, kidx))
+			return (NULL);
+		cidx = lua_tointeger(L, kidx);
+		if (cidx < 1 || cidx > UINT_MAX)
+			return (NULL);
+		return (ucl_array_find_index(ucl, cidx - 1));
+	default:
+		return (NULL);
+	}
+}
+
+static bool
+uclua_cow_frozen(lua_State *L, int idx)
+{
+	bool frozen;
+
+	if (!uclua_cow_proxy(L, idx))
+		return (false);
+
+	lua_getmetatable(L, idx);
+	lua_getfield(L, -1, "__frozen");
+	frozen = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	return (frozen);
+}
+
+/* Push a new proxy metatable over the base table at `bidx`. */
+static void
+uclua_cow_meta_new(lua_State *L, lcookie_t *lcook, int bidx,
+    const ucl_object_t *ucl)
+{
+
+	bidx = lua_absindex(L, bidx);
+	lua_newtable(L);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, LCOWMT_IDX);
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, -5);
+	}
+	lua_pop(L, 1);
+
+	lua_pushvalue(L, bidx);
+	lua_setfield(L, -2, "__base");
+	lua_newtable(L);
+	lua_setfield(L, -2, "__data");
+	if (ucl != NULL) {
+		lua_pushlightuserdata(L, (void *)(uintptr_t)ucl);
+		lua_setfield(L, -2, "__ucl");
+	}
+	lua_pushinteger(L, lcook->cow_gen);
+	lua_setfield(L, -2, "__gen");
+	lua_pushboolean(L, 0);
+	lua_setfield(L, -2, "__metatable");
+}
+
+/* Push a new proxy shadowing the table at `bidx`. */
+static void
+uclua_cow_new(lua_State *L, lcookie_t *lcook, int bidx, const ucl_object_t *ucl)
+{
+
+	/* A frozen table is shadowed through its base, with its conversion. */
+	if (uclua_cow_frozen(L, bidx)) {
+		ucl = uclua_cow_ucl(L, lcook, bidx);
+		lua_getmetatable(L, bidx);
+		lua_getfield(L, -1, "__base");
+		lua_remove(L, -2);
+	} else {
+		lua_pushvalue(L, bidx);
+	}
+
+	lua_newtable(L);
+	uclua_cow_meta_new(L, lcook, -2, ucl);
+	lua_setmetatable(L, -2);
+	lua_remove(L, -2);
+}
+
+static int
+uclua_cow_index(lua_State *L)
+{
+	lcookie_t *lcook;
+	const ucl_object_t *ucl;
+
+	lcook = lua_touserdata(L, lua_upvalueindex(1));
+	lua_settop(L, 2);
+	uclua_cow_tables(L, 1);		/* 3: data, 4: base */
+
+	lua_pushvalue(L, 2);
+	if (lua_rawget(L, 3) != LUA_TNIL) {
+		if (uclua_is_tombstone(L, -1))
+			lua_pushnil(L);
+		return (1);
+	}
+	lua_pop(L, 1);
+
+	/* Tables in a frozen base are frozen themselves, or never will be. */
+	if (uclua_cow_frozen(L, 1)) {
+		lua_pushvalue(L, 2);
+		lua_gettable(L, 4);
+		return (1);
+	}
+
+	lua_pushvalue(L, 2);
+	switch (lua_rawget(L, 4)) {
+	case LUA_TTABLE:
+		/* Shadow it as well, so that writes land in the overlay. */
+		ucl = uclua_cow_ucl_child(L, uclua_cow_ucl(L, lcook, 1), 2);
+		uclua_cow_new(L, lcook, -1, ucl);
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, 3);
+		return (1);
+	case LUA_TNIL:
+		/* Defer to the base's metatable, i.e. _G for the env. */
+		lua_pop(L, 1);
+		lua_pushvalue(L, 2);
+		lua_gettable(L, 4);
+		return (1);
+	default:
+		return (1);
+	}
+}
+
+static int
+uclua_cow_newindex(lua_State *L)
+{
+
+	lua_settop(L, 3);
+	if (uclua_cow_frozen(L, 1))
+		return (luaL_error(L, "attempt to modify a frozen table"));
+	uclua_cow_tables(L, 1);		/* 4: data, 5: base */
+
+	lua_pushvalue(L, 2);
+	if (lua_isnil(L, 3)) {
+		lua_pushvalue(L, 2);
+		if (lua_rawget(L, 5) != LUA_TNIL)
+			lua_pushlightuserdata(L, &uclua_tombstone);
+		else
+			lua_pushnil(L);
+		lua_remove(L, -2);
+	} else {
+		lua_pushvalue(L, 3);
+	}
+
+	lua_rawset(L, 4);
+	return (0);
+}
+
+/*
+ * Traverse the overlay first, then whatever's left of the base.  Keys found in
+ * the overlay are always overlay keys, as uclua_cow_pairs() has already
+ * shadowed every table in the base.
+ */
+static int
+uclua_cow_next(lua_State *L)
+{
+	bool indata;
+
+	lua_settop(L, 2);
+	uclua_cow_tables(L, 1);		/* 3: data, 4: base */
+
+	indata = lua_isnil(L, 2);
+	if (!indata) {
+		lua_pushvalue(L, 2);
+		indata = lua_rawget(L, 3) != LUA_TNIL;
+		lua_pop(L, 1);
+	}
+
+	lua_pushvalue(L, 2);
+	if (indata) {
+		while (lua_next(L, 3) != 0) {
+			if (!uclua_is_tombstone(L, -1))
+				return (2);
+			lua_pop(L, 1);
+		}
+
+		lua_pushnil(L);
+	}
+
+	while (lua_next(L, 4) != 0) {
+		lua_pushvalue(L, -2);
+		if (lua_rawget(L, 3) == LUA_TNIL) {
+			lua_pop(L, 1);
+			return (2);
+		}
+		lua_pop(L, 2);
+	}
+
+	lua_pushnil(L);
+	return (1);
+}
+
+static int
+uclua_cow_pairs(lua_State *L)
+{
+
+	lua_settop(L, 1);
+	uclua_cow_tables(L, 1);		/* 2: data, 3: base */
+
+	lua_pushnil(L);
+	while (lua_next(L, 3) != 0) {
+		if (lua_type(L, -1) == LUA_TTABLE) {
+			lua_pushvalue(L, -2);
+			lua_gettable(L, 1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+
+	lua_pushcfunction(L, uclua_cow_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return (3);
+}
+
+static int
+uclua_cow_len(lua_State *L)
+{
+	lua_Integer n;
+
+	lua_settop(L, 1);
+	uclua_cow_tables(L, 1);		/* 2: data, 3: base */
+
+	for (n = 0;; n++) {
+		if (lua_rawgeti(L, 2, n + 1) != LUA_TNIL) {
+			if (uclua_is_tombstone(L, -1))
+				break;
+		} else if (lua_rawgeti(L, 3, n + 1) == LUA_TNIL) {
+			break;
+		} else {
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+
+	lua_pushinteger(L, n);
+	return (1);
+}
+
+bool
+uclua_cow_proxy(lua_State *L, int idx)
+{
+	bool proxy;
+
+	if (!lua_getmetatable(L, idx))
+		return (false);
+
+	lua_pushliteral(L, "__index");
+	lua_rawget(L, -2);
+	proxy = lua_tocfunction(L, -1) == uclua_cow_index;
+	lua_pop(L, 2);
+	return (proxy);
+}
+
+/*
+ * lua_rawget() of the merged view for the key at the top of the stack, without
+ * shadowing anything.
+ */
+int
+uclua_cow_rawget(lua_State *L, int idx)
+{
+	int ltype;
+
+	idx = lua_absindex(L, idx);
+	if (!uclua_cow_proxy(L, idx))
+		return (lua_rawget(L, idx));
+
+	uclua_cow_tables(L, idx);
+	lua_pushvalue(L, -3);
+	ltype = lua_rawget(L, -3);
+	if (ltype == LUA_TNIL) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -3);
+		ltype = lua_rawget(L, -2);
+	} else if (uclua_is_tombstone(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		ltype = LUA_TNIL;
+	}
+
+	lua_replace(L, -4);
+	lua_pop(L, 2);
+	return (ltype);
+}
+
+/*
+ * The merged view is an array if its live keys are exactly 1..n, mirroring
+ * uclua_is_array() for plain tables.
+ */
+static bool
+uclua_cow_is_array(lua_State *L, int didx, int bidx, lua_Integer *np)
+{
+	lua_Integer cidx, count, max;
+	int tidx;
+
+	count = max = 0;
+	for (tidx = didx; tidx <= bidx; tidx++) {
+		lua_pushnil(L);
+		while (lua_next(L, tidx) != 0) {
+			if (tidx == didx) {
+				if (uclua_is_tombstone(L, -1)) {
+					lua_pop(L, 1);
+					continue;
+				}
+			} else {
+				lua_pushvalue(L, -2);
+				if (lua_rawget(L, didx) != LUA_TNIL) {
+					lua_pop(L, 2);
+					continue;
+				}
+				lua_pop(L, 1);
+			}
+
+			if (!lua_isinteger(L, -2) ||
+			    (cidx = lua_tointeger(L, -2)) < 1) {
+				lua_pop(L, 2);
+				return (false);
+			}
+
+			count++;
+			if (cidx > max)
+				max = cidx;
+			lua_pop(L, 1);
+		}
+	}
+
+	*np = count;
+	return (count == max);
+}
+
+/* Add a reference to an already converted base subtree to `obj`. */
+static bool
+uclua_cow_share(lcookie_t *lcook, ucl_object_t *obj, const ucl_object_t *child,
+    bool array)
+{
+	ucl_object_t *val;
+	const char *key;
+	size_t keylen;
+	bool inserted;
+
+	val = ucl_object_ref(child);
+	if (array) {
+		inserted = ucl_array_append(obj, val);
+	} else {
+		key = ucl_object_keyl(val, &keylen);
+		inserted = ucl_object_insert_key(obj, val, key, keylen, false);
+	}
+
+	if (!inserted) {
+		ucl_object_unref(val);
+		(void)uclua_set_error(lcook, UCLUE_MUTATE);
+		return (false);
+	}
+
+	return (true);
+}
+
+static bool
+uclua_cow_process_array(lcookie_t *lcook, ucl_object_t *obj,
+    const ucl_object_t *ucl, lua_Integer n, int didx, int bidx)
+{
+	lua_State *L;
+	const ucl_object_t *child;
+
+	L = lcook->L;
+	if (ucl != NULL && ucl_object_type(ucl) != UCL_ARRAY)
+		ucl = NULL;
+
+	for (lua_Integer i = 1; i <= n; i++) {
+		lua_pushinteger(L, i);
+		if (lua_rawgeti(L, didx, i) == LUA_TNIL) {
+			lua_pop(L, 1);
+			child = uclua_cow_ucl_child(L, ucl, lua_gettop(L));
+			if (child != NULL) {
+				if (!uclua_cow_share(lcook, obj, child, true))
+					return (false);
+				lua_pop(L, 1);
+				continue;
+			}
+
+			lua_rawgeti(L, bidx, i);
+		}
+
+		if (!uclua_process_entry(lcook, obj, true))
+			return (false);
+		lua_pop(L, 2);
+	}
+
+	return (true);
+}
+
+static bool
+uclua_cow_process_object(lcookie_t *lcook, ucl_object_t *obj,
+    const ucl_object_t *ucl, int didx, int bidx)
+{
+	lua_State *L;
+	const ucl_object_t *child;
+
+	L = lcook->L;
+	if (ucl != NULL && ucl_object_type(ucl) != UCL_OBJECT)
+		ucl = NULL;
+
+	/* Tombstones have no processor and are skipped. */
+	lua_pushnil(L);
+	while (lua_next(L, didx) != 0) {
+		if (!uclua_process_entry(lcook, obj, false))
+			return (false);
+		lua_pop(L, 1);
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, bidx) != 0) {
+		lua_pushvalue(L, -2);
+		if (lua_rawget(L, didx) != LUA_TNIL) {
+			lua_pop(L, 2);
+			continue;
+		}
+		lua_pop(L, 1);
+
+		child = uclua_cow_ucl_child(L, ucl, lua_gettop(L) - 1);
+		if (child != NULL) {
+			if (!uclua_cow_share(lcook, obj, child, false))
+				return (false);
+		} else if (!uclua_process_entry(lcook, obj, false)) {
+			return (false);
+		}
+		lua_pop(L, 1);
+	}
+
+	return (true);
+}
+
+ucl_object_t *
+uclua_cow_process(lcookie_t *lcook, int idx)
+{
+	lua_State *L;
+	const ucl_object_t *ucl;
+	ucl_object_t *obj;
+	lua_Integer n;
+	int didx, bidx;
+	bool array, ok;
+
+	L = lcook->L;
+	if ((lcook->max_depth != 0 && lcook->depth + 1 > lcook->max_depth) ||
+	    lcook->recursion == UCLUA_MAX_RECURSION) {
+		(void)uclua_set_error(lcook, UCLUE_TOODEEP);
+		return (NULL);
+	} else if (!lua_checkstack(L, LUA_MINSTACK)) {
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (NULL);
+	}
+
+	idx = lua_absindex(L, idx);
+	ucl = uclua_cow_ucl(L, lcook, idx);
+	uclua_cow_tables(L, idx);
+	bidx = lua_gettop(L);
+	didx = bidx - 1;
+
+	array = uclua_cow_is_array(L, didx, bidx, &n);
+	obj = ucl_object_typed_new(array ? UCL_ARRAY : UCL_OBJECT);
+	if (obj == NULL) {
+		lua_settop(L, didx - 1);
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (NULL);
+	}
+
+	lcook->depth++;
+	lcook->recursion++;
+	if (array)
+		ok = uclua_cow_process_array(lcook, obj, ucl, n, didx, bidx);
+	else
+		ok = uclua_cow_process_object(lcook, obj, ucl, didx, bidx);
+	lcook->recursion--;
+	lcook->depth--;
+	lua_settop(L, didx - 1);
+	if (!ok) {
+		ucl_object_unref(obj);
+		return (NULL);
+	}
+
+	return (obj);
+}
+
+static void
+uclua_cow_init(lcookie_t *lcook, lua_State *L)
+{
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LCOWMT_IDX) == LUA_TNIL) {
+		lua_newtable(L);
+		lua_pushlightuserdata(L, lcook);
+		luaL_setfuncs(L, uclua_cow_meta, 1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LCOWMT_IDX);
+	}
+	lua_pop(L, 1);
+}
+
+/* Copy the entries of the table at `from` to the one at `to`. */
+static void
+uclua_cow_copy(lua_State *L, int from, int to)
+{
+
+	from = lua_absindex(L, from);
+	to = lua_absindex(L, to);
+	lua_pushnil(L);
+	while (lua_next(L, from) != 0) {
+		lua_pushvalue(L, -2);
+		if (uclua_is_tombstone(L, -2))
+			lua_pushnil(L);
+		else
+			lua_pushvalue(L, -2);
+		lua_rawset(L, to);
+		lua_pop(L, 1);
+	}
+}
+
+/*
+ * Push the table of tables freezing mustn't touch, mapped to false: _G and the
+ * standard libraries, i.e. anything in package.loaded that the sandbox
+ * searcher didn't load.
+ */
+static void
+uclua_cow_seen(lua_State *L)
+{
+	bool required;
+
+	lua_newtable(L);
+	lua_pushglobaltable(L);
+	lua_pushboolean(L, 0);
+	lua_rawset(L, -3);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, LREQUIRED_IDX);
+	lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		required = false;
+		if (lua_istable(L, -4)) {
+			lua_pushvalue(L, -2);
+			required = lua_rawget(L, -5) != LUA_TNIL;
+			lua_pop(L, 1);
+		}
+
+		if (!required && lua_type(L, -1) == LUA_TTABLE) {
+			lua_pushboolean(L, 0);
+			lua_rawset(L, -6);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 2);
+}
+
+/*
+ * Freeze the table at `idx` along with every table reachable from it.  `ucl` is
+ * its conversion, if any, kept for sharing only if the whole tree could be
+ * frozen; that's also what we return.  `seen` is the table from
+ * uclua_cow_seen(), which collects everything we've been through, and `fidx`
+ * is a list to record frozen tables in for uclua_cow_thaw(), or 0.  Only the
+ * environment, `root`, may come with a metatable.
+ */
+static bool
+uclua_cow_freeze_table(lcookie_t *lcook, lua_State *L, int idx,
+    const ucl_object_t *ucl, int seen, int fidx, bool root)
+{
+	const ucl_object_t *child;
+	int sidx;
+	bool frozen, proxy;
+
+	idx = lua_absindex(L, idx);
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, seen) != LUA_TNIL) {
+		frozen = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		return (frozen);
+	}
+	lua_pop(L, 1);
+
+	frozen = uclua_cow_frozen(L, idx);
+	if (frozen)
+		goto out;
+
+	proxy = uclua_cow_proxy(L, idx);
+	if (!proxy && !root && lua_getmetatable(L, idx)) {
+		lua_pop(L, 1);
+		goto out;
+	} else if (!lua_checkstack(L, LUA_MINSTACK)) {
+		goto out;
+	}
+	frozen = true;
+
+	/* Cycles will have to do without sharing. */
+	lua_pushvalue(L, idx);
+	lua_pushboolean(L, 0);
+	lua_rawset(L, seen);
+
+	lua_newtable(L);
+	sidx = lua_gettop(L);
+	if (proxy) {
+		uclua_cow_tables(L, idx);
+		uclua_cow_copy(L, -1, sidx);
+		uclua_cow_copy(L, -2, sidx);
+		lua_pop(L, 2);
+	} else {
+		uclua_cow_copy(L, idx, sidx);
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, sidx) != 0) {
+		if (lua_type(L, -1) == LUA_TTABLE) {
+			child = uclua_cow_ucl_child(L, ucl, lua_gettop(L) - 1);
+			if (!uclua_cow_freeze_table(lcook, L, -1, child, seen,
+			    fidx, false))
+				frozen = false;
+		}
+		lua_pop(L, 1);
+	}
+	if (!frozen)
+		ucl = NULL;
+
+	if (proxy) {
+		lua_getmetatable(L, idx);
+		lua_getfield(L, -1, "__base");
+		lua_setfield(L, -2, "__vbase");
+		lua_getfield(L, -1, "__data");
+		lua_setfield(L, -2, "__vdata");
+		lua_pushvalue(L, sidx);
+		lua_setfield(L, -2, "__base");
+		lua_newtable(L);
+		lua_setfield(L, -2, "__data");
+		if (ucl != NULL)
+			lua_pushlightuserdata(L, (void *)(uintptr_t)ucl);
+		else
+			lua_pushnil(L);
+		lua_setfield(L, -2, "__ucl");
+		lua_pushinteger(L, lcook->cow_gen);
+		lua_setfield(L, -2, "__gen");
+	} else {
+		/* The environment's metatable goes along, for its __index. */
+		if (lua_getmetatable(L, idx))
+			lua_setmetatable(L, sidx);
+		lua_pushnil(L);
+		while (lua_next(L, sidx) != 0) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, idx);
+		}
+
+		uclua_cow_meta_new(L, lcook, sidx, ucl);
+		lua_pushvalue(L, -1);
+		lua_setmetatable(L, idx);
+	}
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "__frozen");
+	lua_pop(L, 2);
+
+	if (fidx != 0) {
+		lua_pushvalue(L, idx);
+		lua_rawseti(L, fidx, (lua_Integer)lua_rawlen(L, fidx) + 1);
+	}
+
+out:
+	lua_pushvalue(L, idx);
+	lua_pushboolean(L, frozen);
+	lua_rawset(L, seen);
+	return (frozen);
+}
+
+/* Undo the freezing done for the checkpoint. */
+static void
+uclua_cow_thaw(lua_State *L)
+{
+	size_t n;
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LFROZEN_IDX) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	n = lua_rawlen(L, -1);
+	for (size_t i = 1; i <= n; i++) {
+		lua_rawgeti(L, -1, (lua_Integer)i);
+		lua_getmetatable(L, -1);
+		if (lua_getfield(L, -1, "__vbase") != LUA_TNIL) {
+			lua_setfield(L, -2, "__base");
+			lua_getfield(L, -1, "__vdata");
+			lua_setfield(L, -2, "__data");
+			lua_pushnil(L);
+			lua_setfield(L, -2, "__vbase");
+			lua_pushnil(L);
+			lua_setfield(L, -2, "__vdata");
+			lua_pushnil(L);
+			lua_setfield(L, -2, "__ucl");
+			lua_pushnil(L);
+			lua_setfield(L, -2, "__frozen");
+			lua_pop(L, 2);
+			continue;
+		}
+
+		lua_pop(L, 1);
+		lua_getfield(L, -1, "__base");
+		uclua_cow_copy(L, -1, -3);
+		if (!lua_getmetatable(L, -1))
+			lua_pushnil(L);
+		lua_setmetatable(L, -4);
+		lua_pop(L, 3);
+	}
+	lua_pop(L, 1);
+
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LFROZEN_IDX);
+}
+
+/* Freeze the value at `idx` for good, to share it between documents. */
+void
+uclua_cow_freeze(lcookie_t *lcook, lua_State *L, int idx)
+{
+
+	idx = lua_absindex(L, idx);
+	if (lua_type(L, idx) != LUA_TTABLE)
+		return;
+
+	uclua_cow_init(lcook, L);
+	uclua_cow_seen(L);
+	(void)uclua_cow_freeze_table(lcook, L, idx, NULL, lua_gettop(L), 0,
+	    false);
+	lua_pop(L, 1);
+}
+
+/*
+ * Push a copy-on-write view of the table at `idx` outside of any checkpoint,
+ * for values shared between documents.
+ */
+void
+uclua_cow_view(lcookie_t *lcook, lua_State *L, int idx)
+{
+
+	idx = lua_absindex(L, idx);
+	uclua_cow_init(lcook, L);
+	uclua_cow_new(L, lcook, idx, NULL);
+}
+
+/* Install a fresh, empty overlay over the checkpointed base. */
+static void
+uclua_cow_overlay(lcookie_t *lcook)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	lua_getfield(L, LUA_REGISTRYINDEX, LBASE_IDX);
+	uclua_cow_new(L, lcook, -1, lcook->base);
+	lua_setfield(L, LUA_REGISTRYINDEX, LENV_IDX);
+	lua_pop(L, 1);
+}
+
+bool
+uclua_checkpoint(lcookie_t *lcook)
+{
+	lua_State *L;
+
+	if (lcook->co != NULL) {
+		(void)uclua_set_error(lcook, UCLUE_BUSY);
+		return (false);
+	} else if (lcook->base != NULL) {
+		(void)uclua_set_error(lcook, UCLUE_CHECKPOINT);
+		return (false);
+	}
+
+	/* We want a conversion to share, even of an empty environment. */
+	if (lcook->ucl == NULL)
+		lcook->dirty = true;
+	if (uclua_ucl(lcook) == NULL)
+		return (false);
+
+	L = lcook->L;
+	uclua_cow_init(lcook, L);
+
+	lcook->base = ucl_object_ref(lcook->ucl);
+	lcook->cow_gen++;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, LENV_IDX);
+	uclua_cow_seen(L);
+	lua_newtable(L);
+	(void)uclua_cow_freeze_table(lcook, L, -3, lcook->base,
+	    lua_gettop(L) - 1, lua_gettop(L), true);
+	lua_setfield(L, LUA_REGISTRYINDEX, LFROZEN_IDX);
+	lua_pop(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LBASE_IDX);
+	uclua_cow_overlay(lcook);
+
+	return (true);
+}
+
+bool
+uclua_rollback(lcookie_t *lcook)
+{
+	lua_State *L;
+	const ucl_object_t *ucl;
+
+	if (lcook->co != NULL) {
+		(void)uclua_set_error(lcook, UCLUE_BUSY);
+		return (false);
+	} else if (lcook->base == NULL) {
+		(void)uclua_set_error(lcook, UCLUE_NOCHECKPOINT);
+		return (false);
+	}
+
+	uclua_ucl_abort(lcook);
+	uclua_cow_overlay(lcook);
+
+	/* The base's conversion only holds if all of it could be frozen. */
+	L = lcook->L;
+	lua_getfield(L, LUA_REGISTRYINDEX, LBASE_IDX);
+	ucl = uclua_cow_ucl(L, lcook, -1);
+	lua_pop(L, 1);
+
+	uclua_ucl_free(lcook);
+	if (ucl != NULL) {
+		lcook->ucl = ucl_object_ref(lcook->base);
+		lcook->dirty = false;
+	} else {
+		lcook->dirty = true;
+	}
+
+	return (true);
+}
+
+void
+uclua_checkpoint_free(lcookie_t *lcook)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	uclua_cow_thaw(L);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LBASE_IDX);
+
+	if (lcook->base == NULL)
+		return;
+	ucl_object_unref(lcook->base);
+	lcook->base = NULL;
+}
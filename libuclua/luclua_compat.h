@@ -0,0 +1,240 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lua backend shims.  We're written against the 5.3 API; anything that the
+ * selected backend (see LUA_BACKEND in the Makefile) lacks or spells
+ * differently is papered over here, so the rest of the library doesn't need to
+ * care.  A LUA_VERSION_NUM of 501 is assumed to be LuaJIT 2.1, which carries
+ * a handful of 5.2 additions (e.g. luaL_setfuncs) on top of the 5.1 API.
+ *
+ * Known LuaJIT limitations: count hooks only fire in the interpreter and
+ * hooks can't yield, so uclua_parse_step() budgets are ignored and --profile
+ * only sees code that hasn't been compiled; tables don't honor __len, so `#`
+ * on a checkpoint overlay proxy yields 0; and __pairs requires a LuaJIT built
+ * with LUAJIT_ENABLE_LUA52COMPAT.
+ */
+
+#ifndef _LUCLUA_COMPAT_H
+#define	_LUCLUA_COMPAT_H
+
+#include <math.h>
+
+#if LUA_VERSION_NUM < 502
+#include <luajit.h>
+#endif
+
+#if LUA_VERSION_NUM >= 502
+#define	UCLUA_SEARCHERS		"searchers"
+#else
+#define	UCLUA_SEARCHERS		"loaders"
+#endif
+
+#if LUA_VERSION_NUM >= 504
+static inline int
+uclua_resume(lua_State *L, lua_State *from, int nargs)
+{
+	int nres;
+
+	return (lua_resume(L, from, nargs, &nres));
+}
+#elif LUA_VERSION_NUM >= 502
+#define	uclua_resume(L, from, nargs)	lua_resume((L), (from), (nargs))
+#else
+#define	uclua_resume(L, from, nargs)	lua_resume((L), (nargs))
+#endif
+
+/* As uclua_resume(), also reporting how many values were yielded/returned. */
+static inline int
+uclua_resume_nres(lua_State *L, lua_State *from, int nargs, int *nres)
+{
+#if LUA_VERSION_NUM >= 504
+
+	return (lua_resume(L, from, nargs, nres));
+#else
+	int status;
+
+	status = uclua_resume(L, from, nargs);
+	*nres = lua_gettop(L);
+	return (status);
+#endif
+}
+
+/* Debug info can only be stripped from 5.3 on. */
+#if LUA_VERSION_NUM >= 503
+#define	uclua_lua_dump(L, writer, data, strip)	\
+	lua_dump((L), (writer), (data), (strip))
+#else
+#define	uclua_lua_dump(L, writer, data, strip)	\
+	lua_dump((L), (writer), (data))
+#endif
+
+#if LUA_VERSION_NUM >= 502
+#define	uclua_load(L, reader, data, name)	\
+	lua_load((L), (reader), (data), (name), NULL)
+#else
+#define	uclua_load(L, reader, data, name)	\
+	lua_load((L), (reader), (data), (name))
+#endif
+
+/* Make the table at the top of the stack the environment of `fidx`. */
+static inline void
+uclua_setenv(lua_State *L, int fidx)
+{
+
+#if LUA_VERSION_NUM >= 502
+	/* _ENV is the sole upvalue of a main chunk. */
+	(void)lua_setupvalue(L, fidx, 1);
+#else
+	(void)lua_setfenv(L, fidx);
+#endif
+}
+
+#if LUA_VERSION_NUM < 503
+/* Integral numbers that fit are treated as integers, as 5.3 would have. */
+static inline int
+uclua_isinteger(lua_State *L, int idx)
+{
+	lua_Number n;
+
+	if (lua_type(L, idx) != LUA_TNUMBER)
+		return (0);
+	n = lua_tonumber(L, idx);
+	return (floor(n) == n && n >= -9223372036854775808.0 &&
+	    n < 9223372036854775808.0);
+}
+#define	lua_isinteger(L, idx)	uclua_isinteger((L), (idx))
+#endif
+
+#if LUA_VERSION_NUM < 502
+#define	LUA_OK			0
+
+#define	lua_pushglobaltable(L)	lua_pushvalue((L), LUA_GLOBALSINDEX)
+
+/* Yielding from hooks isn't supported, so we never try. */
+#define	lua_isyieldable(L)	0
+
+static inline int
+uclua_absindex(lua_State *L, int idx)
+{
+
+	return (idx > 0 || idx <= LUA_REGISTRYINDEX ? idx :
+	    lua_gettop(L) + idx + 1);
+}
+#define	lua_absindex(L, idx)	uclua_absindex((L), (idx))
+
+/* No __len for tables in 5.1, so the raw length is all there is. */
+#define	lua_len(L, idx)		\
+	lua_pushinteger((L), (lua_Integer)lua_objlen((L), (idx)))
+#define	lua_rawlen(L, idx)	lua_objlen((L), (idx))
+
+/* The 5.1 getters don't return the type of what they pushed. */
+static inline int
+uclua_getfield(lua_State *L, int idx, const char *k)
+{
+
+	lua_getfield(L, idx, k);
+	return (lua_type(L, -1));
+}
+
+static inline int
+uclua_gettable(lua_State *L, int idx)
+{
+
+	lua_gettable(L, idx);
+	return (lua_type(L, -1));
+}
+
+static inline int
+uclua_rawget(lua_State *L, int idx)
+{
+
+	lua_rawget(L, idx);
+	return (lua_type(L, -1));
+}
+
+static inline int
+uclua_rawgeti(lua_State *L, int idx, int n)
+{
+
+	lua_rawgeti(L, idx, n);
+	return (lua_type(L, -1));
+}
+
+#define	lua_getfield(L, idx, k)	uclua_getfield((L), (idx), (k))
+#define	lua_gettable(L, idx)	uclua_gettable((L), (idx))
+#define	lua_rawget(L, idx)	uclua_rawget((L), (idx))
+#define	lua_rawgeti(L, idx, n)	uclua_rawgeti((L), (idx), (n))
+
+static inline const char *
+uclua_tolstring(lua_State *L, int idx, size_t *len)
+{
+
+	switch (lua_type(L, idx)) {
+	case LUA_TNUMBER:
+	case LUA_TSTRING:
+		lua_pushvalue(L, idx);
+		break;
+	case LUA_TBOOLEAN:
+		lua_pushstring(L, lua_toboolean(L, idx) ? "true" : "false");
+		break;
+	case LUA_TNIL:
+		lua_pushliteral(L, "nil");
+		break;
+	default:
+		lua_pushfstring(L, "%s: %p", luaL_typename(L, idx),
+		    lua_topointer(L, idx));
+		break;
+	}
+
+	return (lua_tolstring(L, -1, len));
+}
+#define	luaL_tolstring(L, idx, len)	uclua_tolstring((L), (idx), (len))
+
+static inline void
+uclua_requiref(lua_State *L, const char *modname, lua_CFunction openf, int glb)
+{
+
+	lua_pushcfunction(L, openf);
+	lua_pushstring(L, modname);
+	lua_call(L, 1, 1);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+	lua_pushvalue(L, -2);
+	lua_setfield(L, -2, modname);
+	lua_pop(L, 1);
+
+	if (glb) {
+		lua_pushvalue(L, -1);
+		lua_setglobal(L, modname);
+	}
+}
+#define	luaL_requiref(L, modname, openf, glb)	\
+	uclua_requiref((L), (modname), (openf), (glb))
+#endif	/* LUA_VERSION_NUM < 502 */
+
+#endif	/* _LUCLUA_COMPAT_H */
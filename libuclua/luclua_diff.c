@@ -0,0 +1,384 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Structural diff of two converted configurations.  Every subtree gets a
+ * Merkle-style hash: scalars hash their type and value, arrays fold their
+ * elements' hashes in order, and objects sum a mix of each key with its value's
+ * hash so that key order doesn't matter.  A value's own key isn't part of its
+ * hash, so identical tables under different keys hash alike.
+ *
+ * With uclua_set_hash(), hashes are computed as the converter finishes each
+ * node and kept in a table keyed by object address, so diffing only has to
+ * descend where the hashes differ.  Anything missing from the table (e.g.
+ * copies made while sharing, or checkpoint overlays) is hashed on demand.
+ * Entries are dropped whenever a fresh conversion starts; only objects
+ * reachable from lcook->ucl are ever looked up.
+ */
+
+#include <sys/param.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luclua_internal.h"
+
+#define	UCLUA_HASH_MINSLOTS	256
+
+struct uclua_hashent {
+	const ucl_object_t	*obj;
+	uint64_t		 hash;
+};
+
+static uint64_t
+uclua_hash_mix(uint64_t h)
+{
+
+	/* splitmix64 finalizer */
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return (h);
+}
+
+static uint64_t
+uclua_hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p;
+
+	/* FNV-1a */
+	for (p = buf; len > 0; p++, len--) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+static size_t
+uclua_hash_slot(const struct uclua_hashent *ents, size_t nslots,
+    const ucl_object_t *obj)
+{
+	size_t slot;
+
+	slot = uclua_hash_mix((uintptr_t)obj) & (nslots - 1);
+	while (ents[slot].obj != NULL && ents[slot].obj != obj)
+		slot = (slot + 1) & (nslots - 1);
+	return (slot);
+}
+
+static void
+uclua_hash_insert(lcookie_t *lcook, const ucl_object_t *obj, uint64_t hash)
+{
+	struct uclua_hashent *ents;
+	size_t i, nslots, slot;
+
+	if ((lcook->nhashes + 1) * 4 > lcook->maxhashes * 3) {
+		nslots = MAX(lcook->maxhashes * 2, UCLUA_HASH_MINSLOTS);
+		ents = calloc(nslots, sizeof(*ents));
+		if (ents == NULL)
+			return;	/* We'll just have to hash it again. */
+
+		for (i = 0; i < lcook->maxhashes; i++) {
+			if (lcook->hashes[i].obj == NULL)
+				continue;
+			slot = uclua_hash_slot(ents, nslots,
+			    lcook->hashes[i].obj);
+			ents[slot] = lcook->hashes[i];
+		}
+
+		free(lcook->hashes);
+		lcook->hashes = ents;
+		lcook->maxhashes = nslots;
+	}
+
+	slot = uclua_hash_slot(lcook->hashes, lcook->maxhashes, obj);
+	if (lcook->hashes[slot].obj == NULL)
+		lcook->nhashes++;
+	lcook->hashes[slot].obj = obj;
+	lcook->hashes[slot].hash = hash;
+}
+
+void
+uclua_hash_clear(lcookie_t *lcook)
+{
+
+	free(lcook->hashes);
+	lcook->hashes = NULL;
+	lcook->nhashes = lcook->maxhashes = 0;
+}
+
+void
+uclua_set_hash(lcookie_t *lcook, bool enable)
+{
+
+	lcook->hash_tree = enable;
+	if (!enable)
+		uclua_hash_clear(lcook);
+}
+
+/*
+ * Hash of the subtree at `obj`, from the table if we have it.  Called by the
+ * converter on each node it completes, whose children are already in the table.
+ */
+uint64_t
+uclua_hash(lcookie_t *lcook, const ucl_object_t *obj)
+{
+	ucl_object_iter_t it;
+	const ucl_object_t *elt;
+	const char *str;
+	size_t len, slot;
+	uint64_t h, sum;
+	int64_t iv;
+	double dv;
+	ucl_type_t type;
+
+	if (lcook->maxhashes != 0) {
+		slot = uclua_hash_slot(lcook->hashes, lcook->maxhashes, obj);
+		if (lcook->hashes[slot].obj == obj)
+			return (lcook->hashes[slot].hash);
+	}
+
+	type = ucl_object_type(obj);
+	h = uclua_hash_mix(0xcbf29ce484222325ULL + type);
+	switch (type) {
+	case UCL_OBJECT:
+		sum = 0;
+		it = NULL;
+		while ((elt = ucl_object_iterate(obj, &it, true)) != NULL) {
+			str = ucl_object_keyl(elt, &len);
+			sum += uclua_hash_mix(uclua_hash_bytes(h, str, len) ^
+			    uclua_hash_mix(uclua_hash(lcook, elt)));
+		}
+		h = uclua_hash_mix(h ^ sum);
+		break;
+	case UCL_ARRAY:
+		it = NULL;
+		while ((elt = ucl_object_iterate(obj, &it, true)) != NULL)
+			h = uclua_hash_mix(h ^ uclua_hash(lcook, elt));
+		break;
+	case UCL_INT:
+		iv = ucl_object_toint(obj);
+		h = uclua_hash_bytes(h, &iv, sizeof(iv));
+		break;
+	case UCL_FLOAT:
+		dv = ucl_object_todouble(obj);
+		h = uclua_hash_bytes(h, &dv, sizeof(dv));
+		break;
+	case UCL_STRING:
+		str = ucl_object_tolstring(obj, &len);
+		h = uclua_hash_bytes(h, str, len);
+		break;
+	case UCL_BOOLEAN:
+		h = uclua_hash_mix(h + ucl_object_toboolean(obj));
+		break;
+	default:
+		break;
+	}
+
+	uclua_hash_insert(lcook, obj, h);
+	return (h);
+}
+
+struct uclua_diff {
+	lcookie_t	*old;
+	lcookie_t	*new;
+	ucl_object_t	*changes;
+	char		*path;
+	size_t		 pathlen;
+	size_t		 pathcap;
+};
+
+static bool
+uclua_diff_path(struct uclua_diff *diff, const char *key, size_t keylen,
+    size_t idx)
+{
+	char *path;
+	size_t cap, need;
+	int len;
+
+	need = diff->pathlen + (key != NULL ? keylen + 1 : 24) + 1;
+	if (need > diff->pathcap) {
+		cap = MAX(MAX(diff->pathcap * 2, need), 64);
+		path = realloc(diff->path, cap);
+		if (path == NULL)
+			return (false);
+		diff->path = path;
+		diff->pathcap = cap;
+	}
+
+	if (key != NULL) {
+		len = snprintf(diff->path + diff->pathlen,
+		    diff->pathcap - diff->pathlen, "%s%.*s",
+		    diff->pathlen == 0 ? "" : ".", (int)keylen, key);
+	} else {
+		len = snprintf(diff->path + diff->pathlen,
+		    diff->pathcap - diff->pathlen, "[%zu]", idx);
+	}
+
+	diff->pathlen += len;
+	return (true);
+}
+
+/* Record a change at the current path; either side may be missing. */
+static bool
+uclua_diff_record(struct uclua_diff *diff, const char *op,
+    const ucl_object_t *oldv, const ucl_object_t *newv)
+{
+	ucl_object_t *change, *val;
+
+	change = ucl_object_typed_new(UCL_OBJECT);
+	if (change == NULL)
+		return (false);
+
+	if (!ucl_object_insert_key(change, ucl_object_fromstring(op), "op", 0,
+	    false) ||
+	    !ucl_object_insert_key(change, ucl_object_fromlstring(diff->path,
+	    diff->pathlen), "path", 0, false))
+		goto fail;
+
+	/* Values carry their own key, so they can't be shared in here. */
+	if (oldv != NULL && ((val = ucl_object_copy(oldv)) == NULL ||
+	    !ucl_object_insert_key(change, val, "old", 0, false)))
+		goto fail;
+	if (newv != NULL && ((val = ucl_object_copy(newv)) == NULL ||
+	    !ucl_object_insert_key(change, val, "new", 0, false)))
+		goto fail;
+
+	return (ucl_array_append(diff->changes, change));
+fail:
+	ucl_object_unref(change);
+	return (false);
+}
+
+static bool
+uclua_diff_walk(struct uclua_diff *diff, const ucl_object_t *oldv,
+    const ucl_object_t *newv)
+{
+	ucl_object_iter_t it;
+	const ucl_object_t *elt, *other;
+	const char *key;
+	size_t idx, keylen, plen;
+	ucl_type_t type;
+	bool ok;
+
+	type = ucl_object_type(oldv);
+	if (type == ucl_object_type(newv) &&
+	    uclua_hash(diff->old, oldv) == uclua_hash(diff->new, newv))
+		return (true);
+	if (type != ucl_object_type(newv) ||
+	    (type != UCL_OBJECT && type != UCL_ARRAY))
+		return (uclua_diff_record(diff, "change", oldv, newv));
+
+	plen = diff->pathlen;
+	ok = true;
+	if (type == UCL_ARRAY) {
+		for (idx = 0; ok; idx++) {
+			elt = ucl_array_find_index(oldv, idx);
+			other = ucl_array_find_index(newv, idx);
+			if (elt == NULL && other == NULL)
+				break;
+			/* Paths follow Lua, where arrays start at 1. */
+			if (!uclua_diff_path(diff, NULL, 0, idx + 1))
+				return (false);
+			if (elt == NULL)
+				ok = uclua_diff_record(diff, "add", NULL,
+				    other);
+			else if (other == NULL)
+				ok = uclua_diff_record(diff, "remove", elt,
+				    NULL);
+			else
+				ok = uclua_diff_walk(diff, elt, other);
+			diff->pathlen = plen;
+		}
+		return (ok);
+	}
+
+	it = NULL;
+	while (ok && (elt = ucl_object_iterate(oldv, &it, true)) != NULL) {
+		key = ucl_object_keyl(elt, &keylen);
+		if (!uclua_diff_path(diff, key, keylen, 0))
+			return (false);
+		other = ucl_object_lookup_len(newv, key, keylen);
+		if (other == NULL)
+			ok = uclua_diff_record(diff, "remove", elt, NULL);
+		else
+			ok = uclua_diff_walk(diff, elt, other);
+		diff->pathlen = plen;
+	}
+
+	it = NULL;
+	while (ok && (elt = ucl_object_iterate(newv, &it, true)) != NULL) {
+		key = ucl_object_keyl(elt, &keylen);
+		if (ucl_object_lookup_len(oldv, key, keylen) != NULL)
+			continue;
+		if (!uclua_diff_path(diff, key, keylen, 0))
+			return (false);
+		ok = uclua_diff_record(diff, "add", NULL, elt);
+		diff->pathlen = plen;
+	}
+
+	return (ok);
+}
+
+/*
+ * Compare the configurations evaluated in `old` and `new`, converting them as
+ * needed.  The result is an array of { op, path, old, new } changes, with `op`
+ * one of "add", "remove" or "change"; the caller owns it.  Errors are reported
+ * through `old`.
+ */
+ucl_object_t *
+uclua_diff(lcookie_t *old, lcookie_t *new)
+{
+	struct uclua_diff diff;
+	const ucl_object_t *oldv, *newv;
+
+	if ((oldv = uclua_ucl(old)) == NULL)
+		return (NULL);
+	if ((newv = uclua_ucl(new)) == NULL) {
+		(void)uclua_set_error(old, new->error);
+		return (NULL);
+	}
+
+	memset(&diff, 0, sizeof(diff));
+	diff.old = old;
+	diff.new = new;
+	diff.changes = ucl_object_typed_new(UCL_ARRAY);
+	if (diff.changes == NULL || !uclua_diff_path(&diff, "", 0, 0) ||
+	    !uclua_diff_walk(&diff, oldv, newv)) {
+		if (diff.changes != NULL)
+			ucl_object_unref(diff.changes);
+		diff.changes = NULL;
+		(void)uclua_set_error(old, UCLUE_NOMEM);
+	}
+
+	free(diff.path);
+	return (diff.changes);
+}
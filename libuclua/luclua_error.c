@@ -54,6 +54,20 @@ static const char *error2str[] = {
 	[UCLUE_DUMP_EMITFAIL]	= "Failed to emit requested type",
 	[UCLUE_DUMP_NOSPC]		= "No space left in requested file",
 	[UCLUE_DUMP_WRITEFAIL]	= "Generic failure to write to requested file",
+
+	/* Added in 1.1. */
+	[UCLUE_BUSY]		= "Evaluation already in progress",
+	[UCLUE_CHECKPOINT]		= "Checkpoint already taken",
+	[UCLUE_NOCHECKPOINT]	= "No checkpoint to roll back to",
+	[UCLUE_BADPATH]		= "Malformed lookup path",
+	[UCLUE_NOTFOUND]	= "Nothing found at lookup path",
+	[UCLUE_TOODEEP]		= "Maximum table nesting depth exceeded",
+	[UCLUE_CYCLE]		= "Cyclic table reference",
+	[UCLUE_NOPROFILE]	= "Profiling not enabled",
+	[UCLUE_BADSCHEMA]	= "Malformed schema",
+	[UCLUE_SCHEMA]		= "Schema validation failed",
+	[UCLUE_DUMP_NOSTREAM]	= "Output cannot be streamed with a schema set",
+	[UCLUE_GC_UNSUPPORTED]	= "Collector mode not supported by this Lua",
 };
 
 uclua_error
@@ -0,0 +1,321 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Memory footprint report.  The converted tree is walked to estimate the bytes
+ * held by each subtree, and with uclua_set_footprint() enabled every module
+ * loaded from the sandbox is charged with the bytes allocated while its main
+ * chunk ran.  Those are counted by wrapping the state's allocator, as the heap
+ * size would come up short whenever the collector freed something during the
+ * load.  Nested requires are included in their parent's figure.
+ */
+
+#include <sys/param.h>
+
+#include <string.h>
+
+#include "luclua_internal.h"
+
+#define	LFOOT_IDX		"uclua_footprint"
+
+/* Rough per-entry overhead of libucl's object hash. */
+#define	UCLUA_FOOTPRINT_HASHENT	(3 * sizeof(void *))
+
+struct uclua_footprint {
+	size_t	bytes;
+	size_t	nodes;
+};
+
+static void *
+uclua_footprint_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	lcookie_t *lcook;
+	void *nptr;
+
+	lcook = ud;
+	/* Without a block, osize is the type of object being allocated. */
+	if (ptr == NULL)
+		osize = 0;
+	nptr = lcook->foot_allocf(lcook->foot_allocud, ptr, osize, nsize);
+	if (nptr != NULL && nsize > osize)
+		lcook->foot_alloced += nsize - osize;
+	return (nptr);
+}
+
+void
+uclua_set_footprint(lcookie_t *lcook, bool enable)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	if (enable && !lcook->footprint) {
+		lcook->foot_allocf = lua_getallocf(L, &lcook->foot_allocud);
+		lua_setallocf(L, uclua_footprint_alloc, lcook);
+	} else if (!enable && lcook->footprint) {
+		lua_setallocf(L, lcook->foot_allocf, lcook->foot_allocud);
+	}
+	lcook->footprint = enable;
+	if (enable)
+		lua_newtable(L);
+	else
+		lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LFOOT_IDX);
+}
+
+static lua_Integer
+uclua_footprint_heap(lua_State *L)
+{
+
+	return ((lua_Integer)lua_gc(L, LUA_GCCOUNT, 0) * 1024 +
+	    lua_gc(L, LUA_GCCOUNTB, 0));
+}
+
+/*
+ * Stands in for a module's main chunk; upvalues are the chunk, its name and
+ * lcook.
+ */
+static int
+uclua_footprint_load(lua_State *L)
+{
+	lcookie_t *lcook;
+	uint64_t before;
+	lua_Integer delta;
+	int nargs, nres;
+
+	lcook = lua_touserdata(L, lua_upvalueindex(3));
+	nargs = lua_gettop(L);
+	before = lcook->foot_alloced;
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, nargs, LUA_MULTRET);
+	delta = (lua_Integer)(lcook->foot_alloced - before);
+
+	nres = lua_gettop(L);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LFOOT_IDX) == LUA_TTABLE) {
+		lua_pushvalue(L, lua_upvalueindex(2));
+		lua_pushvalue(L, -1);
+		lua_rawget(L, -3);
+		lua_pushinteger(L, lua_tointeger(L, -1) + delta);
+		lua_remove(L, -2);
+		lua_rawset(L, -3);
+	}
+	lua_pop(L, 1);
+	return (nres);
+}
+
+void
+uclua_footprint_wrap(lcookie_t *lcook, lua_State *L, const char *name)
+{
+
+	lua_pushstring(L, name);
+	lua_pushlightuserdata(L, lcook);
+	lua_pushcclosure(L, uclua_footprint_load, 3);
+}
+
+static size_t
+uclua_footprint_self(const ucl_object_t *obj)
+{
+	size_t sz;
+
+	sz = sizeof(*obj);
+	if (obj->key != NULL && (obj->flags & UCL_OBJECT_ALLOCATED_KEY) != 0)
+		sz += obj->keylen + 1;
+
+	switch (obj->type) {
+	case UCL_STRING:
+		sz += obj->len + 1;
+		break;
+	case UCL_OBJECT:
+		sz += obj->len * UCLUA_FOOTPRINT_HASHENT;
+		break;
+	case UCL_ARRAY:
+		sz += obj->len * sizeof(void *);
+		break;
+	default:
+		break;
+	}
+
+	return (sz);
+}
+
+static ucl_object_t *
+uclua_footprint_entry(const struct uclua_footprint *fp, ucl_object_t *keys)
+{
+	ucl_object_t *rep;
+
+	rep = ucl_object_typed_new(UCL_OBJECT);
+	if (rep == NULL)
+		return (NULL);
+
+	if (!ucl_object_insert_key(rep, ucl_object_fromint(fp->bytes), "bytes",
+	    0, false) ||
+	    !ucl_object_insert_key(rep, ucl_object_fromint(fp->nodes), "nodes",
+	    0, false)) {
+		ucl_object_unref(rep);
+		return (NULL);
+	}
+
+	if (keys != NULL && keys->len != 0) {
+		if (!ucl_object_insert_key(rep, ucl_object_ref(keys), "keys", 0,
+		    false)) {
+			ucl_object_unref(keys);
+			ucl_object_unref(rep);
+			return (NULL);
+		}
+	}
+
+	return (rep);
+}
+
+/*
+ * Tally obj and everything beneath it into fp.  With keys, each member of an
+ * object is also reported in keys, recursing for depth levels.  Shared
+ * subtrees are counted once per reference.
+ */
+static bool
+uclua_footprint_count(const ucl_object_t *obj, unsigned int depth,
+    ucl_object_t *keys, struct uclua_footprint *fp)
+{
+	struct uclua_footprint cfp;
+	const ucl_object_t *child, *cur;
+	ucl_object_t *ckeys, *rep;
+	ucl_object_iter_t it;
+	bool ok;
+
+	fp->bytes += uclua_footprint_self(obj);
+	fp->nodes++;
+	if (obj->type != UCL_OBJECT && obj->type != UCL_ARRAY)
+		return (true);
+
+	if (obj->type != UCL_OBJECT)
+		keys = NULL;
+
+	it = NULL;
+	while ((child = ucl_object_iterate(obj, &it, true)) != NULL) {
+		if (keys == NULL) {
+			for (cur = child; cur != NULL; cur = cur->next) {
+				if (!uclua_footprint_count(cur, 0, NULL, fp))
+					return (false);
+			}
+			continue;
+		}
+
+		ckeys = NULL;
+		if (depth > 1) {
+			ckeys = ucl_object_typed_new(UCL_OBJECT);
+			if (ckeys == NULL)
+				return (false);
+		}
+
+		memset(&cfp, 0, sizeof(cfp));
+		ok = true;
+		for (cur = child; cur != NULL && ok; cur = cur->next)
+			ok = uclua_footprint_count(cur, depth - 1, ckeys, &cfp);
+		rep = ok ? uclua_footprint_entry(&cfp, ckeys) : NULL;
+		if (ckeys != NULL)
+			ucl_object_unref(ckeys);
+		if (rep == NULL ||
+		    !ucl_object_insert_key(keys, rep, child->key, child->keylen,
+		    true)) {
+			if (rep != NULL)
+				ucl_object_unref(rep);
+			return (false);
+		}
+
+		fp->bytes += cfp.bytes;
+		fp->nodes += cfp.nodes;
+	}
+
+	return (true);
+}
+
+/*
+ * The report is { bytes, nodes, keys, heap, modules }: the totals for the
+ * whole config, per-key figures down to depth levels, the current Lua heap,
+ * and the heap charged to each module if accounting was enabled.
+ */
+ucl_object_t *
+uclua_footprint(lcookie_t *lcook, unsigned int depth)
+{
+	struct uclua_footprint fp;
+	const ucl_object_t *ucl;
+	ucl_object_t *keys, *mods, *rep;
+	lua_State *L;
+
+	ucl = uclua_ucl(lcook);
+	if (ucl == NULL)
+		return (NULL);
+
+	L = lcook->L;
+	keys = NULL;
+	if (depth > 0) {
+		keys = ucl_object_typed_new(UCL_OBJECT);
+		if (keys == NULL)
+			goto nomem;
+	}
+
+	memset(&fp, 0, sizeof(fp));
+	if (!uclua_footprint_count(ucl, depth, keys, &fp))
+		goto nomem;
+
+	rep = uclua_footprint_entry(&fp, keys);
+	if (keys != NULL)
+		ucl_object_unref(keys);
+	keys = NULL;
+	if (rep == NULL)
+		goto nomem;
+
+	if (!ucl_object_insert_key(rep,
+	    ucl_object_fromint(uclua_footprint_heap(L)), "heap", 0, false)) {
+		ucl_object_unref(rep);
+		goto nomem;
+	}
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LFOOT_IDX) == LUA_TTABLE) {
+		mods = uclua_convert(lcook, -1);
+		lua_pop(L, 1);
+		if (mods == NULL) {
+			ucl_object_unref(rep);
+			return (NULL);
+		}
+
+		if (!ucl_object_insert_key(rep, mods, "modules", 0, false)) {
+			ucl_object_unref(mods);
+			ucl_object_unref(rep);
+			goto nomem;
+		}
+	} else {
+		lua_pop(L, 1);
+	}
+
+	return (rep);
+nomem:
+	if (keys != NULL)
+		ucl_object_unref(keys);
+	(void)uclua_set_error(lcook, UCLUE_NOMEM);
+	return (NULL);
+}
@@ -0,0 +1,163 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Collector policy and statistics.  Lua doesn't count its own cycles, so we
+ * keep an unreachable sentinel userdata around whose finalizer bumps the count
+ * and sets up the next sentinel; it's collected once per cycle, or per minor
+ * collection in generational mode.  Only collections we run ourselves can be
+ * timed.
+ */
+
+#include <stdint.h>
+
+#include "luclua_internal.h"
+
+static void uclua_gc_sentinel(lcookie_t *, lua_State *);
+
+static int
+uclua_gc_finalize(lua_State *L)
+{
+	lcookie_t *lcook;
+
+	lcook = lua_touserdata(L, lua_upvalueindex(1));
+	lcook->gc_cycles++;
+	/* No new sentinel once lua_close() has started finalizing. */
+	if (!lcook->gc_closing)
+		uclua_gc_sentinel(lcook, L);
+	return (0);
+}
+
+static void
+uclua_gc_sentinel(lcookie_t *lcook, lua_State *L)
+{
+
+	(void)lua_newuserdata(L, 1);
+	lua_createtable(L, 0, 1);
+	lua_pushlightuserdata(L, lcook);
+	lua_pushcclosure(L, uclua_gc_finalize, 1);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
+}
+
+void
+uclua_gc_init(lcookie_t *lcook)
+{
+
+	uclua_gc_sentinel(lcook, lcook->L);
+}
+
+bool
+uclua_set_gc_policy(lcookie_t *lcook, const struct uclua_gc_policy *policy)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	switch (policy->mode) {
+	case UCLUA_GC_DEFAULT:
+		break;
+	case UCLUA_GC_INCREMENTAL:
+#if LUA_VERSION_NUM >= 504
+		/* Zero leaves a parameter as it was. */
+		(void)lua_gc(L, LUA_GCINC, policy->pause, policy->stepmul, 0);
+#else
+		if (policy->pause > 0)
+			(void)lua_gc(L, LUA_GCSETPAUSE, policy->pause);
+		if (policy->stepmul > 0)
+			(void)lua_gc(L, LUA_GCSETSTEPMUL, policy->stepmul);
+#endif
+		break;
+	case UCLUA_GC_GENERATIONAL:
+#if LUA_VERSION_NUM >= 504
+		(void)lua_gc(L, LUA_GCGEN, 0, 0);
+		break;
+#endif
+	default:
+		(void)uclua_set_error(lcook, UCLUE_GC_UNSUPPORTED);
+		return (false);
+	}
+
+	lcook->gc_flags = policy->flags;
+	return (true);
+}
+
+/* Called as evaluation of a document starts and stops. */
+void
+uclua_gc_parse(lcookie_t *lcook, bool parsing)
+{
+
+	if ((lcook->gc_flags & UCLUA_GC_PARSE_STOP) == 0)
+		return;
+	(void)lua_gc(lcook->L, parsing ? LUA_GCSTOP : LUA_GCRESTART, 0);
+}
+
+/* Called from uclua_reset(), once the old environment is unreachable. */
+void
+uclua_gc_reset(lcookie_t *lcook)
+{
+	uint64_t start;
+
+	if ((lcook->gc_flags & UCLUA_GC_RESET_COLLECT) == 0)
+		return;
+	start = uclua_profile_now();
+	(void)lua_gc(lcook->L, LUA_GCCOLLECT, 0);
+	lcook->gc_usec += uclua_profile_now() - start;
+	lcook->gc_collects++;
+}
+
+/*
+ * { cycles, collections, collect_usec, heap }: cycles the collector has
+ * completed, how many of them were full collections we ran and how long those
+ * took, and the current size of the Lua heap in bytes.
+ */
+ucl_object_t *
+uclua_gc_stats(lcookie_t *lcook)
+{
+	ucl_object_t *rep;
+	lua_Integer heap;
+
+	heap = (lua_Integer)lua_gc(lcook->L, LUA_GCCOUNT, 0) * 1024 +
+	    lua_gc(lcook->L, LUA_GCCOUNTB, 0);
+	rep = ucl_object_typed_new(UCL_OBJECT);
+	if (rep == NULL ||
+	    !ucl_object_insert_key(rep, ucl_object_fromint(lcook->gc_cycles),
+	    "cycles", 0, false) ||
+	    !ucl_object_insert_key(rep, ucl_object_fromint(lcook->gc_collects),
+	    "collections", 0, false) ||
+	    !ucl_object_insert_key(rep, ucl_object_fromint(lcook->gc_usec),
+	    "collect_usec", 0, false) ||
+	    !ucl_object_insert_key(rep, ucl_object_fromint(heap), "heap", 0,
+	    false)) {
+		if (rep != NULL)
+			ucl_object_unref(rep);
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (NULL);
+	}
+
+	return (rep);
+}
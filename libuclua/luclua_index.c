@@ -0,0 +1,356 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Frozen path index over a converted tree.  Every node is entered once under
+ * its full path, spelled as for uclua_lookup() ("a.b[3].c", arrays from 1,
+ * the root as ""), in an open-addressed table keyed by the path's hash.
+ * uclua_path_compile() does the one hash and probe; the handle it returns
+ * carries the node and its value already decoded, so the typed accessors are
+ * plain loads.
+ *
+ * The index holds a reference on the tree, which must not be modified for
+ * as long as the index exists.
+ */
+
+#include <sys/param.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luclua_internal.h"
+
+struct uclua_path {
+	const ucl_object_t	*obj;
+	uint64_t		 hash;
+	uint32_t		 path;	/* offset into the pool */
+	uint32_t		 pathlen;
+	ucl_type_t		 type;
+	int64_t			 iv;
+	double			 dv;
+	const char		*sv;
+	size_t			 count;	/* entries, or string length */
+};
+
+struct uclua_index {
+	ucl_object_t		*root;
+	struct uclua_path	*paths;
+	size_t			 npaths;
+	size_t			 maxpaths;
+	uint32_t		*slots;	/* path index + 1; 0 is empty */
+	size_t			 nslots;
+	char			*pool;
+	size_t			 poollen;
+	size_t			 poolcap;
+};
+
+static uint64_t
+uclua_index_hash(const char *str, size_t len)
+{
+	uint64_t h;
+
+	/* FNV-1a */
+	h = 0xcbf29ce484222325ULL;
+	while (len-- > 0) {
+		h ^= (unsigned char)*str++;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+static bool
+uclua_index_grow(char **bufp, size_t *capp, size_t need)
+{
+	char *buf;
+	size_t cap;
+
+	if (need <= *capp)
+		return (true);
+	if (need > UINT32_MAX)
+		return (false);
+
+	cap = MAX(MAX(*capp * 2, need), 4096);
+	buf = realloc(*bufp, cap);
+	if (buf == NULL)
+		return (false);
+	*bufp = buf;
+	*capp = cap;
+	return (true);
+}
+
+/* Decode `obj` into a new entry for the path at the tail of the pool. */
+static bool
+uclua_index_add(struct uclua_index *idx, const ucl_object_t *obj,
+    size_t pathoff, size_t pathlen)
+{
+	struct uclua_path *paths, *p;
+	size_t cap;
+
+	if (idx->npaths == idx->maxpaths) {
+		if (idx->maxpaths >= UINT32_MAX / 2)
+			return (false);
+		cap = MAX(idx->maxpaths * 2, 64);
+		paths = reallocarray(idx->paths, cap, sizeof(*paths));
+		if (paths == NULL)
+			return (false);
+		idx->paths = paths;
+		idx->maxpaths = cap;
+	}
+
+	p = &idx->paths[idx->npaths++];
+	memset(p, 0, sizeof(*p));
+	p->obj = obj;
+	p->path = (uint32_t)pathoff;
+	p->pathlen = (uint32_t)pathlen;
+	p->hash = uclua_index_hash(idx->pool + pathoff, pathlen);
+	p->type = ucl_object_type(obj);
+	switch (p->type) {
+	case UCL_INT:
+		p->iv = ucl_object_toint(obj);
+		p->dv = (double)p->iv;
+		break;
+	case UCL_FLOAT:
+	case UCL_TIME:
+		p->dv = ucl_object_todouble(obj);
+		p->iv = (int64_t)p->dv;
+		break;
+	case UCL_BOOLEAN:
+		p->iv = ucl_object_toboolean(obj);
+		p->dv = (double)p->iv;
+		break;
+	case UCL_STRING:
+		p->sv = ucl_object_tolstring(obj, &p->count);
+		break;
+	case UCL_ARRAY:
+	case UCL_OBJECT:
+		p->count = obj->len;
+		break;
+	default:
+		break;
+	}
+
+	return (true);
+}
+
+/*
+ * Enter `obj`, whose path was just appended to the pool at `pathoff`, and
+ * everything below it.  Children's paths are built by copying the parent's
+ * to the tail of the pool and appending their own component.
+ */
+static bool
+uclua_index_walk(struct uclua_index *idx, const ucl_object_t *obj,
+    size_t pathoff, size_t pathlen)
+{
+	ucl_object_iter_t it;
+	const ucl_object_t *elt;
+	const char *key;
+	char num[24];
+	size_t i, keylen, need, off;
+
+	if (!uclua_index_add(idx, obj, pathoff, pathlen))
+		return (false);
+	if (obj->type != UCL_OBJECT && obj->type != UCL_ARRAY)
+		return (true);
+
+	i = 0;
+	it = NULL;
+	while ((elt = ucl_object_iterate(obj, &it, true)) != NULL) {
+		if (obj->type == UCL_ARRAY) {
+			keylen = (size_t)snprintf(num, sizeof(num), "[%zu]",
+			    ++i);
+			key = num;
+		} else {
+			key = ucl_object_keyl(elt, &keylen);
+		}
+
+		off = idx->poollen;
+		need = pathlen + keylen + 2;
+		if (!uclua_index_grow(&idx->pool, &idx->poolcap, off + need))
+			return (false);
+		memcpy(idx->pool + off, idx->pool + pathoff, pathlen);
+		idx->poollen += pathlen;
+		if (obj->type == UCL_OBJECT && pathlen != 0)
+			idx->pool[idx->poollen++] = '.';
+		memcpy(idx->pool + idx->poollen, key, keylen);
+		idx->poollen += keylen;
+		idx->pool[idx->poollen++] = '\0';
+
+		if (!uclua_index_walk(idx, elt, off, idx->poollen - off - 1))
+			return (false);
+	}
+
+	return (true);
+}
+
+static const struct uclua_path *
+uclua_index_find(const struct uclua_index *idx, const char *path, size_t len)
+{
+	const struct uclua_path *p;
+	size_t slot;
+	uint64_t h;
+
+	h = uclua_index_hash(path, len);
+	slot = h & (idx->nslots - 1);
+	while (idx->slots[slot] != 0) {
+		p = &idx->paths[idx->slots[slot] - 1];
+		if (p->hash == h && p->pathlen == len &&
+		    memcmp(idx->pool + p->path, path, len) == 0)
+			return (p);
+		slot = (slot + 1) & (idx->nslots - 1);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Index every path in `obj`, usually the result of uclua_ucl().  The index
+ * keeps its own reference, so it stays valid across uclua_reset() and
+ * uclua_free() of the cookie that produced it.
+ */
+struct uclua_index *
+uclua_index_new(const ucl_object_t *obj)
+{
+	struct uclua_index *idx;
+	size_t i, slot;
+
+	if (obj == NULL)
+		return (NULL);
+	idx = calloc(1, sizeof(*idx));
+	if (idx == NULL)
+		return (NULL);
+
+	if (!uclua_index_grow(&idx->pool, &idx->poolcap, 1))
+		goto fail;
+	idx->pool[idx->poollen++] = '\0';
+	if (!uclua_index_walk(idx, obj, 0, 0))
+		goto fail;
+
+	idx->nslots = 16;
+	while (idx->nslots < idx->npaths * 2)
+		idx->nslots *= 2;
+	idx->slots = calloc(idx->nslots, sizeof(*idx->slots));
+	if (idx->slots == NULL)
+		goto fail;
+
+	/*
+	 * A key with a "." or "[" in it can spell the same path as a nested
+	 * one; whichever was entered first wins.
+	 */
+	for (i = 0; i < idx->npaths; i++) {
+		if (uclua_index_find(idx, idx->pool + idx->paths[i].path,
+		    idx->paths[i].pathlen) != NULL)
+			continue;
+		slot = idx->paths[i].hash & (idx->nslots - 1);
+		while (idx->slots[slot] != 0)
+			slot = (slot + 1) & (idx->nslots - 1);
+		idx->slots[slot] = (uint32_t)(i + 1);
+	}
+
+	idx->root = ucl_object_ref(obj);
+	return (idx);
+fail:
+	uclua_index_free(idx);
+	return (NULL);
+}
+
+void
+uclua_index_free(struct uclua_index *idx)
+{
+
+	if (idx == NULL)
+		return;
+	if (idx->root != NULL)
+		ucl_object_unref(idx->root);
+	free(idx->slots);
+	free(idx->paths);
+	free(idx->pool);
+	free(idx);
+}
+
+/* Resolve `path` once; the handle is valid until uclua_index_free(). */
+const uclua_path *
+uclua_path_compile(const struct uclua_index *idx, const char *path)
+{
+
+	return (uclua_index_find(idx, path, strlen(path)));
+}
+
+const ucl_object_t *
+uclua_path_object(const uclua_path *p)
+{
+
+	return (p->obj);
+}
+
+ucl_type_t
+uclua_path_type(const uclua_path *p)
+{
+
+	return (p->type);
+}
+
+/* Entries in an array or object, or a string's length. */
+size_t
+uclua_path_count(const uclua_path *p)
+{
+
+	return (p->count);
+}
+
+int64_t
+uclua_path_toint(const uclua_path *p)
+{
+
+	return (p->iv);
+}
+
+double
+uclua_path_todouble(const uclua_path *p)
+{
+
+	return (p->dv);
+}
+
+bool
+uclua_path_toboolean(const uclua_path *p)
+{
+
+	return (p->iv != 0);
+}
+
+const char *
+uclua_path_tostring(const uclua_path *p, size_t *lenp)
+{
+
+	if (p->type != UCL_STRING)
+		return (NULL);
+	if (lenp != NULL)
+		*lenp = p->count;
+	return (p->sv);
+}
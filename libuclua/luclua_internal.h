@@ -29,6 +29,7 @@
 #define	_LUCLUA_INTERNAL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <luaconf.h>
 #include <lua.h>
@@ -37,20 +38,125 @@
 #include <ucl.h>
 
 #include <uclua.h>
+#include "luclua_compat.h"
+#include "luclua_probe.h"
 
 #define	LENV_IDX		"uclua_env"
+/* Set of the modules the sandbox searcher found since the last reset. */
+#define	LREQUIRED_IDX		"uclua_required"
+
+/* Default limit on table nesting during conversion; 0 is unlimited. */
+#define	UCLUA_DEFAULT_MAX_DEPTH	512
+
+/*
+ * Checkpoint overlays are converted by recursing, as are lazy modules that
+ * load as other proxies; this bounds that even without a max_depth.
+ */
+#define	UCLUA_MAX_RECURSION	200
+
+struct uclua_hashent;
+struct uclua_schema;
 
 struct uclua_cookie {
 	lua_State *L;
+	lua_State *co;		/* in-flight uclua_parse_begin() */
 	ucl_object_t *ucl;
+	ucl_object_t *pending;	/* in-flight uclua_ucl_step() */
+	ucl_object_t *base;	/* uclua_checkpoint() */
+	lua_Integer cow_gen;
+	unsigned int depth;	/* current conversion depth */
+	unsigned int max_depth;
+	unsigned int recursion;	/* proxies being converted */
+	int budget;		/* uclua_parse_step() */
+	int hook_count;
+	bool budgeted;
+	int prof_interval;	/* uclua_set_profile() */
+	uint64_t prof_last;
+	bool footprint;		/* uclua_set_footprint() */
+	lua_Alloc foot_allocf;
+	void *foot_allocud;
+	uint64_t foot_alloced;
+	bool lazy_require;	/* uclua_set_lazy_require() */
+	bool module_cache;	/* uclua_set_module_cache() */
+	bool module_views;	/* cached module results handed out */
+	unsigned int threads;	/* uclua_set_threads() */
+	int gc_flags;		/* uclua_set_gc_policy() */
+	uint64_t gc_cycles;
+	uint64_t gc_collects;
+	uint64_t gc_usec;
+	bool gc_closing;
 	int dirfd;	/* sandboxed require */
+	struct uclua_schema *schema_root;	/* uclua_set_schema() */
+	ucl_object_t *schema_src;
+	const struct uclua_schema *schema;	/* of the value being built */
+	char *schema_path;
+	size_t schema_pathlen;
+	size_t schema_pathcap;
+	char *schema_msg;
+	struct uclua_hashent *hashes;	/* uclua_set_hash() */
+	size_t nhashes;
+	size_t maxhashes;
+	bool hash_tree;
+	bool hashing;	/* in uclua_ucl_step() */
 	uclua_error error;
 	bool dirty;
+	bool pending_array;
 };
 
 void uclua_ucl_free(lcookie_t *);
+void uclua_ucl_abort(lcookie_t *);
+bool uclua_process_entry(lcookie_t *, ucl_object_t *, bool);
+ucl_object_t *uclua_convert(lcookie_t *, int);
+const char *uclua_path_index(const char *, long long *);
+bool uclua_is_array(lua_State *, int);
+ucl_object_t *uclua_parallel_convert(lcookie_t *, int, bool *);
+
+bool uclua_cow_proxy(lua_State *, int);
+int uclua_cow_rawget(lua_State *, int);
+ucl_object_t *uclua_cow_process(lcookie_t *, int);
+void uclua_cow_freeze(lcookie_t *, lua_State *, int);
+void uclua_cow_view(lcookie_t *, lua_State *, int);
+void uclua_checkpoint_free(lcookie_t *);
+
+const struct uclua_schema *uclua_schema_enter(lcookie_t *,
+    const struct uclua_schema *, bool);
+void uclua_schema_leave(lcookie_t *, size_t);
+bool uclua_schema_check(lcookie_t *, const struct uclua_schema *,
+    const ucl_object_t *);
+bool uclua_schema_validate(lcookie_t *, const struct uclua_schema *,
+    const ucl_object_t *);
+void uclua_schema_release(lcookie_t *);
+
+uint64_t uclua_hash(lcookie_t *, const ucl_object_t *);
+void uclua_hash_clear(lcookie_t *);
+
+int uclua_sandbox_open(lcookie_t *, lua_State *, const char *);
+int uclua_load_file(lcookie_t *, lua_State *, FILE *, const char *);
+int uclua_literal_load(lcookie_t *, const char *, size_t);
+
+void uclua_lazy_loader(lcookie_t *, lua_State *);
+bool uclua_lazy_proxy(lua_State *, int);
+bool uclua_lazy_resolve(lcookie_t *, lua_State *, int);
+bool uclua_lazy_value(lcookie_t *, lua_State *, int);
+
+int uclua_modcache_search(lcookie_t *, lua_State *, const char *, int);
+void uclua_modcache_reset(lcookie_t *);
+void uclua_modcache_flush(lcookie_t *);
+
+void uclua_gc_init(lcookie_t *);
+void uclua_gc_parse(lcookie_t *, bool);
+void uclua_gc_reset(lcookie_t *);
+
+uint64_t uclua_profile_now(void);
+void uclua_profile_sample(lcookie_t *, lua_State *);
+void uclua_profile_resume(lcookie_t *);
+
+void uclua_footprint_wrap(lcookie_t *, lua_State *, const char *);
 
-int uclua_dump_lua(lcookie_t *, FILE *);
+int uclua_emit(const ucl_object_t *, uclua_dump_type, FILE *, uclua_error *);
+int uclua_dump_lua(const ucl_object_t *, FILE *, uclua_error *);
+int uclua_dump_luac(const ucl_object_t *, FILE *, uclua_error *);
+int uclua_dump_snapshot(const ucl_object_t *, FILE *, uclua_error *);
 
 static inline int
 uclua_set_error(lcookie_t *lcook, uclua_error error)
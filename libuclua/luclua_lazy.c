@@ -0,0 +1,318 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lazy require.  With uclua_set_lazy_require(), the sandbox searcher only
+ * checks that a module exists and hands require() a loader that returns a
+ * proxy table in its place.  The module is compiled and run the first time the
+ * proxy is indexed, assigned to, iterated, called or converted; from then on
+ * the proxy forwards to the module's value, which also replaces the proxy in
+ * package.loaded.  Modules that are never referenced are never compiled.
+ *
+ * Side effects of a module's main chunk are deferred along with it, which is
+ * why this is opt-in.
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "luclua_internal.h"
+
+#define	LLAZYMT_IDX		"uclua_lazy_meta"
+
+static int uclua_lazy_index(lua_State *);
+static int uclua_lazy_newindex(lua_State *);
+static int uclua_lazy_pairs(lua_State *);
+static int uclua_lazy_len(lua_State *);
+static int uclua_lazy_call(lua_State *);
+
+static const luaL_Reg uclua_lazy_meta[] = {
+	{ "__index", uclua_lazy_index },
+	{ "__newindex", uclua_lazy_newindex },
+	{ "__pairs", uclua_lazy_pairs },
+	{ "__len", uclua_lazy_len },
+	{ "__call", uclua_lazy_call },
+	{ NULL, NULL },
+};
+
+void
+uclua_set_lazy_require(lcookie_t *lcook, bool enable)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	lcook->lazy_require = enable;
+	if (!enable)
+		return;
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LLAZYMT_IDX) == LUA_TNIL) {
+		lua_newtable(L);
+		lua_pushlightuserdata(L, lcook);
+		luaL_setfuncs(L, uclua_lazy_meta, 1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LLAZYMT_IDX);
+	}
+	lua_pop(L, 1);
+}
+
+bool
+uclua_lazy_proxy(lua_State *L, int idx)
+{
+	bool proxy;
+
+	if (!lua_getmetatable(L, idx))
+		return (false);
+
+	lua_pushliteral(L, "__index");
+	lua_rawget(L, -2);
+	proxy = lua_tocfunction(L, -1) == uclua_lazy_index;
+	lua_pop(L, 2);
+	return (proxy);
+}
+
+/* The loader handed to require(); upvalue 1 is the cookie. */
+static int
+uclua_lazy_load(lua_State *L)
+{
+	const char *name;
+
+	name = luaL_checkstring(L, 1);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, LLAZYMT_IDX);
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, -5);
+	}
+	lua_pop(L, 1);
+
+	lua_pushstring(L, name);
+	lua_setfield(L, -2, "__module");
+	lua_setmetatable(L, -2);
+	return (1);
+}
+
+/* Pushed by the sandbox searcher in place of the module's main chunk. */
+void
+uclua_lazy_loader(lcookie_t *lcook, lua_State *L)
+{
+
+	lua_pushlightuserdata(L, lcook);
+	lua_pushcclosure(L, uclua_lazy_load, 1);
+}
+
+/*
+ * Push the module behind the proxy at idx, loading it if that hasn't happened
+ * yet.  On failure, the error message is pushed instead and false returned.
+ */
+bool
+uclua_lazy_resolve(lcookie_t *lcook, lua_State *L, int idx)
+{
+	FILE *f;
+	const char *name;
+	int fd, lerr, mt;
+
+	idx = lua_absindex(L, idx);
+	lua_getmetatable(L, idx);
+	mt = lua_gettop(L);
+	if (lua_getfield(L, mt, "__target") != LUA_TNIL) {
+		lua_remove(L, mt);
+		return (true);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, mt, "__module");
+	name = lua_tostring(L, -1);
+	if (lua_getfield(L, mt, "__loading") != LUA_TNIL) {
+		lua_pushfstring(L, "loop while lazily loading module '%s'",
+		    name);
+		goto fail;
+	}
+	lua_pop(L, 1);
+
+	fd = uclua_sandbox_open(lcook, L, name);
+	if (fd == -1) {
+		lua_pushfstring(L, "module '%s' is no longer in the sandbox",
+		    name);
+		goto fail;
+	}
+
+	f = fdopen(fd, "r");
+	if (f == NULL) {
+		close(fd);
+		lua_pushfstring(L, "failed to open '%s' for reading", name);
+		goto fail;
+	}
+
+	lerr = uclua_load_file(lcook, L, f, name);
+	fclose(f);
+	if (lua_isnil(L, -lerr)) {
+		lua_remove(L, -2);
+		goto fail;
+	}
+	if (lcook->footprint)
+		uclua_footprint_wrap(lcook, L, name);
+
+	lua_pushboolean(L, 1);
+	lua_setfield(L, mt, "__loading");
+	lua_pushvalue(L, mt + 1);
+	lerr = lua_pcall(L, 1, 1, 0);
+	lua_pushnil(L);
+	lua_setfield(L, mt, "__loading");
+	if (lerr != LUA_OK)
+		goto fail;
+
+	/* As with require(), a module that returns nothing becomes true. */
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushboolean(L, 1);
+	}
+	lua_pushvalue(L, -1);
+	lua_setfield(L, mt, "__target");
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+	lua_getfield(L, -1, name);
+	if (lua_rawequal(L, -1, idx)) {
+		lua_pushvalue(L, -3);
+		lua_setfield(L, -3, name);
+	}
+	lua_pop(L, 2);
+
+	lua_replace(L, mt);
+	lua_settop(L, mt);
+	return (true);
+fail:
+	lua_replace(L, mt);
+	lua_settop(L, mt);
+	return (false);
+}
+
+/*
+ * Conversion and lookups see modules rather than their proxies.  Replace the
+ * value at idx with its module if it's a proxy; a module that fails to load is
+ * reported through the cookie, as there's no Lua caller to raise it to.
+ */
+bool
+uclua_lazy_value(lcookie_t *lcook, lua_State *L, int idx)
+{
+
+	if (lua_type(L, idx) != LUA_TTABLE || !uclua_lazy_proxy(L, idx))
+		return (true);
+
+	idx = lua_absindex(L, idx);
+	if (!uclua_lazy_resolve(lcook, L, idx)) {
+		lua_pop(L, 1);
+		(void)uclua_set_error(lcook, UCLUE_LUA_ERROR);
+		return (false);
+	}
+
+	lua_replace(L, idx);
+	return (true);
+}
+
+static void
+uclua_lazy_target(lua_State *L)
+{
+	lcookie_t *lcook;
+
+	lcook = lua_touserdata(L, lua_upvalueindex(1));
+	if (!uclua_lazy_resolve(lcook, L, 1))
+		lua_error(L);
+	lua_replace(L, 1);
+}
+
+static int
+uclua_lazy_index(lua_State *L)
+{
+
+	lua_settop(L, 2);
+	uclua_lazy_target(L);
+	lua_gettable(L, 1);
+	return (1);
+}
+
+static int
+uclua_lazy_newindex(lua_State *L)
+{
+
+	lua_settop(L, 3);
+	uclua_lazy_target(L);
+	lua_settable(L, 1);
+	return (0);
+}
+
+static int
+uclua_lazy_next(lua_State *L)
+{
+
+	lua_settop(L, 2);
+	if (lua_next(L, 1) != 0)
+		return (2);
+	lua_pushnil(L);
+	return (1);
+}
+
+static int
+uclua_lazy_pairs(lua_State *L)
+{
+
+	lua_settop(L, 1);
+	uclua_lazy_target(L);
+	if (luaL_getmetafield(L, 1, "__pairs") != LUA_TNIL) {
+		lua_pushvalue(L, 1);
+		lua_call(L, 1, 3);
+		return (3);
+	}
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_pushcfunction(L, uclua_lazy_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return (3);
+}
+
+static int
+uclua_lazy_len(lua_State *L)
+{
+
+	lua_settop(L, 1);
+	uclua_lazy_target(L);
+	lua_len(L, 1);
+	return (1);
+}
+
+static int
+uclua_lazy_call(lua_State *L)
+{
+
+	uclua_lazy_target(L);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return (lua_gettop(L));
+}
@@ -0,0 +1,605 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Fast path for chunks that are nothing but assignments of literals to
+ * globals:
+ *
+ *   name = "string"
+ *   other = { 1, 2, key = true, ["a key"] = -3.5, nested = { [[long]] } }
+ *
+ * These are parsed directly into tables and assigned to the environment in
+ * order, without compiling or running anything.  The tables are presized and
+ * filled in the same order that the VM's constructors would, so that they come
+ * out of lua_next() in the same order and the converted result is identical.
+ * Anything else, including any string escape or numeric key that we'd rather
+ * not reproduce ourselves, sends the chunk down the usual path; syntax errors
+ * are left for the compiler to report.
+ *
+ * LuaJIT builds constant tables from templates, so we don't try to match it.
+ */
+
+#include <sys/param.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "luclua_internal.h"
+
+#if defined(LUAJIT_VERSION)
+int
+uclua_literal_load(lcookie_t *lcook __unused, const char *buf __unused,
+    size_t len __unused)
+{
+
+	return (0);
+}
+#else
+
+/* The compiler's limit on nesting, LUAI_MAXCCALLS. */
+#define	UCLUA_LITERAL_MAXDEPTH	200
+
+/* Longer numerals are left to the compiler. */
+#define	UCLUA_LITERAL_MAXNUM	128
+
+struct uclua_lit {
+	lua_State	*L;
+	const char	*p;
+	const char	*end;
+	unsigned int	 depth;
+	bool		 literal;
+};
+
+static const char *uclua_lit_reserved[] = {
+	"and", "break", "do", "else", "elseif", "end", "false", "for",
+	"function", "goto", "if", "in", "local", "nil", "not", "or", "repeat",
+	"return", "then", "true", "until", "while",
+};
+
+static int uclua_lit_value(struct uclua_lit *, bool);
+
+static bool
+uclua_lit_isalpha(int c)
+{
+
+	return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_');
+}
+
+static bool
+uclua_lit_isdigit(int c)
+{
+
+	return (c >= '0' && c <= '9');
+}
+
+static bool
+uclua_lit_isxdigit(int c)
+{
+
+	return (uclua_lit_isdigit(c) || (c >= 'a' && c <= 'f') ||
+	    (c >= 'A' && c <= 'F'));
+}
+
+static bool
+uclua_lit_peek(const struct uclua_lit *lit, int c)
+{
+
+	return (lit->p < lit->end && *lit->p == c);
+}
+
+/* The level of the long bracket opening at p, or -1 if there isn't one. */
+static int
+uclua_lit_bracket(const char *p, const char *end)
+{
+	int level;
+
+	if (p >= end || *p++ != '[')
+		return (-1);
+	for (level = 0; p < end && *p == '='; p++)
+		level++;
+	return (p < end && *p == '[' ? level : -1);
+}
+
+/* Find the end of the long bracket at lit->p, with `body` at its contents. */
+static bool
+uclua_lit_long(struct uclua_lit *lit, const char **body, size_t *len)
+{
+	const char *p;
+	int level, n;
+
+	level = uclua_lit_bracket(lit->p, lit->end);
+	p = lit->p + level + 2;
+	*body = p;
+	for (; p < lit->end; p++) {
+		if (*p != ']')
+			continue;
+		for (n = 0; p + n + 1 < lit->end && p[n + 1] == '='; n++)
+			continue;
+		if (n == level && p + n + 1 < lit->end && p[n + 1] == ']') {
+			*len = p - *body;
+			lit->p = p + n + 2;
+			return (true);
+		}
+	}
+
+	return (false);
+}
+
+static bool
+uclua_lit_space(struct uclua_lit *lit)
+{
+	const char *body;
+	size_t len;
+
+	while (lit->p < lit->end) {
+		switch (*lit->p) {
+		case ' ':
+		case '\f':
+		case '\n':
+		case '\r':
+		case '\t':
+		case '\v':
+			lit->p++;
+			continue;
+		case '-':
+			if (lit->p + 1 >= lit->end || lit->p[1] != '-')
+				return (true);
+			lit->p += 2;
+			if (uclua_lit_bracket(lit->p, lit->end) >= 0) {
+				if (!uclua_lit_long(lit, &body, &len))
+					return (false);
+				continue;
+			}
+			while (lit->p < lit->end && *lit->p != '\n' &&
+			    *lit->p != '\r')
+				lit->p++;
+			continue;
+		default:
+			return (true);
+		}
+	}
+
+	return (true);
+}
+
+static bool
+uclua_lit_name(struct uclua_lit *lit, const char **name, size_t *len)
+{
+	const char *p;
+
+	p = lit->p;
+	if (p >= lit->end || !uclua_lit_isalpha(*p))
+		return (false);
+	while (p < lit->end && (uclua_lit_isalpha(*p) || uclua_lit_isdigit(*p)))
+		p++;
+
+	*name = lit->p;
+	*len = p - lit->p;
+	lit->p = p;
+	return (true);
+}
+
+static bool
+uclua_lit_isreserved(const char *name, size_t len)
+{
+
+	for (size_t i = 0; i < nitems(uclua_lit_reserved); i++) {
+		if (strlen(uclua_lit_reserved[i]) == len &&
+		    memcmp(uclua_lit_reserved[i], name, len) == 0)
+			return (true);
+	}
+
+	return (false);
+}
+
+/* An `=` that's an assignment, not the start of `==`. */
+static bool
+uclua_lit_assign(struct uclua_lit *lit)
+{
+
+	if (!uclua_lit_peek(lit, '=') ||
+	    (lit->p + 1 < lit->end && lit->p[1] == '='))
+		return (false);
+	lit->p++;
+	return (uclua_lit_space(lit));
+}
+
+/*
+ * Only the simple escapes are handled here; \z and \u{} take the long way.
+ */
+static bool
+uclua_lit_short(struct uclua_lit *lit, bool build)
+{
+	luaL_Buffer b;
+	const char *p, *start;
+	int c, n;
+	char quote;
+
+	quote = *lit->p++;
+	start = lit->p;
+	for (p = start; p < lit->end && *p != quote && *p != '\\'; p++) {
+		if (*p == '\n' || *p == '\r')
+			return (false);
+	}
+	if (p >= lit->end)
+		return (false);
+	if (*p == quote) {
+		if (build)
+			lua_pushlstring(lit->L, start, p - start);
+		lit->p = p + 1;
+		return (true);
+	}
+
+	if (build) {
+		luaL_buffinit(lit->L, &b);
+		luaL_addlstring(&b, start, p - start);
+	}
+	while (p < lit->end && *p != quote) {
+		c = *p++;
+		if (c == '\n' || c == '\r')
+			return (false);
+		if (c != '\\') {
+			if (build)
+				luaL_addchar(&b, c);
+			continue;
+		}
+
+		if (p >= lit->end)
+			return (false);
+		switch ((c = *p++)) {
+		case 'a':	c = '\a'; break;
+		case 'b':	c = '\b'; break;
+		case 'f':	c = '\f'; break;
+		case 'n':	c = '\n'; break;
+		case 'r':	c = '\r'; break;
+		case 't':	c = '\t'; break;
+		case 'v':	c = '\v'; break;
+		case '\\':
+		case '"':
+		case '\'':
+		case '\n':
+			break;
+		case 'x':
+			if (p + 2 > lit->end || !uclua_lit_isxdigit(p[0]) ||
+			    !uclua_lit_isxdigit(p[1]))
+				return (false);
+			for (c = 0, n = 0; n < 2; n++, p++) {
+				c = c * 16 + (uclua_lit_isdigit(*p) ? *p - '0' :
+				    (*p | 0x20) - 'a' + 10);
+			}
+			break;
+		default:
+			if (!uclua_lit_isdigit(c))
+				return (false);
+			c -= '0';
+			for (n = 1; n < 3 && p < lit->end &&
+			    uclua_lit_isdigit(*p); n++)
+				c = c * 10 + *p++ - '0';
+			if (c > UCHAR_MAX)
+				return (false);
+			break;
+		}
+		if (build)
+			luaL_addchar(&b, c);
+	}
+	if (p >= lit->end)
+		return (false);
+
+	if (build)
+		luaL_pushresult(&b);
+	lit->p = p + 1;
+	return (true);
+}
+
+/* The compiler normalizes line endings in long strings; we don't bother. */
+static bool
+uclua_lit_longstring(struct uclua_lit *lit, bool build)
+{
+	const char *body;
+	size_t len;
+
+	if (!uclua_lit_long(lit, &body, &len) ||
+	    memchr(body, '\r', len) != NULL)
+		return (false);
+
+	/* A newline right after the opening bracket is skipped. */
+	if (len > 0 && *body == '\n') {
+		body++;
+		len--;
+	}
+	if (build)
+		lua_pushlstring(lit->L, body, len);
+	return (true);
+}
+
+/* Scanned just as the lexer does, then converted by the same routine. */
+static bool
+uclua_lit_number(struct uclua_lit *lit)
+{
+	char num[UCLUA_LITERAL_MAXNUM];
+	const char *expo, *p;
+	size_t len;
+
+	p = lit->p;
+	expo = "Ee";
+	if (p + 1 < lit->end && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		expo = "Pp";
+		p += 2;
+	}
+	while (p < lit->end) {
+		if (*p == expo[0] || *p == expo[1]) {
+			p++;
+			if (p < lit->end && (*p == '+' || *p == '-'))
+				p++;
+		} else if (uclua_lit_isxdigit(*p) || *p == '.') {
+			p++;
+		} else {
+			break;
+		}
+	}
+
+	len = p - lit->p;
+	if (len >= sizeof(num))
+		return (false);
+	memcpy(num, lit->p, len);
+	num[len] = '\0';
+	if (lua_stringtonumber(lit->L, num) == 0)
+		return (false);
+	lit->p = p;
+	return (true);
+}
+
+static bool
+uclua_lit_fields(struct uclua_lit *lit, bool build, int *narrp, int *nrecp)
+{
+	lua_State *L;
+	const char *name, *save;
+	size_t len;
+	int narr, nrec, t;
+
+	L = lit->L;
+	t = lua_gettop(L);
+	narr = nrec = 0;
+	for (;;) {
+		if (!uclua_lit_space(lit) || lit->p >= lit->end)
+			return (false);
+		if (*lit->p == '}') {
+			lit->p++;
+			break;
+		}
+
+		save = lit->p;
+		if (*lit->p == '[' && uclua_lit_bracket(lit->p, lit->end) < 0) {
+			/* Other key types might end up in the array part. */
+			lit->p++;
+			if (!uclua_lit_space(lit) ||
+			    uclua_lit_value(lit, build) != LUA_TSTRING ||
+			    !uclua_lit_space(lit) || !uclua_lit_peek(lit, ']'))
+				return (false);
+			lit->p++;
+			if (!uclua_lit_space(lit) || !uclua_lit_assign(lit) ||
+			    uclua_lit_value(lit, build) == LUA_TNONE)
+				return (false);
+			if (build)
+				lua_rawset(L, t);
+			nrec++;
+		} else if (uclua_lit_name(lit, &name, &len) &&
+		    uclua_lit_space(lit) && uclua_lit_assign(lit)) {
+			if (uclua_lit_isreserved(name, len))
+				return (false);
+			if (build)
+				lua_pushlstring(L, name, len);
+			if (uclua_lit_value(lit, build) == LUA_TNONE)
+				return (false);
+			if (build)
+				lua_rawset(L, t);
+			nrec++;
+		} else {
+			lit->p = save;
+			if (uclua_lit_value(lit, build) == LUA_TNONE)
+				return (false);
+			narr++;
+			if (build)
+				lua_rawseti(L, t, narr);
+		}
+
+		if (!uclua_lit_space(lit))
+			return (false);
+		if (uclua_lit_peek(lit, ',') || uclua_lit_peek(lit, ';'))
+			lit->p++;
+		else if (!uclua_lit_peek(lit, '}'))
+			return (false);
+	}
+
+	*narrp = narr;
+	*nrecp = nrec;
+	return (true);
+}
+
+/*
+ * Constructors are sized upfront, so each one is scanned once to count its
+ * fields before it's built.
+ */
+static bool
+uclua_lit_table(struct uclua_lit *lit, bool build)
+{
+	struct uclua_lit scan;
+	int narr, nrec;
+
+	if (++lit->depth > UCLUA_LITERAL_MAXDEPTH)
+		return (false);
+	lit->p++;
+	if (build) {
+		if (!lua_checkstack(lit->L, LUA_MINSTACK))
+			return (false);
+		scan = *lit;
+		if (!uclua_lit_fields(&scan, false, &narr, &nrec))
+			return (false);
+		lua_createtable(lit->L, narr, nrec);
+	}
+
+	if (!uclua_lit_fields(lit, build, &narr, &nrec))
+		return (false);
+	lit->depth--;
+	return (true);
+}
+
+/*
+ * Parse one value, pushing it if we're building.  Returns its type, or
+ * LUA_TNONE if it's not something we handle.
+ */
+static int
+uclua_lit_value(struct uclua_lit *lit, bool build)
+{
+	const char *name;
+	size_t len;
+	int c;
+
+	if (lit->p >= lit->end)
+		return (LUA_TNONE);
+
+	c = *lit->p;
+	if (c == '"' || c == '\'')
+		return (uclua_lit_short(lit, build) ? LUA_TSTRING : LUA_TNONE);
+	if (c == '[')
+		return (uclua_lit_longstring(lit, build) ? LUA_TSTRING :
+		    LUA_TNONE);
+	if (c == '{')
+		return (uclua_lit_table(lit, build) ? LUA_TTABLE : LUA_TNONE);
+	if (uclua_lit_isdigit(c) || (c == '.' && lit->p + 1 < lit->end &&
+	    uclua_lit_isdigit(lit->p[1]))) {
+		if (!uclua_lit_number(lit))
+			return (LUA_TNONE);
+		if (!build)
+			lua_pop(lit->L, 1);
+		return (LUA_TNUMBER);
+	}
+	if (c == '-') {
+		/* Folded by the compiler just the same. */
+		lit->p++;
+		if (!uclua_lit_space(lit) ||
+		    uclua_lit_value(lit, build) != LUA_TNUMBER)
+			return (LUA_TNONE);
+		if (build)
+			lua_arith(lit->L, LUA_OPUNM);
+		return (LUA_TNUMBER);
+	}
+
+	if (!uclua_lit_name(lit, &name, &len))
+		return (LUA_TNONE);
+	if ((len == 4 && memcmp(name, "true", 4) == 0) ||
+	    (len == 5 && memcmp(name, "false", 5) == 0)) {
+		if (build)
+			lua_pushboolean(lit->L, len == 4);
+		return (LUA_TBOOLEAN);
+	}
+
+	return (LUA_TNONE);
+}
+
+/*
+ * Runs protected; the assignments are only made once the whole chunk has been
+ * parsed, so a chunk that turns out not to be literal leaves no trace.
+ */
+static int
+uclua_lit_chunk(lua_State *L)
+{
+	struct uclua_lit *lit;
+	const char *name;
+	size_t len;
+	lua_Integer n;
+
+	lit = lua_touserdata(L, 1);
+	lua_newtable(L);
+	n = 0;
+	for (;;) {
+		if (!uclua_lit_space(lit))
+			return (0);
+		if (lit->p >= lit->end)
+			break;
+		if (*lit->p == ';') {
+			lit->p++;
+			continue;
+		}
+
+		if (!uclua_lit_name(lit, &name, &len) ||
+		    uclua_lit_isreserved(name, len) || !uclua_lit_space(lit) ||
+		    !uclua_lit_assign(lit))
+			return (0);
+		lua_pushlstring(L, name, len);
+		lua_rawseti(L, 2, ++n);
+		if (uclua_lit_value(lit, true) == LUA_TNONE)
+			return (0);
+		lua_rawseti(L, 2, ++n);
+	}
+
+	lit->literal = true;
+	lua_getfield(L, LUA_REGISTRYINDEX, LENV_IDX);
+	for (lua_Integer i = 1; i < n; i += 2) {
+		lua_rawgeti(L, 2, i);
+		lua_rawgeti(L, 2, i + 1);
+		/* Not raw, a checkpoint overlay needs to see these. */
+		lua_settable(L, 3);
+	}
+
+	return (0);
+}
+
+/*
+ * Returns 1 if the chunk was literal and has been evaluated, 0 if it needs to
+ * be run, or -1 if assigning its globals failed.
+ */
+int
+uclua_literal_load(lcookie_t *lcook, const char *buf, size_t len)
+{
+	struct uclua_lit lit;
+	lua_State *L;
+	int lerr, top;
+
+	L = lcook->L;
+	memset(&lit, 0, sizeof(lit));
+	lit.L = L;
+	lit.p = buf;
+	lit.end = buf + len;
+
+	top = lua_gettop(L);
+	lua_pushcfunction(L, uclua_lit_chunk);
+	lua_pushlightuserdata(L, &lit);
+	lerr = lua_pcall(L, 1, 0, 0);
+	if (lerr != LUA_OK && lit.literal) {
+		fprintf(stderr, "pcall error %s\n",
+		    luaL_tolstring(L, -1, NULL));
+		lua_settop(L, top);
+		(void)uclua_set_error(lcook, UCLUE_LUA_ERROR);
+		return (-1);
+	}
+
+	lua_settop(L, top);
+	return (lerr == LUA_OK && lit.literal ? 1 : 0);
+}
+#endif	/* LUAJIT_VERSION */
@@ -0,0 +1,323 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Module results kept across uclua_reset().  With uclua_set_module_cache(), a
+ * module whose first line is UCLUA_PURE_MARK, or that lives beneath one of the
+ * directories given to uclua_add_library(), is run once per cookie instead of
+ * once per document that requires it:
+ *
+ *   - It runs in a private environment over _G, so it neither sees nor leaves
+ *     anything behind in the environment of the document that required it.
+ *   - Its result is kept here, and each document gets a copy-on-write view of
+ *     it (see luclua_checkpoint.c), so that nothing one document does to it
+ *     is seen by the next.
+ *   - It's dropped from package.loaded at uclua_reset(), so that the next
+ *     document's require() comes back through the searcher, which runs it
+ *     again if the file's mtime has changed.
+ *
+ * The cache lives in the registry:
+ *
+ *   libs - array of library directories, relative to the sandbox
+ *   mods - name -> { value = result, sec = mtime, nsec = mtime }
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "luclua_internal.h"
+
+#define	LMODCACHE_IDX		"uclua_modcache"
+
+#define	UCLUA_PURE_MARK		"-- uclua: pure"
+
+/* Push the cache, creating it on first use. */
+static int
+uclua_modcache(lua_State *L)
+{
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LMODCACHE_IDX) == LUA_TTABLE)
+		return (lua_gettop(L));
+
+	lua_pop(L, 1);
+	lua_createtable(L, 0, 2);
+	lua_newtable(L);
+	lua_setfield(L, -2, "libs");
+	lua_newtable(L);
+	lua_setfield(L, -2, "mods");
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LMODCACHE_IDX);
+	return (lua_gettop(L));
+}
+
+void
+uclua_set_module_cache(lcookie_t *lcook, bool enable)
+{
+
+	lcook->module_cache = enable;
+}
+
+/*
+ * Cache every module beneath `dir` in the sandbox, whether it's marked pure or
+ * not; "" is the whole sandbox.
+ */
+void
+uclua_add_library(lcookie_t *lcook, const char *dir)
+{
+	lua_State *L;
+	size_t len;
+
+	L = lcook->L;
+	len = strlen(dir);
+	while (len > 0 && dir[len - 1] == '/')
+		len--;
+
+	uclua_modcache(L);
+	lua_getfield(L, -1, "libs");
+	lua_pushlstring(L, dir, len);
+	lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+	lua_pop(L, 2);
+}
+
+/* Does the module `name`, open on `fd`, belong in the cache? */
+static bool
+uclua_modcache_wanted(lua_State *L, int cidx, const char *name, int fd)
+{
+	char line[sizeof(UCLUA_PURE_MARK) + 1];
+	const char *dir;
+	size_t len, nlibs;
+	ssize_t nb;
+
+	lua_getfield(L, cidx, "libs");
+	nlibs = lua_rawlen(L, -1);
+	for (size_t i = 1; i <= nlibs; i++) {
+		lua_rawgeti(L, -1, (lua_Integer)i);
+		dir = lua_tolstring(L, -1, &len);
+		if (len == 0 || (strncmp(name, dir, len) == 0 &&
+		    name[len] == '/')) {
+			lua_pop(L, 2);
+			return (true);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	/* The mark must be the whole of the first line. */
+	nb = pread(fd, line, sizeof(line), 0);
+	len = sizeof(UCLUA_PURE_MARK) - 1;
+	if (nb < (ssize_t)len || memcmp(line, UCLUA_PURE_MARK, len) != 0)
+		return (false);
+	return (nb == (ssize_t)len || line[len] == '\n' || line[len] == '\r');
+}
+
+/* Push the value a require() of a cached result hands out. */
+static void
+uclua_modcache_push(lcookie_t *lcook, lua_State *L, int idx)
+{
+
+	if (lua_type(L, idx) != LUA_TTABLE) {
+		lua_pushvalue(L, idx);
+		return;
+	}
+
+	lcook->module_views = true;
+	uclua_cow_view(lcook, L, idx);
+}
+
+/* Loader for a module that's already in the cache; upvalues lcook, result. */
+static int
+uclua_modcache_hit(lua_State *L)
+{
+
+	uclua_modcache_push(lua_touserdata(L, lua_upvalueindex(1)), L,
+	    lua_upvalueindex(2));
+	return (1);
+}
+
+/*
+ * Loader for a module that isn't; upvalues are lcook, the chunk, and the mtime
+ * it was loaded at.  The chunk's result is cached before we hand out a view.
+ */
+static int
+uclua_modcache_miss(lua_State *L)
+{
+	const char *name;
+	lcookie_t *lcook;
+	int nargs;
+
+	lcook = lua_touserdata(L, lua_upvalueindex(1));
+	name = luaL_checkstring(L, 1);
+	nargs = lua_gettop(L);
+	lua_pushvalue(L, lua_upvalueindex(2));
+	for (int i = 1; i <= nargs; i++)
+		lua_pushvalue(L, i);
+	lua_call(L, nargs, 1);
+
+	/* As with require(), a module that returns nothing becomes true. */
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushboolean(L, 1);
+	}
+
+	/* No document gets to change what the next one will see. */
+	uclua_cow_freeze(lcook, L, -1);
+	uclua_modcache(L);
+	lua_getfield(L, -1, "mods");
+	lua_createtable(L, 0, 3);
+	lua_pushvalue(L, -4);
+	lua_setfield(L, -2, "value");
+	lua_pushvalue(L, lua_upvalueindex(3));
+	lua_setfield(L, -2, "sec");
+	lua_pushvalue(L, lua_upvalueindex(4));
+	lua_setfield(L, -2, "nsec");
+	lua_setfield(L, -2, name);
+	lua_pop(L, 2);
+
+	uclua_modcache_push(lcook, L, -1);
+	return (1);
+}
+
+/*
+ * Called by the sandbox searcher for the module `name` open on `fd`.  Returns
+ * -1, with `fd` untouched, if the module isn't one for the cache; otherwise
+ * `fd` is consumed and the searcher's results are pushed and counted.
+ */
+int
+uclua_modcache_search(lcookie_t *lcook, lua_State *L, const char *name, int fd)
+{
+	struct stat st;
+	FILE *f;
+	int cidx, lerr, top;
+
+	top = lua_gettop(L);
+	cidx = uclua_modcache(L);
+	if (fstat(fd, &st) == -1 || !uclua_modcache_wanted(L, cidx, name, fd)) {
+		lua_settop(L, top);
+		return (-1);
+	}
+
+	lua_getfield(L, cidx, "mods");
+	if (lua_getfield(L, -1, name) == LUA_TTABLE) {
+		lua_getfield(L, -1, "sec");
+		lua_getfield(L, -2, "nsec");
+		if (lua_tointeger(L, -2) == st.st_mtim.tv_sec &&
+		    lua_tointeger(L, -1) == st.st_mtim.tv_nsec) {
+			close(fd);
+			lua_pushlightuserdata(L, lcook);
+			lua_getfield(L, -4, "value");
+			lua_pushcclosure(L, uclua_modcache_hit, 2);
+			lua_replace(L, top + 1);
+			lua_settop(L, top + 1);
+			return (1);
+		}
+	}
+	lua_settop(L, top);
+
+	f = fdopen(fd, "r");
+	if (f == NULL) {
+		close(fd);
+		lua_pushfstring(L, "\tfailed to open '%s' for reading", name);
+		return (1);
+	}
+
+	lerr = uclua_load_file(lcook, L, f, name);
+	fclose(f);
+	assert(lerr > 0);
+	if (lua_isnil(L, -lerr)) {
+		/* The searcher passes the error along. */
+		assert(lerr > 1);
+		lua_replace(L, top + 1);
+		lua_settop(L, top + 1);
+		return (1);
+	}
+
+	/* A private environment, as uclua_reset() would make for a document. */
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushglobaltable(L);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	uclua_setenv(L, -2);
+
+	if (lcook->footprint)
+		uclua_footprint_wrap(lcook, L, name);
+	lua_pushlightuserdata(L, lcook);
+	lua_insert(L, -2);
+	lua_pushinteger(L, st.st_mtim.tv_sec);
+	lua_pushinteger(L, st.st_mtim.tv_nsec);
+	lua_pushcclosure(L, uclua_modcache_miss, 4);
+	return (1);
+}
+
+/*
+ * Between documents: make the next require() of each cached module ask the
+ * searcher again.
+ */
+void
+uclua_modcache_reset(lcookie_t *lcook)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	lcook->module_views = false;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LMODCACHE_IDX) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	lua_getfield(L, -1, "mods");
+	lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+	lua_pushnil(L);
+	while (lua_next(L, -3) != 0) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, -4);
+	}
+
+	lua_pop(L, 3);
+}
+
+/* Forget every cached result, e.g. because the sandbox changed. */
+void
+uclua_modcache_flush(lcookie_t *lcook)
+{
+	lua_State *L;
+
+	uclua_modcache_reset(lcook);
+	L = lcook->L;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LMODCACHE_IDX) == LUA_TTABLE) {
+		lua_newtable(L);
+		lua_setfield(L, -2, "mods");
+	}
+	lua_pop(L, 1);
+}
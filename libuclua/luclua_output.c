@@ -0,0 +1,174 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Fan-out: emit one converted tree in several formats.  Emission doesn't touch
+ * the Lua state or the cookie, so with UCLUA_DUMP_THREADED each output beyond
+ * the first gets a thread of its own while the caller's thread takes the first.
+ * Outputs that share a stream would interleave, so those are grouped and
+ * written in order by the thread of the first one in the group.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "luclua_internal.h"
+
+/* A group of outputs for one thread, those whose group[] is `first`. */
+struct uclua_output_job {
+	struct uclua_output	*outs;
+	size_t			 nouts;
+	const size_t		*group;
+	size_t			 first;
+	const ucl_object_t	*ucl;
+};
+
+static void
+uclua_output_emit(struct uclua_output *out, const ucl_object_t *ucl)
+{
+
+	out->status = uclua_emit(ucl, out->type, out->file, &out->error);
+}
+
+static void *
+uclua_output_worker(void *arg)
+{
+	struct uclua_output_job *job;
+
+	job = arg;
+	for (size_t i = job->first; i < job->nouts; i++) {
+		if (job->group[i] == job->first)
+			uclua_output_emit(&job->outs[i], job->ucl);
+	}
+	return (NULL);
+}
+
+static bool
+uclua_output_shared(FILE *a, FILE *b)
+{
+	struct stat sa, sb;
+
+	if (a == b)
+		return (true);
+	if (fstat(fileno(a), &sa) == -1 || fstat(fileno(b), &sb) == -1)
+		return (false);
+	return (sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino);
+}
+
+int
+uclua_dump_outputs(lcookie_t *lcook, const ucl_object_t *ucl,
+    struct uclua_output *outs, size_t nouts, int flags)
+{
+	struct uclua_output_job *jobs;
+	pthread_t *threads;
+	size_t *group;
+	bool *started;
+	size_t i, j;
+	int ret;
+
+	jobs = NULL;
+	threads = NULL;
+	group = NULL;
+	started = NULL;
+	for (i = 0; i < nouts; i++) {
+		outs[i].status = 0;
+		outs[i].error = UCLUE_OK;
+	}
+
+	if ((flags & UCLUA_DUMP_THREADED) != 0 && nouts > 1) {
+		jobs = calloc(nouts, sizeof(*jobs));
+		threads = calloc(nouts, sizeof(*threads));
+		group = calloc(nouts, sizeof(*group));
+		started = calloc(nouts, sizeof(*started));
+		if (jobs == NULL || threads == NULL || group == NULL ||
+		    started == NULL) {
+			/* Just do it all here. */
+			free(jobs);
+			free(threads);
+			free(group);
+			free(started);
+			jobs = NULL;
+			threads = NULL;
+			group = NULL;
+			started = NULL;
+		}
+	}
+
+	if (threads != NULL) {
+		for (i = 0; i < nouts; i++) {
+			group[i] = i;
+			for (j = 0; j < i; j++) {
+				if (group[j] == j &&
+				    uclua_output_shared(outs[i].file,
+				    outs[j].file)) {
+					group[i] = j;
+					break;
+				}
+			}
+
+			jobs[i].outs = outs;
+			jobs[i].nouts = nouts;
+			jobs[i].group = group;
+			jobs[i].first = i;
+			jobs[i].ucl = ucl;
+		}
+
+		for (i = 1; i < nouts; i++) {
+			if (group[i] != i)
+				continue;
+			started[i] = pthread_create(&threads[i], NULL,
+			    uclua_output_worker, &jobs[i]) == 0;
+		}
+	}
+
+	for (i = 0; i < nouts; i++) {
+		if (threads == NULL)
+			uclua_output_emit(&outs[i], ucl);
+		else if (group[i] == i && !started[i])
+			(void)uclua_output_worker(&jobs[i]);
+	}
+
+	ret = 0;
+	for (i = 0; i < nouts; i++) {
+		if (threads != NULL && started[i])
+			(void)pthread_join(threads[i], NULL);
+		if (outs[i].status != 0 && ret == 0) {
+			ret = outs[i].status;
+			(void)uclua_set_error(lcook, outs[i].error);
+		}
+	}
+
+	free(jobs);
+	free(threads);
+	free(group);
+	free(started);
+	return (ret);
+}
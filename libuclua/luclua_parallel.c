@@ -0,0 +1,581 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Parallel conversion, in two stages.  The environment is first flattened into
+ * an intermediate representation that has no ties to the Lua state: a flat
+ * array of nodes, with the children of each table stored contiguously and all
+ * strings in a single pool.  The UCL objects for each top-level entry are then
+ * built from that on a pool of threads, and finally linked into the root in
+ * their original order.
+ *
+ * Tables referenced from several places are left to uclua_process_table(),
+ * which converts them once and shares the result.  Threads can't share what
+ * they build with each other, and building a copy for each reference would
+ * multiply the work and the memory used, so such an environment isn't
+ * converted here at all.  That also rules out cycles.
+ */
+
+#include <sys/param.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luclua_internal.h"
+
+#define	UCLUA_IR_NONE	UINT32_MAX
+
+enum uclua_irtype {
+	UCLUA_IR_BOOL,
+	UCLUA_IR_INT,
+	UCLUA_IR_FLOAT,
+	UCLUA_IR_STRING,
+	UCLUA_IR_OBJECT,
+	UCLUA_IR_ARRAY,
+};
+
+struct uclua_irnode {
+	uint32_t	key;		/* pool offset, in objects only */
+	uint32_t	parent;
+	uint32_t	depth;
+	uint8_t		type;
+	union {
+		int64_t		iv;
+		double		dv;
+		bool		bv;
+		uint32_t	str;
+		struct {
+			uint32_t	first;
+			uint32_t	count;
+		} kids;
+	} v;
+};
+
+struct uclua_ir {
+	struct uclua_irnode	*nodes;
+	size_t			 nnodes;
+	size_t			 maxnodes;
+	char			*pool;
+	size_t			 poollen;
+	size_t			 poolcap;
+	bool			 shared;	/* a table was seen twice */
+};
+
+struct uclua_irframe {
+	uint32_t	 node;
+	uint32_t	 next;
+	ucl_object_t	*obj;
+};
+
+struct uclua_pool {
+	const struct uclua_ir	*ir;
+	ucl_object_t		**objs;
+	pthread_mutex_t		 lock;
+	uint32_t		 next;
+	uint32_t		 count;
+	uclua_error		 error;
+};
+
+void
+uclua_set_threads(lcookie_t *lcook, unsigned int nthreads)
+{
+
+	lcook->threads = nthreads;
+}
+
+static uint32_t
+uclua_ir_node(lcookie_t *lcook, struct uclua_ir *ir, uint8_t type,
+    uint32_t parent)
+{
+	struct uclua_irnode *node;
+	size_t maxnodes;
+
+	if (ir->nnodes == UCLUA_IR_NONE) {
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (UCLUA_IR_NONE);
+	}
+
+	if (ir->nnodes == ir->maxnodes) {
+		maxnodes = ir->maxnodes == 0 ? 256 : ir->maxnodes * 2;
+		node = reallocarray(ir->nodes, maxnodes, sizeof(*node));
+		if (node == NULL) {
+			(void)uclua_set_error(lcook, UCLUE_NOMEM);
+			return (UCLUA_IR_NONE);
+		}
+
+		ir->nodes = node;
+		ir->maxnodes = maxnodes;
+	}
+
+	node = &ir->nodes[ir->nnodes];
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->key = UCLUA_IR_NONE;
+	node->parent = parent;
+	node->depth = parent == UCLUA_IR_NONE ? 0 :
+	    ir->nodes[parent].depth + 1;
+	return (ir->nnodes++);
+}
+
+/* Strings are kept NUL-terminated, as that's how they're handed to libucl. */
+static uint32_t
+uclua_ir_string(lcookie_t *lcook, struct uclua_ir *ir, const char *str)
+{
+	size_t len, poolcap;
+	char *pool;
+	uint32_t off;
+
+	len = strlen(str) + 1;
+	if (ir->poollen + len > UCLUA_IR_NONE) {
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (UCLUA_IR_NONE);
+	}
+
+	if (ir->poollen + len > ir->poolcap) {
+		poolcap = ir->poolcap == 0 ? 4096 : ir->poolcap;
+		while (ir->poollen + len > poolcap)
+			poolcap *= 2;
+		pool = realloc(ir->pool, poolcap);
+		if (pool == NULL) {
+			(void)uclua_set_error(lcook, UCLUE_NOMEM);
+			return (UCLUA_IR_NONE);
+		}
+
+		ir->pool = pool;
+		ir->poolcap = poolcap;
+	}
+
+	off = ir->poollen;
+	memcpy(&ir->pool[off], str, len);
+	ir->poollen += len;
+	return (off);
+}
+
+/*
+ * Add a node for the key/value pair at the top of the stack to `parent`.
+ * Values that uclua_process_pair() would skip don't get a node.  New tables
+ * are queued up in `work`, keyed by their node, and remembered in `memo`; on
+ * running into one again, we note that and give up.
+ */
+static bool
+uclua_ir_pair(lcookie_t *lcook, struct uclua_ir *ir, uint32_t parent,
+    int work, int memo)
+{
+	lua_State *L;
+	uint32_t n;
+	int ltype;
+	uint8_t type;
+
+	L = lcook->L;
+	ltype = lua_type(L, -2);
+	if (ltype != LUA_TSTRING && ltype != LUA_TNUMBER) {
+		(void)uclua_set_error(lcook, UCLUE_BADKEYTYPE);
+		return (false);
+	}
+
+	if (!uclua_lazy_value(lcook, L, -1))
+		return (false);
+
+	switch (lua_type(L, -1)) {
+	case LUA_TBOOLEAN:
+		n = uclua_ir_node(lcook, ir, UCLUA_IR_BOOL, parent);
+		if (n != UCLUA_IR_NONE)
+			ir->nodes[n].v.bv = lua_toboolean(L, -1);
+		break;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, -1)) {
+			n = uclua_ir_node(lcook, ir, UCLUA_IR_INT, parent);
+			if (n != UCLUA_IR_NONE)
+				ir->nodes[n].v.iv = lua_tointeger(L, -1);
+			break;
+		}
+#if LUA_FLOAT_TYPE == LUA_FLOAT_FLOAT || LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE
+		n = uclua_ir_node(lcook, ir, UCLUA_IR_FLOAT, parent);
+		if (n != UCLUA_IR_NONE)
+			ir->nodes[n].v.dv = (double)lua_tonumber(L, -1);
+		break;
+#else
+		(void)uclua_set_error(lcook, UCLUE_NOTYPE);
+		return (false);
+#endif
+	case LUA_TSTRING:
+		n = uclua_ir_node(lcook, ir, UCLUA_IR_STRING, parent);
+		if (n == UCLUA_IR_NONE)
+			break;
+		ir->nodes[n].v.str = uclua_ir_string(lcook, ir,
+		    luaL_tolstring(L, -1, NULL));
+		lua_pop(L, 1);
+		if (ir->nodes[n].v.str == UCLUA_IR_NONE)
+			return (false);
+		break;
+	case LUA_TTABLE:
+		lua_pushvalue(L, -1);
+		if (lua_rawget(L, memo) != LUA_TNIL) {
+			lua_pop(L, 1);
+			ir->shared = true;
+			return (false);
+		}
+		lua_pop(L, 1);
+
+		type = uclua_is_array(L, lua_gettop(L)) ? UCLUA_IR_ARRAY :
+		    UCLUA_IR_OBJECT;
+		n = uclua_ir_node(lcook, ir, type, parent);
+		if (n == UCLUA_IR_NONE)
+			break;
+		/* The environment itself counts, as in uclua_conv_push(). */
+		if (lcook->max_depth != 0 &&
+		    ir->nodes[n].depth + 1 > lcook->max_depth) {
+			(void)uclua_set_error(lcook, UCLUE_TOODEEP);
+			return (false);
+		}
+
+		lua_pushvalue(L, -1);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, memo);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, work, (lua_Integer)n + 1);
+		break;
+	default:
+		return (true);
+	}
+
+	if (n == UCLUA_IR_NONE)
+		return (false);
+	if (ir->nodes[parent].type == UCLUA_IR_OBJECT) {
+		ir->nodes[n].key = uclua_ir_string(lcook, ir,
+		    luaL_tolstring(L, -2, NULL));
+		lua_pop(L, 1);
+		if (ir->nodes[n].key == UCLUA_IR_NONE)
+			return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Tables are flattened breadth first, so that each one's entries land next to
+ * each other in the node array.  Nodes are only ever appended, so the tables
+ * still waiting for their entries are simply every table node past the one
+ * we're working on.
+ */
+static bool
+uclua_ir_flatten(lcookie_t *lcook, struct uclua_ir *ir, int envidx)
+{
+	lua_State *L;
+	uint32_t first, n;
+	int memo, top, work;
+	uint8_t type;
+
+	L = lcook->L;
+	if (!lua_checkstack(L, LUA_MINSTACK)) {
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (false);
+	}
+
+	top = lua_gettop(L);
+	lua_newtable(L);
+	work = lua_gettop(L);
+	lua_newtable(L);
+	memo = lua_gettop(L);
+
+	type = uclua_is_array(L, envidx) ? UCLUA_IR_ARRAY : UCLUA_IR_OBJECT;
+	if (uclua_ir_node(lcook, ir, type, UCLUA_IR_NONE) == UCLUA_IR_NONE)
+		goto fail;
+	lua_pushvalue(L, envidx);
+	lua_rawseti(L, work, 1);
+	lua_pushvalue(L, envidx);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, memo);
+
+	for (n = 0; n < ir->nnodes; n++) {
+		type = ir->nodes[n].type;
+		if (type != UCLUA_IR_OBJECT && type != UCLUA_IR_ARRAY)
+			continue;
+
+		lua_rawgeti(L, work, (lua_Integer)n + 1);
+		lua_pushnil(L);
+		lua_rawseti(L, work, (lua_Integer)n + 1);
+
+		first = ir->nnodes;
+		lua_pushnil(L);
+		while (lua_next(L, memo + 1) != 0) {
+			if (!uclua_ir_pair(lcook, ir, n, work, memo))
+				goto fail;
+			lua_settop(L, memo + 2);
+		}
+		lua_pop(L, 1);
+
+		ir->nodes[n].v.kids.first = first;
+		ir->nodes[n].v.kids.count = ir->nnodes - first;
+	}
+
+	lua_settop(L, top);
+	return (true);
+fail:
+	lua_settop(L, top);
+	return (false);
+}
+
+static ucl_object_t *
+uclua_ir_scalar(const struct uclua_ir *ir, const struct uclua_irnode *node)
+{
+
+	switch (node->type) {
+	case UCLUA_IR_BOOL:
+		return (ucl_object_frombool(node->v.bv));
+	case UCLUA_IR_INT:
+		return (ucl_object_fromint(node->v.iv));
+	case UCLUA_IR_FLOAT:
+		return (ucl_object_fromdouble(node->v.dv));
+	case UCLUA_IR_STRING:
+		return (ucl_object_fromstring(&ir->pool[node->v.str]));
+	case UCLUA_IR_OBJECT:
+		return (ucl_object_typed_new(UCL_OBJECT));
+	case UCLUA_IR_ARRAY:
+		return (ucl_object_typed_new(UCL_ARRAY));
+	default:
+		return (NULL);
+	}
+}
+
+/*
+ * Build the value of node `n`, without recursing.  Only the IR is read, so any
+ * number of these may run at once.
+ */
+static ucl_object_t *
+uclua_ir_build(const struct uclua_ir *ir, uint32_t n, uclua_error *error)
+{
+	struct uclua_irframe *frame, *nstack, *stack;
+	const struct uclua_irnode *node, *cnode;
+	ucl_object_t *root, *val;
+	size_t depth, maxdepth;
+	uint32_t child;
+	bool inserted;
+
+	node = &ir->nodes[n];
+	root = uclua_ir_scalar(ir, node);
+	if (root == NULL) {
+		*error = UCLUE_NOMEM;
+		return (NULL);
+	}
+	if (node->type != UCLUA_IR_OBJECT && node->type != UCLUA_IR_ARRAY)
+		return (root);
+
+	maxdepth = 64;
+	stack = calloc(maxdepth, sizeof(*stack));
+	if (stack == NULL)
+		goto nomem;
+
+	depth = 0;
+	stack[depth].node = node - ir->nodes;
+	stack[depth++].obj = root;
+	while (depth > 0) {
+		frame = &stack[depth - 1];
+		node = &ir->nodes[frame->node];
+		if (frame->next == node->v.kids.count) {
+			depth--;
+			continue;
+		}
+
+		child = node->v.kids.first + frame->next++;
+		cnode = &ir->nodes[child];
+		if ((val = uclua_ir_scalar(ir, cnode)) == NULL)
+			goto nomem;
+
+		if (node->type == UCLUA_IR_ARRAY)
+			inserted = ucl_array_append(frame->obj, val);
+		else
+			inserted = ucl_object_insert_key(frame->obj, val,
+			    &ir->pool[cnode->key], 0, true);
+		if (!inserted) {
+			ucl_object_unref(val);
+			*error = UCLUE_MUTATE;
+			goto fail;
+		}
+
+		if (cnode->type != UCLUA_IR_OBJECT &&
+		    cnode->type != UCLUA_IR_ARRAY)
+			continue;
+
+		if (depth == maxdepth) {
+			nstack = reallocarray(stack, maxdepth * 2,
+			    sizeof(*stack));
+			if (nstack == NULL)
+				goto nomem;
+			stack = nstack;
+			maxdepth *= 2;
+		}
+
+		stack[depth].node = cnode - ir->nodes;
+		stack[depth].next = 0;
+		stack[depth++].obj = val;
+	}
+
+	free(stack);
+	return (root);
+nomem:
+	*error = UCLUE_NOMEM;
+fail:
+	free(stack);
+	ucl_object_unref(root);
+	return (NULL);
+}
+
+static void *
+uclua_pool_worker(void *arg)
+{
+	struct uclua_pool *pool;
+	const struct uclua_irnode *root;
+	uclua_error error;
+	uint32_t i;
+
+	pool = arg;
+	root = &pool->ir->nodes[0];
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->error != UCLUE_OK || pool->next == pool->count) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		error = UCLUE_OK;
+		pool->objs[i] = uclua_ir_build(pool->ir,
+		    root->v.kids.first + i, &error);
+		if (pool->objs[i] == NULL) {
+			pthread_mutex_lock(&pool->lock);
+			if (pool->error == UCLUE_OK)
+				pool->error = error;
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+	}
+
+	return (NULL);
+}
+
+/* Build the top-level entries on up to lcook->threads threads, ours too. */
+static ucl_object_t *
+uclua_ir_assemble(lcookie_t *lcook, const struct uclua_ir *ir)
+{
+	struct uclua_pool pool;
+	const struct uclua_irnode *root;
+	pthread_t *threads;
+	ucl_object_t *obj;
+	size_t i, nthreads, started;
+	bool inserted;
+
+	root = &ir->nodes[0];
+	obj = uclua_ir_scalar(ir, root);
+	if (obj == NULL) {
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (NULL);
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pool.ir = ir;
+	pool.count = root->v.kids.count;
+	pool.error = UCLUE_OK;
+	pool.objs = calloc(MAX(pool.count, 1), sizeof(*pool.objs));
+	if (pool.objs == NULL) {
+		ucl_object_unref(obj);
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (NULL);
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+
+	nthreads = MIN(lcook->threads, pool.count);
+	threads = NULL;
+	if (nthreads > 1)
+		threads = calloc(nthreads - 1, sizeof(*threads));
+	started = 0;
+	if (threads != NULL) {
+		for (; started < nthreads - 1; started++) {
+			if (pthread_create(&threads[started], NULL,
+			    uclua_pool_worker, &pool) != 0)
+				break;
+		}
+	}
+
+	(void)uclua_pool_worker(&pool);
+	for (i = 0; i < started; i++)
+		(void)pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&pool.lock);
+
+	for (i = 0; i < pool.count; i++) {
+		if (pool.objs[i] == NULL || pool.error != UCLUE_OK)
+			continue;
+		if (root->type == UCLUA_IR_ARRAY)
+			inserted = ucl_array_append(obj, pool.objs[i]);
+		else
+			inserted = ucl_object_insert_key(obj, pool.objs[i],
+			    &ir->pool[ir->nodes[root->v.kids.first + i].key], 0,
+			    true);
+		if (!inserted)
+			pool.error = UCLUE_MUTATE;
+		else
+			pool.objs[i] = NULL;
+	}
+
+	for (i = 0; i < pool.count; i++) {
+		if (pool.objs[i] != NULL)
+			ucl_object_unref(pool.objs[i]);
+	}
+	free(pool.objs);
+
+	if (pool.error != UCLUE_OK) {
+		ucl_object_unref(obj);
+		(void)uclua_set_error(lcook, pool.error);
+		return (NULL);
+	}
+
+	return (obj);
+}
+
+/*
+ * Returns NULL with *serialp set if the environment has to be converted by
+ * uclua_process_table() instead.
+ */
+ucl_object_t *
+uclua_parallel_convert(lcookie_t *lcook, int envidx, bool *serialp)
+{
+	struct uclua_ir ir;
+	ucl_object_t *obj;
+
+	memset(&ir, 0, sizeof(ir));
+	obj = NULL;
+	if (uclua_ir_flatten(lcook, &ir, envidx))
+		obj = uclua_ir_assemble(lcook, &ir);
+
+	*serialp = ir.shared;
+	free(ir.nodes);
+	free(ir.pool);
+	return (obj);
+}
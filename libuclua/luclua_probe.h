@@ -0,0 +1,61 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Static tracepoints, for dtrace, perf, bpftrace and friends; built with
+ * WITH_SDT.  Otherwise they compile to nothing, arguments included.  All probes
+ * belong to the "uclua" provider, declared for dtrace(1) in uclua_probes.d:
+ *
+ *   load_start(name)			a chunk starts loading
+ *   load_done(name, bytes, ok)		... and has been read and compiled
+ *   eval_start()			a document starts or resumes running
+ *   eval_done(status)			... and stopped, as a uclua_step
+ *   resolve(name, found)		the sandbox searcher looked up a module
+ *   convert_start()			uclua_ucl() starts
+ *   convert_done(ok, entries)		... and finished; top-level entries
+ *   dump_start(format)			a uclua_dump_type starts emitting
+ *   dump_done(format, error)		... and finished, 0 or an errno
+ */
+
+#ifndef _LUCLUA_PROBE_H
+#define	_LUCLUA_PROBE_H
+
+#ifdef UCLUA_SDT
+#include <sys/sdt.h>
+
+#define	UCLUA_PROBE(name)		DTRACE_PROBE(uclua, name)
+#define	UCLUA_PROBE1(name, a)		DTRACE_PROBE1(uclua, name, a)
+#define	UCLUA_PROBE2(name, a, b)	DTRACE_PROBE2(uclua, name, a, b)
+#define	UCLUA_PROBE3(name, a, b, c)	DTRACE_PROBE3(uclua, name, a, b, c)
+#else
+#define	UCLUA_PROBE(name)		do { } while (0)
+#define	UCLUA_PROBE1(name, a)		do { } while (0)
+#define	UCLUA_PROBE2(name, a, b)	do { } while (0)
+#define	UCLUA_PROBE3(name, a, b, c)	do { } while (0)
+#endif
+
+#endif	/* _LUCLUA_PROBE_H */
@@ -0,0 +1,283 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Sampling profiler for document evaluation.  The count hook installed by
+ * uclua_parse_step() calls in here every `prof_interval` VM instructions, and
+ * the wall time elapsed since the previous sample is charged to the stack as
+ * it stands: self time to the innermost frame, total time to every distinct
+ * frame on the stack.  require()d modules are loaded on the same thread and
+ * are sampled along with the document.
+ *
+ * Samples accumulate in a registry table shaped like the report, so that
+ * uclua_profile() is just another conversion:
+ *
+ *   lines   - "source:line" -> { self_us, total_us, samples }
+ *   modules - chunk name -> { self_us, total_us, samples }
+ *   stacks  - folded stack -> microseconds, as consumed by flamegraph.pl
+ */
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "luclua_internal.h"
+
+#define	LPROF_IDX		"uclua_profile"
+
+/* Deeper frames are cut off from the sample. */
+#define	UCLUA_PROFILE_MAXDEPTH	64
+
+struct uclua_profile_frame {
+	char	line[LUA_IDSIZE + 16];
+	char	func[LUA_IDSIZE + 80];
+	char	module[LUA_IDSIZE];
+	bool	lua;
+};
+
+uint64_t
+uclua_profile_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+void
+uclua_set_profile(lcookie_t *lcook, int interval)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	lcook->prof_interval = interval;
+	if (interval <= 0) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, LPROF_IDX);
+		return;
+	}
+
+	lua_createtable(L, 0, 3);
+	lua_newtable(L);
+	lua_setfield(L, -2, "lines");
+	lua_newtable(L);
+	lua_setfield(L, -2, "modules");
+	lua_newtable(L);
+	lua_setfield(L, -2, "stacks");
+	lua_setfield(L, LUA_REGISTRYINDEX, LPROF_IDX);
+}
+
+/* Don't charge the time spent outside of uclua_parse_step() to anyone. */
+void
+uclua_profile_resume(lcookie_t *lcook)
+{
+
+	lcook->prof_last = uclua_profile_now();
+}
+
+static void
+uclua_profile_charge(lua_State *L, int tidx, const char *key, lua_Integer dt,
+    bool leaf)
+{
+
+	if (lua_getfield(L, tidx, key) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 3);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, tidx, key);
+	}
+
+	lua_getfield(L, -1, "self_us");
+	lua_pushinteger(L, lua_tointeger(L, -1) + (leaf ? dt : 0));
+	lua_setfield(L, -3, "self_us");
+	lua_getfield(L, -2, "total_us");
+	lua_pushinteger(L, lua_tointeger(L, -1) + dt);
+	lua_setfield(L, -4, "total_us");
+	lua_getfield(L, -3, "samples");
+	lua_pushinteger(L, lua_tointeger(L, -1) + (leaf ? 1 : 0));
+	lua_setfield(L, -5, "samples");
+	lua_pop(L, 4);
+}
+
+void
+uclua_profile_sample(lcookie_t *lcook, lua_State *L)
+{
+	struct uclua_profile_frame frames[UCLUA_PROFILE_MAXDEPTH];
+	lua_Debug ar;
+	luaL_Buffer b;
+	struct uclua_profile_frame *fr;
+	uint64_t now;
+	lua_Integer dt;
+	int depth, i, j, ptop, top;
+	bool leaf, seen;
+
+	now = uclua_profile_now();
+	dt = (lua_Integer)(now - lcook->prof_last);
+	lcook->prof_last = now;
+
+	for (depth = 0; depth < UCLUA_PROFILE_MAXDEPTH; depth++) {
+		if (lua_getstack(L, depth, &ar) == 0 ||
+		    lua_getinfo(L, "Sln", &ar) == 0)
+			break;
+
+		fr = &frames[depth];
+		fr->lua = strcmp(ar.what, "C") != 0;
+		strlcpy(fr->module, ar.source, sizeof(fr->module));
+		if (ar.currentline > 0)
+			snprintf(fr->line, sizeof(fr->line), "%s:%d",
+			    ar.short_src, ar.currentline);
+		else
+			strlcpy(fr->line, ar.short_src, sizeof(fr->line));
+		if (strcmp(ar.what, "main") == 0)
+			snprintf(fr->func, sizeof(fr->func), "main chunk (%s)",
+			    ar.short_src);
+		else
+			snprintf(fr->func, sizeof(fr->func), "%s (%s:%d)",
+			    ar.name != NULL ? ar.name : "?", ar.short_src,
+			    ar.linedefined);
+	}
+
+	if (depth == 0)
+		return;
+
+	top = lua_gettop(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, LPROF_IDX);
+	ptop = lua_gettop(L);
+	if (!lua_istable(L, ptop))
+		goto out;
+
+	lua_getfield(L, ptop, "lines");
+	for (i = 0; i < depth; i++) {
+		for (j = 0, seen = false; j < i && !seen; j++)
+			seen = strcmp(frames[i].line, frames[j].line) == 0;
+		if (!seen)
+			uclua_profile_charge(L, ptop + 1, frames[i].line, dt,
+			    i == 0);
+	}
+
+	/* Self time goes to the innermost Lua chunk, C functions have none. */
+	lua_getfield(L, ptop, "modules");
+	leaf = true;
+	for (i = 0; i < depth; i++) {
+		if (!frames[i].lua)
+			continue;
+		for (j = 0, seen = false; j < i && !seen; j++)
+			seen = frames[j].lua &&
+			    strcmp(frames[i].module, frames[j].module) == 0;
+		if (!seen)
+			uclua_profile_charge(L, ptop + 2, frames[i].module, dt,
+			    leaf);
+		leaf = false;
+	}
+
+	/* Folded stacks run outermost to innermost. */
+	lua_getfield(L, ptop, "stacks");
+	luaL_buffinit(L, &b);
+	for (i = depth - 1; i >= 0; i--) {
+		luaL_addstring(&b, frames[i].func);
+		if (i > 0)
+			luaL_addchar(&b, ';');
+	}
+	luaL_pushresult(&b);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, ptop + 3);
+	lua_pushinteger(L, lua_tointeger(L, -1) + dt);
+	lua_remove(L, -2);
+	lua_rawset(L, ptop + 3);
+out:
+	lua_settop(L, top);
+}
+
+ucl_object_t *
+uclua_profile(lcookie_t *lcook)
+{
+	lua_State *L;
+	ucl_object_t *obj;
+
+	L = lcook->L;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LPROF_IDX) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		(void)uclua_set_error(lcook, UCLUE_NOPROFILE);
+		return (NULL);
+	}
+
+	/* The folded stacks are only offered through uclua_profile_folded(). */
+	lua_createtable(L, 0, 2);
+	lua_getfield(L, -2, "lines");
+	lua_setfield(L, -2, "lines");
+	lua_getfield(L, -2, "modules");
+	lua_setfield(L, -2, "modules");
+	obj = uclua_convert(lcook, -1);
+	lua_pop(L, 2);
+	return (obj);
+}
+
+int
+uclua_profile_folded(lcookie_t *lcook, FILE *f)
+{
+	lua_State *L;
+	int ret;
+
+	L = lcook->L;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LPROF_IDX) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		(void)uclua_set_error(lcook, UCLUE_NOPROFILE);
+		return (EINVAL);
+	}
+
+	ret = 0;
+	lua_getfield(L, -1, "stacks");
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		if (fprintf(f, "%s %jd\n", lua_tostring(L, -2),
+		    (intmax_t)lua_tointeger(L, -1)) < 0) {
+			ret = feof(f) ? ENOSPC : errno;
+			lua_pop(L, 2);
+			break;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+
+	switch (ret) {
+	case 0:
+		break;
+	case ENOSPC:
+	case EFBIG:
+	case EDQUOT:
+		(void)uclua_set_error(lcook, UCLUE_DUMP_NOSPC);
+		break;
+	default:
+		(void)uclua_set_error(lcook, UCLUE_DUMP_WRITEFAIL);
+		break;
+	}
+
+	return (ret);
+}
@@ -0,0 +1,236 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Module resolution for the sandboxed require() searcher.  Resolving `name`
+ * means trying `name`, then `name.lua`, beneath the sandbox; both the answer
+ * and the directory fd it was found relative to are cached in the registry, so
+ * that documents converted with the same cookie (and repeated requires within
+ * one) don't keep walking the same paths:
+ *
+ *   modules - name -> { file = leaf, sec = mtime, nsec = mtime }; an entry
+ *             without `file` is a negative one
+ *   dirs    - directory -> fd, for modules that live in subdirectories
+ *
+ * An entry is only trusted while its directory's mtime matches the one
+ * recorded, which catches files being added, removed or renamed.  Cached
+ * directory fds aren't revalidated; if the sandbox itself is rearranged then
+ * uclua_sandbox_flush() will drop everything.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "luclua_internal.h"
+
+#define	LSANDBOX_IDX		"uclua_sandbox"
+
+/* Push the cache, creating it on first use. */
+static int
+uclua_sandbox_cache(lua_State *L)
+{
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LSANDBOX_IDX) == LUA_TTABLE)
+		return (lua_gettop(L));
+
+	lua_pop(L, 1);
+	lua_createtable(L, 0, 2);
+	lua_newtable(L);
+	lua_setfield(L, -2, "modules");
+	lua_newtable(L);
+	lua_setfield(L, -2, "dirs");
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LSANDBOX_IDX);
+	return (lua_gettop(L));
+}
+
+/*
+ * Find the directory that `name` lives in, returning an fd for it and pointing
+ * *leaf at the rest of the name.  Returns -1 if the directory can't be opened.
+ */
+static int
+uclua_sandbox_dir(lcookie_t *lcook, lua_State *L, int cidx, const char *name,
+    const char **leaf)
+{
+	const char *slash;
+	int fd;
+
+	slash = strrchr(name, '/');
+	if (slash == NULL) {
+		*leaf = name;
+		return (lcook->dirfd);
+	}
+
+	*leaf = slash + 1;
+	lua_getfield(L, cidx, "dirs");
+	lua_pushlstring(L, name, slash - name);
+	if (lua_rawget(L, -2) == LUA_TNUMBER) {
+		fd = (int)lua_tointeger(L, -1);
+		lua_pop(L, 2);
+		return (fd);
+	}
+
+	lua_pop(L, 1);
+	fd = openat(lcook->dirfd, lua_tostring(L, -1),
+	    O_DIRECTORY | O_SEARCH | O_BENEATH);
+	if (fd != -1) {
+		lua_pushinteger(L, fd);
+		lua_rawset(L, -3);
+	} else {
+		lua_pop(L, 1);
+	}
+
+	lua_pop(L, 1);
+	return (fd);
+}
+
+static void
+uclua_sandbox_record(lua_State *L, int cidx, const char *name,
+    const char *file, const struct stat *dst)
+{
+
+	lua_getfield(L, cidx, "modules");
+	lua_createtable(L, 0, 3);
+	if (file != NULL) {
+		lua_pushstring(L, file);
+		lua_setfield(L, -2, "file");
+	}
+	lua_pushinteger(L, dst->st_mtim.tv_sec);
+	lua_setfield(L, -2, "sec");
+	lua_pushinteger(L, dst->st_mtim.tv_nsec);
+	lua_setfield(L, -2, "nsec");
+	lua_setfield(L, -2, name);
+	lua_pop(L, 1);
+}
+
+/*
+ * Open the module `name` from the sandbox.  Returns -1 with errno set if it
+ * can't be found or opened.
+ */
+int
+uclua_sandbox_open(lcookie_t *lcook, lua_State *L, const char *name)
+{
+	struct stat dst;
+	const char *leaf;
+	char *lname;
+	int cidx, dfd, error, fd, top;
+
+	top = lua_gettop(L);
+	cidx = uclua_sandbox_cache(L);
+	fd = -1;
+
+	dfd = uclua_sandbox_dir(lcook, L, cidx, name, &leaf);
+	if (dfd == -1 || fstat(dfd, &dst) == -1)
+		goto out;
+
+	lua_getfield(L, cidx, "modules");
+	if (lua_getfield(L, -1, name) == LUA_TTABLE) {
+		lua_getfield(L, -1, "sec");
+		lua_getfield(L, -2, "nsec");
+		if (lua_tointeger(L, -2) == dst.st_mtim.tv_sec &&
+		    lua_tointeger(L, -1) == dst.st_mtim.tv_nsec) {
+			if (lua_getfield(L, -3, "file") == LUA_TNIL) {
+				errno = ENOENT;
+				goto out;
+			}
+
+			fd = openat(dfd, lua_tostring(L, -1),
+			    O_RDONLY | O_BENEATH);
+			if (fd != -1)
+				goto found;
+			/* Changed within the mtime granularity; look again. */
+		}
+	}
+
+	lua_settop(L, cidx);
+	fd = openat(dfd, leaf, O_RDONLY | O_BENEATH);
+	if (fd != -1) {
+		uclua_sandbox_record(L, cidx, name, leaf, &dst);
+		goto found;
+	}
+
+	error = errno;
+	lname = NULL;
+	if (asprintf(&lname, "%s.lua", leaf) == -1) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	fd = openat(dfd, lname, O_RDONLY | O_BENEATH);
+	if (fd != -1) {
+		uclua_sandbox_record(L, cidx, name, lname, &dst);
+	} else if (error == ENOENT && errno == ENOENT) {
+		/* Only remember misses that aren't likely to be transient. */
+		uclua_sandbox_record(L, cidx, name, NULL, &dst);
+		errno = ENOENT;
+	}
+
+	free(lname);
+	if (fd == -1)
+		goto out;
+
+found:
+	/* The loader reads it start to finish right away. */
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+out:
+	lua_settop(L, top);
+	return (fd);
+}
+
+void
+uclua_sandbox_flush(lcookie_t *lcook)
+{
+	lua_State *L;
+
+	/* Cached module results came from the old layout, too. */
+	uclua_modcache_flush(lcook);
+
+	L = lcook->L;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LSANDBOX_IDX) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	lua_getfield(L, -1, "dirs");
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		close((int)lua_tointeger(L, -1));
+		lua_pop(L, 1);
+	}
+
+	lua_pop(L, 2);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LSANDBOX_IDX);
+}
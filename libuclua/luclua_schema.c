@@ -0,0 +1,760 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Schema validation during conversion.  uclua_set_schema() compiles a JSON
+ * Schema into a tree of uclua_schema nodes once, and the converter then checks
+ * each value against the node for its position as it's produced: scalars before
+ * they're inserted, containers as soon as their last entry is in.  The first
+ * violation stops the conversion, and uclua_schema_error() says where.
+ *
+ * Supported keywords are type, enum, minimum, maximum, exclusiveMinimum,
+ * exclusiveMaximum (numeric or draft 4 boolean), minLength, maxLength,
+ * minItems, maxItems, minProperties, maxProperties, properties, required,
+ * additionalProperties and items (single schema form).  Anything else is
+ * ignored.
+ */
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luclua_internal.h"
+
+#define	UCLUA_SCHEMA_OBJECT	0x01
+#define	UCLUA_SCHEMA_ARRAY	0x02
+#define	UCLUA_SCHEMA_STRING	0x04
+#define	UCLUA_SCHEMA_INTEGER	0x08
+#define	UCLUA_SCHEMA_NUMBER	0x10
+#define	UCLUA_SCHEMA_BOOLEAN	0x20
+#define	UCLUA_SCHEMA_NULL	0x40
+
+/* Limits that weren't given are left at the widest possible value. */
+struct uclua_schema_prop {
+	const char		*name;
+	size_t			 namelen;
+	struct uclua_schema	*schema;
+	bool			 required;
+};
+
+struct uclua_schema {
+	unsigned int		 types;		/* 0 is anything */
+	double			 min;
+	double			 max;
+	bool			 min_excl;
+	bool			 max_excl;
+	size_t			 minlength;
+	size_t			 maxlength;
+	size_t			 minitems;
+	size_t			 maxitems;
+	size_t			 minprops;
+	size_t			 maxprops;
+	ucl_object_t		*enumv;
+	struct uclua_schema_prop *props;	/* sorted by name */
+	size_t			 nprops;
+	size_t			 nrequired;
+	struct uclua_schema	*additional;
+	bool			 noadditional;
+	struct uclua_schema	*items;
+};
+
+static const struct {
+	const char	*name;
+	unsigned int	 type;
+} uclua_schema_types[] = {
+	{ "object",	UCLUA_SCHEMA_OBJECT },
+	{ "array",	UCLUA_SCHEMA_ARRAY },
+	{ "string",	UCLUA_SCHEMA_STRING },
+	{ "integer",	UCLUA_SCHEMA_INTEGER },
+	{ "number",	UCLUA_SCHEMA_NUMBER },
+	{ "boolean",	UCLUA_SCHEMA_BOOLEAN },
+	{ "null",	UCLUA_SCHEMA_NULL },
+};
+
+/* Stands in for missing subschemas, so that callers needn't check. */
+static struct uclua_schema uclua_schema_any = {
+	.min = -HUGE_VAL,
+	.max = HUGE_VAL,
+	.maxlength = SIZE_MAX,
+	.maxitems = SIZE_MAX,
+	.maxprops = SIZE_MAX,
+};
+
+static void uclua_schema_free(struct uclua_schema *);
+
+static bool __printflike(2, 3)
+uclua_schema_fail(lcookie_t *lcook, const char *fmt, ...)
+{
+	va_list ap;
+	char *msg;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vasprintf(&msg, fmt, ap);
+	va_end(ap);
+
+	free(lcook->schema_msg);
+	lcook->schema_msg = ret == -1 ? NULL : msg;
+	return (false);
+}
+
+static bool __printflike(2, 3)
+uclua_schema_invalid(lcookie_t *lcook, const char *fmt, ...)
+{
+	va_list ap;
+	char *msg;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vasprintf(&msg, fmt, ap);
+	va_end(ap);
+
+	if (ret == -1) {
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (false);
+	}
+
+	(void)uclua_schema_fail(lcook, "%s: %s",
+	    lcook->schema_pathlen == 0 ? "<root>" : lcook->schema_path, msg);
+	free(msg);
+	(void)uclua_set_error(lcook, UCLUE_SCHEMA);
+	return (false);
+}
+
+static int
+uclua_schema_propcmp(const void *a, const void *b)
+{
+	const struct uclua_schema_prop *pa, *pb;
+	int cmp;
+
+	pa = a;
+	pb = b;
+	cmp = memcmp(pa->name, pb->name, MIN(pa->namelen, pb->namelen));
+	if (cmp != 0)
+		return (cmp);
+	return ((pa->namelen > pb->namelen) - (pa->namelen < pb->namelen));
+}
+
+static struct uclua_schema_prop *
+uclua_schema_prop(const struct uclua_schema *schema, const char *name,
+    size_t namelen)
+{
+	struct uclua_schema_prop key;
+
+	if (schema->nprops == 0)
+		return (NULL);
+
+	key.name = name;
+	key.namelen = namelen;
+	return (bsearch(&key, schema->props, schema->nprops,
+	    sizeof(*schema->props), uclua_schema_propcmp));
+}
+
+static bool
+uclua_schema_size(lcookie_t *lcook, const ucl_object_t *obj, const char *kw,
+    size_t *valp)
+{
+	int64_t val;
+
+	if (ucl_object_type(obj) != UCL_INT ||
+	    (val = ucl_object_toint(obj)) < 0)
+		return (uclua_schema_fail(lcook, "schema: %s must be a "
+		    "non-negative integer", kw));
+
+	*valp = (size_t)val;
+	return (true);
+}
+
+static bool
+uclua_schema_number(lcookie_t *lcook, const ucl_object_t *obj, const char *kw,
+    double *valp)
+{
+
+	switch (ucl_object_type(obj)) {
+	case UCL_INT:
+	case UCL_FLOAT:
+		*valp = ucl_object_todouble(obj);
+		return (true);
+	default:
+		return (uclua_schema_fail(lcook, "schema: %s must be a number",
+		    kw));
+	}
+}
+
+static bool
+uclua_schema_compile_type(lcookie_t *lcook, struct uclua_schema *schema,
+    const ucl_object_t *obj)
+{
+	ucl_object_iter_t it;
+	const ucl_object_t *elt;
+	const char *name;
+	size_t i;
+
+	it = NULL;
+	while ((elt = ucl_object_iterate(obj, &it, true)) != NULL) {
+		if ((name = ucl_object_tostring(elt)) == NULL)
+			return (uclua_schema_fail(lcook, "schema: type must "
+			    "be a string or array of strings"));
+		for (i = 0; i < nitems(uclua_schema_types); i++) {
+			if (strcmp(name, uclua_schema_types[i].name) == 0)
+				break;
+		}
+		if (i == nitems(uclua_schema_types))
+			return (uclua_schema_fail(lcook,
+			    "schema: unknown type '%s'", name));
+		schema->types |= uclua_schema_types[i].type;
+	}
+
+	return (true);
+}
+
+static struct uclua_schema *
+uclua_schema_compile(lcookie_t *lcook, const ucl_object_t *obj)
+{
+	struct uclua_schema *schema;
+	struct uclua_schema_prop *prop;
+	ucl_object_iter_t it;
+	const ucl_object_t *elt, *props, *req;
+	const char *name;
+	size_t i, len, namelen;
+
+	if (ucl_object_type(obj) != UCL_OBJECT) {
+		(void)uclua_schema_fail(lcook, "schema: expected an object");
+		return (NULL);
+	}
+
+	schema = malloc(sizeof(*schema));
+	if (schema == NULL) {
+		(void)uclua_schema_fail(lcook, "schema: out of memory");
+		return (NULL);
+	}
+	*schema = uclua_schema_any;
+
+	it = NULL;
+	while ((elt = ucl_object_iterate(obj, &it, true)) != NULL) {
+		name = ucl_object_key(elt);
+		if (strcmp(name, "type") == 0) {
+			if (!uclua_schema_compile_type(lcook, schema, elt))
+				goto fail;
+		} else if (strcmp(name, "enum") == 0) {
+			if (ucl_object_type(elt) != UCL_ARRAY) {
+				(void)uclua_schema_fail(lcook,
+				    "schema: enum must be an array");
+				goto fail;
+			}
+			schema->enumv = ucl_object_ref(elt);
+		} else if (strcmp(name, "minimum") == 0) {
+			if (!uclua_schema_number(lcook, elt, name,
+			    &schema->min))
+				goto fail;
+		} else if (strcmp(name, "maximum") == 0) {
+			if (!uclua_schema_number(lcook, elt, name,
+			    &schema->max))
+				goto fail;
+		} else if (strcmp(name, "exclusiveMinimum") == 0) {
+			if (ucl_object_type(elt) == UCL_BOOLEAN) {
+				schema->min_excl = ucl_object_toboolean(elt);
+			} else if (uclua_schema_number(lcook, elt, name,
+			    &schema->min)) {
+				schema->min_excl = true;
+			} else {
+				goto fail;
+			}
+		} else if (strcmp(name, "exclusiveMaximum") == 0) {
+			if (ucl_object_type(elt) == UCL_BOOLEAN) {
+				schema->max_excl = ucl_object_toboolean(elt);
+			} else if (uclua_schema_number(lcook, elt, name,
+			    &schema->max)) {
+				schema->max_excl = true;
+			} else {
+				goto fail;
+			}
+		} else if (strcmp(name, "minLength") == 0) {
+			if (!uclua_schema_size(lcook, elt, name,
+			    &schema->minlength))
+				goto fail;
+		} else if (strcmp(name, "maxLength") == 0) {
+			if (!uclua_schema_size(lcook, elt, name,
+			    &schema->maxlength))
+				goto fail;
+		} else if (strcmp(name, "minItems") == 0) {
+			if (!uclua_schema_size(lcook, elt, name,
+			    &schema->minitems))
+				goto fail;
+		} else if (strcmp(name, "maxItems") == 0) {
+			if (!uclua_schema_size(lcook, elt, name,
+			    &schema->maxitems))
+				goto fail;
+		} else if (strcmp(name, "minProperties") == 0) {
+			if (!uclua_schema_size(lcook, elt, name,
+			    &schema->minprops))
+				goto fail;
+		} else if (strcmp(name, "maxProperties") == 0) {
+			if (!uclua_schema_size(lcook, elt, name,
+			    &schema->maxprops))
+				goto fail;
+		} else if (strcmp(name, "additionalProperties") == 0) {
+			if (ucl_object_type(elt) == UCL_BOOLEAN) {
+				schema->noadditional =
+				    !ucl_object_toboolean(elt);
+			} else if ((schema->additional =
+			    uclua_schema_compile(lcook, elt)) == NULL) {
+				goto fail;
+			}
+		} else if (strcmp(name, "items") == 0) {
+			if (ucl_object_type(elt) != UCL_OBJECT) {
+				(void)uclua_schema_fail(lcook, "schema: only a "
+				    "single schema is supported for items");
+				goto fail;
+			}
+			if ((schema->items = uclua_schema_compile(lcook,
+			    elt)) == NULL)
+				goto fail;
+		}
+	}
+
+	/*
+	 * Required keys without a schema of their own still get a property, so
+	 * that they can be found and counted the same way.
+	 */
+	props = ucl_object_lookup(obj, "properties");
+	req = ucl_object_lookup(obj, "required");
+	if (props != NULL && ucl_object_type(props) != UCL_OBJECT) {
+		(void)uclua_schema_fail(lcook,
+		    "schema: properties must be an object");
+		goto fail;
+	}
+	if (req != NULL && ucl_object_type(req) != UCL_ARRAY) {
+		(void)uclua_schema_fail(lcook,
+		    "schema: required must be an array");
+		goto fail;
+	}
+
+	/* Property names point into the source, which is kept referenced. */
+	len = (props != NULL ? props->len : 0) + (req != NULL ? req->len : 0);
+	if (len == 0)
+		return (schema);
+
+	schema->props = calloc(len, sizeof(*schema->props));
+	if (schema->props == NULL) {
+		(void)uclua_schema_fail(lcook, "schema: out of memory");
+		goto fail;
+	}
+
+	it = NULL;
+	while (props != NULL &&
+	    (elt = ucl_object_iterate(props, &it, true)) != NULL) {
+		prop = &schema->props[schema->nprops];
+		prop->name = ucl_object_keyl(elt, &prop->namelen);
+		if ((prop->schema = uclua_schema_compile(lcook, elt)) == NULL)
+			goto fail;
+		schema->nprops++;
+	}
+	qsort(schema->props, schema->nprops, sizeof(*schema->props),
+	    uclua_schema_propcmp);
+
+	it = NULL;
+	while (req != NULL &&
+	    (elt = ucl_object_iterate(req, &it, true)) != NULL) {
+		if (ucl_object_type(elt) != UCL_STRING) {
+			(void)uclua_schema_fail(lcook,
+			    "schema: required must only contain strings");
+			goto fail;
+		}
+
+		name = ucl_object_tolstring(elt, &namelen);
+		prop = uclua_schema_prop(schema, name, namelen);
+		if (prop == NULL) {
+			prop = &schema->props[schema->nprops++];
+			prop->name = name;
+			prop->namelen = namelen;
+			qsort(schema->props, schema->nprops,
+			    sizeof(*schema->props), uclua_schema_propcmp);
+			prop = uclua_schema_prop(schema, name, namelen);
+		}
+
+		if (!prop->required) {
+			prop->required = true;
+			schema->nrequired++;
+		}
+	}
+
+	for (i = 0; i < schema->nprops; i++) {
+		if (schema->props[i].schema == NULL)
+			schema->props[i].schema = &uclua_schema_any;
+	}
+
+	return (schema);
+fail:
+	uclua_schema_free(schema);
+	return (NULL);
+}
+
+static void
+uclua_schema_free(struct uclua_schema *schema)
+{
+	size_t i;
+
+	if (schema == NULL || schema == &uclua_schema_any)
+		return;
+
+	for (i = 0; i < schema->nprops; i++)
+		uclua_schema_free(schema->props[i].schema);
+	free(schema->props);
+	uclua_schema_free(schema->additional);
+	uclua_schema_free(schema->items);
+	if (schema->enumv != NULL)
+		ucl_object_unref(schema->enumv);
+	free(schema);
+}
+
+/*
+ * A NULL schema turns validation back off.  The schema object is referenced for
+ * as long as the compiled form is in use.
+ */
+bool
+uclua_set_schema(lcookie_t *lcook, const ucl_object_t *obj)
+{
+	struct uclua_schema *schema;
+
+	schema = NULL;
+	if (obj != NULL &&
+	    (schema = uclua_schema_compile(lcook, obj)) == NULL) {
+		(void)uclua_set_error(lcook, UCLUE_BADSCHEMA);
+		return (false);
+	}
+
+	uclua_schema_free(lcook->schema_root);
+	if (lcook->schema_src != NULL)
+		ucl_object_unref(lcook->schema_src);
+	lcook->schema_root = schema;
+	lcook->schema_src = obj != NULL ? ucl_object_ref(obj) : NULL;
+	return (true);
+}
+
+const char *
+uclua_schema_error(lcookie_t *lcook)
+{
+
+	return (lcook->schema_msg);
+}
+
+void
+uclua_schema_release(lcookie_t *lcook)
+{
+
+	uclua_schema_free(lcook->schema_root);
+	if (lcook->schema_src != NULL)
+		ucl_object_unref(lcook->schema_src);
+	free(lcook->schema_path);
+	free(lcook->schema_msg);
+}
+
+static bool __printflike(2, 3)
+uclua_schema_path_add(lcookie_t *lcook, const char *fmt, ...)
+{
+	va_list ap;
+	char *path;
+	size_t avail, cap;
+	int len;
+
+	for (;;) {
+		avail = lcook->schema_pathcap - lcook->schema_pathlen;
+		va_start(ap, fmt);
+		len = vsnprintf(lcook->schema_path == NULL ? NULL :
+		    lcook->schema_path + lcook->schema_pathlen, avail, fmt, ap);
+		va_end(ap);
+		if (len < 0) {
+			(void)uclua_set_error(lcook, UCLUE_NOMEM);
+			return (false);
+		}
+		if ((size_t)len < avail)
+			break;
+
+		cap = MAX(lcook->schema_pathcap * 2,
+		    lcook->schema_pathlen + len + 1);
+		cap = MAX(cap, 64);
+		path = realloc(lcook->schema_path, cap);
+		if (path == NULL) {
+			(void)uclua_set_error(lcook, UCLUE_NOMEM);
+			return (false);
+		}
+		lcook->schema_path = path;
+		lcook->schema_pathcap = cap;
+	}
+
+	lcook->schema_pathlen += len;
+	return (true);
+}
+
+void
+uclua_schema_leave(lcookie_t *lcook, size_t len)
+{
+
+	lcook->schema_pathlen = len;
+	if (lcook->schema_path != NULL)
+		lcook->schema_path[len] = '\0';
+}
+
+static const struct uclua_schema *
+uclua_schema_child(lcookie_t *lcook, const struct uclua_schema *parent,
+    const char *key, size_t keylen)
+{
+	const struct uclua_schema_prop *prop;
+
+	prop = uclua_schema_prop(parent, key, keylen);
+	if (prop != NULL)
+		return (prop->schema);
+	if (parent->noadditional) {
+		(void)uclua_schema_invalid(lcook, "property not allowed");
+		return (NULL);
+	}
+	return (parent->additional != NULL ? parent->additional :
+	    &uclua_schema_any);
+}
+
+/*
+ * Descend into the entry whose key is just below the value at the top of the
+ * stack, returning the schema for its value.
+ */
+const struct uclua_schema *
+uclua_schema_enter(lcookie_t *lcook, const struct uclua_schema *parent,
+    bool array)
+{
+	lua_State *L;
+	const struct uclua_schema *child;
+	const char *key;
+	size_t keylen;
+
+	L = lcook->L;
+	if (array) {
+		if (!uclua_schema_path_add(lcook, "[%jd]",
+		    (intmax_t)lua_tointeger(L, -2)))
+			return (NULL);
+		return (parent->items != NULL ? parent->items :
+		    &uclua_schema_any);
+	}
+
+	key = luaL_tolstring(L, -2, &keylen);
+	if (!uclua_schema_path_add(lcook, "%s%s",
+	    lcook->schema_pathlen == 0 ? "" : ".", key)) {
+		lua_pop(L, 1);
+		return (NULL);
+	}
+
+	child = uclua_schema_child(lcook, parent, key, keylen);
+	lua_pop(L, 1);
+	return (child);
+}
+
+static bool
+uclua_schema_check_type(lcookie_t *lcook, const struct uclua_schema *schema,
+    const ucl_object_t *obj)
+{
+	unsigned int types;
+	double d;
+
+	types = schema->types;
+	switch (ucl_object_type(obj)) {
+	case UCL_OBJECT:
+		if ((types & UCLUA_SCHEMA_OBJECT) != 0)
+			return (true);
+		break;
+	case UCL_ARRAY:
+		if ((types & UCLUA_SCHEMA_ARRAY) != 0)
+			return (true);
+		break;
+	case UCL_STRING:
+		if ((types & UCLUA_SCHEMA_STRING) != 0)
+			return (true);
+		break;
+	case UCL_INT:
+		if ((types & (UCLUA_SCHEMA_INTEGER | UCLUA_SCHEMA_NUMBER)) != 0)
+			return (true);
+		break;
+	case UCL_FLOAT:
+		if ((types & UCLUA_SCHEMA_NUMBER) != 0)
+			return (true);
+		d = ucl_object_todouble(obj);
+		if ((types & UCLUA_SCHEMA_INTEGER) != 0 && d == (int64_t)d)
+			return (true);
+		break;
+	case UCL_BOOLEAN:
+		if ((types & UCLUA_SCHEMA_BOOLEAN) != 0)
+			return (true);
+		break;
+	case UCL_NULL:
+		if ((types & UCLUA_SCHEMA_NULL) != 0)
+			return (true);
+		break;
+	default:
+		break;
+	}
+
+	return (uclua_schema_invalid(lcook, "unexpected %s",
+	    ucl_object_type_to_string(ucl_object_type(obj))));
+}
+
+/*
+ * Check `obj` itself against `schema`; containers are expected to be complete,
+ * but their entries have already been checked on the way in.
+ */
+bool
+uclua_schema_check(lcookie_t *lcook, const struct uclua_schema *schema,
+    const ucl_object_t *obj)
+{
+	ucl_object_iter_t it;
+	const ucl_object_t *elt;
+	const struct uclua_schema_prop *prop;
+	const char *what;
+	double d;
+	size_t i, len, maxlen, minlen;
+
+	if (schema == &uclua_schema_any)
+		return (true);
+	if (schema->types != 0 && !uclua_schema_check_type(lcook, schema, obj))
+		return (false);
+
+	if (schema->enumv != NULL) {
+		it = NULL;
+		while ((elt = ucl_object_iterate(schema->enumv, &it,
+		    true)) != NULL) {
+			if (ucl_object_compare(elt, obj) == 0)
+				break;
+		}
+		if (elt == NULL)
+			return (uclua_schema_invalid(lcook,
+			    "not one of the allowed values"));
+	}
+
+	switch (ucl_object_type(obj)) {
+	case UCL_INT:
+	case UCL_FLOAT:
+		d = ucl_object_todouble(obj);
+		if (d < schema->min || (schema->min_excl && d == schema->min))
+			return (uclua_schema_invalid(lcook, "%g is below the "
+			    "%sminimum of %g", d, schema->min_excl ?
+			    "exclusive " : "", schema->min));
+		if (d > schema->max || (schema->max_excl && d == schema->max))
+			return (uclua_schema_invalid(lcook, "%g is above the "
+			    "%smaximum of %g", d, schema->max_excl ?
+			    "exclusive " : "", schema->max));
+		return (true);
+	case UCL_STRING:
+		what = "length";
+		(void)ucl_object_tolstring(obj, &len);
+		minlen = schema->minlength;
+		maxlen = schema->maxlength;
+		break;
+	case UCL_ARRAY:
+		what = "item count";
+		len = obj->len;
+		minlen = schema->minitems;
+		maxlen = schema->maxitems;
+		break;
+	case UCL_OBJECT:
+		what = "property count";
+		len = obj->len;
+		minlen = schema->minprops;
+		maxlen = schema->maxprops;
+		break;
+	default:
+		return (true);
+	}
+
+	if (len < minlen)
+		return (uclua_schema_invalid(lcook, "%s %zu is below the "
+		    "minimum of %zu", what, len, minlen));
+	if (len > maxlen)
+		return (uclua_schema_invalid(lcook, "%s %zu is above the "
+		    "maximum of %zu", what, len, maxlen));
+
+	if (ucl_object_type(obj) != UCL_OBJECT || schema->nrequired == 0)
+		return (true);
+
+	for (i = 0; i < schema->nprops; i++) {
+		prop = &schema->props[i];
+		if (prop->required && ucl_object_lookup_len(obj, prop->name,
+		    prop->namelen) == NULL)
+			return (uclua_schema_invalid(lcook, "missing required "
+			    "property '%.*s'", (int)prop->namelen, prop->name));
+	}
+
+	return (true);
+}
+
+/*
+ * Check an already converted subtree, e.g. one that was shared from elsewhere
+ * or produced from a checkpoint overlay.
+ */
+bool
+uclua_schema_validate(lcookie_t *lcook, const struct uclua_schema *schema,
+    const ucl_object_t *obj)
+{
+	ucl_object_iter_t it;
+	const struct uclua_schema *child;
+	const ucl_object_t *elt;
+	const char *key;
+	size_t idx, keylen, plen;
+	bool ok;
+
+	if (schema == &uclua_schema_any)
+		return (true);
+
+	it = NULL;
+	idx = 0;
+	plen = lcook->schema_pathlen;
+	while ((ucl_object_type(obj) == UCL_OBJECT ||
+	    ucl_object_type(obj) == UCL_ARRAY) &&
+	    (elt = ucl_object_iterate(obj, &it, true)) != NULL) {
+		if (ucl_object_type(obj) == UCL_ARRAY) {
+			ok = uclua_schema_path_add(lcook, "[%zu]", ++idx);
+			child = schema->items != NULL ? schema->items :
+			    &uclua_schema_any;
+		} else {
+			key = ucl_object_keyl(elt, &keylen);
+			ok = uclua_schema_path_add(lcook, "%s%.*s",
+			    plen == 0 ? "" : ".", (int)keylen, key);
+			child = ok ? uclua_schema_child(lcook, schema, key,
+			    keylen) : NULL;
+		}
+
+		ok = ok && child != NULL &&
+		    uclua_schema_validate(lcook, child, elt);
+		uclua_schema_leave(lcook, plen);
+		if (!ok)
+			return (false);
+	}
+
+	return (uclua_schema_check(lcook, schema, obj));
+}
@@ -0,0 +1,737 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Flat snapshots: a read-only, offset-based encoding of a converted tree that
+ * readers use straight out of an mmap(2) of the file, with no parsing and no
+ * copies.  The layout, all in the writer's byte order:
+ *
+ *   header   - struct uclua_snap_header
+ *   nodes    - struct uclua_snap_node, each followed by its payload; children
+ *              are written before their parents, so the root comes last
+ *   strings  - every distinct key and string value once, NUL-terminated
+ *
+ * Payloads by type:
+ *
+ *   UCL_INT, UCL_FLOAT - the 8-byte value
+ *   UCL_STRING         - uint32_t string offset; count is the length
+ *   UCL_BOOLEAN        - none; count is the value
+ *   UCL_ARRAY          - count uint32_t node offsets
+ *   UCL_OBJECT         - count struct uclua_snap_entry, sorted by key
+ *
+ * Node offsets are from the start of the file and are 4-byte aligned; string
+ * offsets are from the start of the string pool.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "luclua_internal.h"
+
+#define	UCLUA_SNAP_MAGIC	"UCLSNAP"
+#define	UCLUA_SNAP_VERSION	1
+#define	UCLUA_SNAP_BYTEORDER	0x01020304
+
+struct uclua_snap_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteorder;
+	uint32_t	size;		/* of the whole file */
+	uint32_t	root;
+	uint32_t	strings;
+	uint32_t	strsize;
+};
+
+struct uclua_snap_node {
+	uint32_t	type;
+	uint32_t	count;
+};
+
+struct uclua_snap_entry {
+	uint32_t	key;
+	uint32_t	keylen;
+	uint32_t	val;
+};
+
+struct uclua_snapshot {
+	const char	*base;
+	size_t		 size;
+	const char	*strings;
+	uint32_t	 strsize;
+	uint32_t	 root;
+};
+
+/* Writer */
+
+struct uclua_snap_intern {
+	uint64_t	hash;
+	uint32_t	off;
+	uint32_t	len;
+};
+
+struct uclua_snapw {
+	char			*nodes;
+	size_t			 nodelen;
+	size_t			 nodecap;
+	char			*pool;
+	size_t			 poollen;
+	size_t			 poolcap;
+	struct uclua_snap_intern *intern;
+	size_t			 ninterned;
+	size_t			 maxinterned;
+};
+
+/* Sort scratch for an object's entries. */
+struct uclua_snapw_key {
+	const char		*key;
+	struct uclua_snap_entry	 ent;
+};
+
+static bool
+uclua_snapw_grow(char **bufp, size_t *capp, size_t need)
+{
+	char *buf;
+	size_t cap;
+
+	if (need <= *capp)
+		return (true);
+	if (need > UINT32_MAX)
+		return (false);
+
+	cap = MAX(MAX(*capp * 2, need), 4096);
+	buf = realloc(*bufp, cap);
+	if (buf == NULL)
+		return (false);
+	*bufp = buf;
+	*capp = cap;
+	return (true);
+}
+
+static uint64_t
+uclua_snapw_hash(const char *str, size_t len)
+{
+	uint64_t h;
+
+	h = 0xcbf29ce484222325ULL;
+	while (len-- > 0) {
+		h ^= (unsigned char)*str++;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+/* Add `str` to the pool once, returning its offset there. */
+static bool
+uclua_snapw_string(struct uclua_snapw *w, const char *str, size_t len,
+    uint32_t *offp)
+{
+	struct uclua_snap_intern *ents, *ent;
+	size_t i, nslots, slot;
+	uint64_t h;
+
+	if ((w->ninterned + 1) * 4 > w->maxinterned * 3) {
+		nslots = MAX(w->maxinterned * 2, 1024);
+		ents = calloc(nslots, sizeof(*ents));
+		if (ents == NULL)
+			return (false);
+		for (i = 0; i < w->maxinterned; i++) {
+			if (w->intern[i].hash == 0)
+				continue;
+			slot = w->intern[i].hash & (nslots - 1);
+			while (ents[slot].hash != 0)
+				slot = (slot + 1) & (nslots - 1);
+			ents[slot] = w->intern[i];
+		}
+		free(w->intern);
+		w->intern = ents;
+		w->maxinterned = nslots;
+	}
+
+	/* A zero hash marks an empty slot, so keep real ones out of its way. */
+	h = uclua_snapw_hash(str, len) | 1;
+	slot = h & (w->maxinterned - 1);
+	for (;;) {
+		ent = &w->intern[slot];
+		if (ent->hash == 0) {
+			break;
+		} else if (ent->hash == h && ent->len == len &&
+		    memcmp(w->pool + ent->off, str, len) == 0) {
+			*offp = ent->off;
+			return (true);
+		}
+		slot = (slot + 1) & (w->maxinterned - 1);
+	}
+
+	if (!uclua_snapw_grow(&w->pool, &w->poolcap, w->poollen + len + 1))
+		return (false);
+	memcpy(w->pool + w->poollen, str, len);
+	w->pool[w->poollen + len] = '\0';
+
+	ent->hash = h;
+	ent->off = (uint32_t)w->poollen;
+	ent->len = (uint32_t)len;
+	w->ninterned++;
+	w->poollen += len + 1;
+	*offp = ent->off;
+	return (true);
+}
+
+static int
+uclua_snapw_keycmp(const void *a, const void *b)
+{
+	const struct uclua_snapw_key *ka, *kb;
+	int cmp;
+
+	ka = a;
+	kb = b;
+	cmp = memcmp(ka->key, kb->key, MIN(ka->ent.keylen, kb->ent.keylen));
+	if (cmp != 0)
+		return (cmp);
+	return ((ka->ent.keylen > kb->ent.keylen) -
+	    (ka->ent.keylen < kb->ent.keylen));
+}
+
+/* Reserve a node with `payload` bytes after it, returning its file offset. */
+static bool
+uclua_snapw_node(struct uclua_snapw *w, uint32_t type, uint32_t count,
+    size_t payload, uint32_t *offp, void **payloadp)
+{
+	struct uclua_snap_node node;
+	size_t len;
+
+	len = sizeof(node) + roundup2(payload, sizeof(uint32_t));
+	if (!uclua_snapw_grow(&w->nodes, &w->nodecap, w->nodelen + len +
+	    sizeof(struct uclua_snap_header)))
+		return (false);
+
+	node.type = type;
+	node.count = count;
+	memcpy(w->nodes + w->nodelen, &node, sizeof(node));
+	*payloadp = w->nodes + w->nodelen + sizeof(node);
+	*offp = (uint32_t)(sizeof(struct uclua_snap_header) + w->nodelen);
+	w->nodelen += len;
+	return (true);
+}
+
+static bool
+uclua_snapw_write(struct uclua_snapw *w, const ucl_object_t *obj,
+    uint32_t *offp)
+{
+	ucl_object_iter_t it;
+	struct uclua_snapw_key *keys;
+	const ucl_object_t *elt;
+	const char *str;
+	void *payload;
+	uint32_t *children, count, soff;
+	size_t i, len;
+	int64_t iv;
+	double dv;
+	bool ok;
+
+	switch (ucl_object_type(obj)) {
+	case UCL_INT:
+		iv = ucl_object_toint(obj);
+		if (!uclua_snapw_node(w, UCL_INT, 0, sizeof(iv), offp,
+		    &payload))
+			return (false);
+		memcpy(payload, &iv, sizeof(iv));
+		return (true);
+	case UCL_FLOAT:
+		dv = ucl_object_todouble(obj);
+		if (!uclua_snapw_node(w, UCL_FLOAT, 0, sizeof(dv), offp,
+		    &payload))
+			return (false);
+		memcpy(payload, &dv, sizeof(dv));
+		return (true);
+	case UCL_STRING:
+		str = ucl_object_tolstring(obj, &len);
+		if (!uclua_snapw_string(w, str, len, &soff) ||
+		    !uclua_snapw_node(w, UCL_STRING, (uint32_t)len,
+		    sizeof(soff), offp, &payload))
+			return (false);
+		memcpy(payload, &soff, sizeof(soff));
+		return (true);
+	case UCL_BOOLEAN:
+		return (uclua_snapw_node(w, UCL_BOOLEAN,
+		    ucl_object_toboolean(obj), 0, offp, &payload));
+	case UCL_NULL:
+		return (uclua_snapw_node(w, UCL_NULL, 0, 0, offp, &payload));
+	case UCL_ARRAY:
+	case UCL_OBJECT:
+		break;
+	default:
+		return (false);
+	}
+
+	/* Children first, so that their offsets are known. */
+	count = obj->len;
+	keys = NULL;
+	children = NULL;
+	if (ucl_object_type(obj) == UCL_OBJECT)
+		keys = calloc(MAX(count, 1), sizeof(*keys));
+	else
+		children = calloc(MAX(count, 1), sizeof(*children));
+	if (keys == NULL && children == NULL)
+		return (false);
+
+	ok = true;
+	i = 0;
+	it = NULL;
+	while (ok && i < count &&
+	    (elt = ucl_object_iterate(obj, &it, true)) != NULL) {
+		if (children != NULL) {
+			ok = uclua_snapw_write(w, elt, &children[i++]);
+			continue;
+		}
+
+		str = ucl_object_keyl(elt, &len);
+		keys[i].key = str;
+		keys[i].ent.keylen = (uint32_t)len;
+		ok = uclua_snapw_string(w, str, len, &keys[i].ent.key) &&
+		    uclua_snapw_write(w, elt, &keys[i].ent.val);
+		i++;
+	}
+	count = (uint32_t)i;
+
+	if (ok && children != NULL) {
+		ok = uclua_snapw_node(w, UCL_ARRAY, count,
+		    count * sizeof(*children), offp, &payload);
+		if (ok)
+			memcpy(payload, children, count * sizeof(*children));
+	} else if (ok) {
+		qsort(keys, count, sizeof(*keys), uclua_snapw_keycmp);
+		ok = uclua_snapw_node(w, UCL_OBJECT, count,
+		    count * sizeof(struct uclua_snap_entry), offp, &payload);
+		for (i = 0; ok && i < count; i++) {
+			memcpy((char *)payload + i * sizeof(keys[i].ent),
+			    &keys[i].ent, sizeof(keys[i].ent));
+		}
+	}
+
+	free(keys);
+	free(children);
+	return (ok);
+}
+
+int
+uclua_dump_snapshot(const ucl_object_t *ucl, FILE *f, uclua_error *error)
+{
+	struct uclua_snapw w;
+	struct uclua_snap_header hdr;
+	size_t size;
+	uint32_t root;
+	int ret;
+
+	memset(&w, 0, sizeof(w));
+	ret = 0;
+	if (!uclua_snapw_write(&w, ucl, &root)) {
+		*error = UCLUE_DUMP_EMITFAIL;
+		ret = EINVAL;
+		goto out;
+	}
+
+	size = sizeof(hdr) + w.nodelen + w.poollen;
+	if (size > UINT32_MAX) {
+		*error = UCLUE_DUMP_EMITFAIL;
+		ret = EFBIG;
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, UCLUA_SNAP_MAGIC, sizeof(UCLUA_SNAP_MAGIC));
+	hdr.version = UCLUA_SNAP_VERSION;
+	hdr.byteorder = UCLUA_SNAP_BYTEORDER;
+	hdr.size = (uint32_t)size;
+	hdr.root = root;
+	hdr.strings = (uint32_t)(sizeof(hdr) + w.nodelen);
+	hdr.strsize = (uint32_t)w.poollen;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    (w.nodelen != 0 && fwrite(w.nodes, w.nodelen, 1, f) != 1) ||
+	    (w.poollen != 0 && fwrite(w.pool, w.poollen, 1, f) != 1)) {
+		ret = feof(f) ? ENOSPC : errno;
+		switch (ret) {
+		case ENOSPC:
+		case EFBIG:
+		case EDQUOT:
+			*error = UCLUE_DUMP_NOSPC;
+			break;
+		default:
+			*error = UCLUE_DUMP_WRITEFAIL;
+			break;
+		}
+	}
+out:
+	free(w.nodes);
+	free(w.pool);
+	free(w.intern);
+	return (ret);
+}
+
+/* Reader */
+
+/*
+ * Every node is bounds checked as it's reached, so a truncated or corrupt file
+ * yields NULLs rather than stray reads.
+ */
+static const struct uclua_snap_node *
+uclua_snap_node(const struct uclua_snapshot *snap, uint32_t off,
+    size_t *paylenp)
+{
+	const struct uclua_snap_node *node;
+	size_t paylen;
+
+	if (off < sizeof(struct uclua_snap_header) || (off & 3) != 0 ||
+	    off > snap->size - sizeof(*node))
+		return (NULL);
+
+	node = (const struct uclua_snap_node *)(const void *)(snap->base + off);
+	switch (node->type) {
+	case UCL_INT:
+	case UCL_FLOAT:
+		paylen = sizeof(int64_t);
+		break;
+	case UCL_STRING:
+		paylen = sizeof(uint32_t);
+		break;
+	case UCL_ARRAY:
+		paylen = (size_t)node->count * sizeof(uint32_t);
+		break;
+	case UCL_OBJECT:
+		paylen = (size_t)node->count * sizeof(struct uclua_snap_entry);
+		break;
+	default:
+		paylen = 0;
+		break;
+	}
+
+	if (paylen > snap->size - off - sizeof(*node))
+		return (NULL);
+	if (paylenp != NULL)
+		*paylenp = paylen;
+	return (node);
+}
+
+static const char *
+uclua_snap_string(const struct uclua_snapshot *snap, uint32_t off, uint32_t len)
+{
+
+	if (off >= snap->strsize || len >= snap->strsize - off ||
+	    snap->strings[off + len] != '\0')
+		return (NULL);
+	return (snap->strings + off);
+}
+
+static const struct uclua_snap_entry *
+uclua_snap_entries(const struct uclua_snap_node *node)
+{
+
+	return ((const struct uclua_snap_entry *)(const void *)(node + 1));
+}
+
+static const uint32_t *
+uclua_snap_children(const struct uclua_snap_node *node)
+{
+
+	return ((const uint32_t *)(const void *)(node + 1));
+}
+
+struct uclua_snapshot *
+uclua_snapshot_open(const char *path)
+{
+	struct uclua_snapshot *snap;
+	struct uclua_snap_header hdr;
+	struct stat st;
+	void *base;
+	int fd, serrno;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (NULL);
+
+	base = MAP_FAILED;
+	snap = NULL;
+	if (fstat(fd, &st) == -1)
+		goto fail;
+	if (st.st_size < (off_t)sizeof(hdr) || st.st_size > UINT32_MAX) {
+		errno = EFTYPE;
+		goto fail;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		goto fail;
+
+	memcpy(&hdr, base, sizeof(hdr));
+	if (memcmp(hdr.magic, UCLUA_SNAP_MAGIC,
+	    sizeof(UCLUA_SNAP_MAGIC)) != 0 ||
+	    hdr.version != UCLUA_SNAP_VERSION ||
+	    hdr.byteorder != UCLUA_SNAP_BYTEORDER ||
+	    hdr.size != st.st_size || hdr.strings < sizeof(hdr) ||
+	    hdr.strings > hdr.size || hdr.strsize != hdr.size - hdr.strings) {
+		errno = EFTYPE;
+		goto fail;
+	}
+
+	snap = malloc(sizeof(*snap));
+	if (snap == NULL)
+		goto fail;
+	snap->base = base;
+	snap->size = hdr.size;
+	snap->strings = snap->base + hdr.strings;
+	snap->strsize = hdr.strsize;
+	snap->root = hdr.root;
+	if (uclua_snap_node(snap, snap->root, NULL) == NULL) {
+		errno = EFTYPE;
+		goto fail;
+	}
+
+	close(fd);
+	return (snap);
+fail:
+	serrno = errno;
+	free(snap);
+	if (base != MAP_FAILED)
+		munmap(base, st.st_size);
+	close(fd);
+	errno = serrno;
+	return (NULL);
+}
+
+void
+uclua_snapshot_close(struct uclua_snapshot *snap)
+{
+
+	if (snap == NULL)
+		return;
+	munmap(__DECONST(char *, snap->base), snap->size);
+	free(snap);
+}
+
+const uclua_snapnode *
+uclua_snapshot_root(const struct uclua_snapshot *snap)
+{
+
+	return ((const uclua_snapnode *)uclua_snap_node(snap, snap->root,
+	    NULL));
+}
+
+static const struct uclua_snap_node *
+uclua_snap_key(const struct uclua_snapshot *snap,
+    const struct uclua_snap_node *node, const char *key, size_t keylen)
+{
+	const struct uclua_snap_entry *ents, *ent;
+	const char *ekey;
+	size_t hi, lo, mid;
+	int cmp;
+
+	ents = uclua_snap_entries(node);
+	lo = 0;
+	hi = node->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		ent = &ents[mid];
+		if ((ekey = uclua_snap_string(snap, ent->key,
+		    ent->keylen)) == NULL)
+			return (NULL);
+		cmp = memcmp(key, ekey, MIN(keylen, ent->keylen));
+		if (cmp == 0)
+			cmp = (keylen > ent->keylen) - (keylen < ent->keylen);
+		if (cmp == 0)
+			return (uclua_snap_node(snap, ent->val, NULL));
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Find the node at `path` beneath `node` (or the root if NULL), using the same
+ * syntax as uclua_lookup().
+ */
+const uclua_snapnode *
+uclua_snapshot_lookup(const struct uclua_snapshot *snap,
+    const uclua_snapnode *unode, const char *path)
+{
+	const struct uclua_snap_node *node;
+	const char *p;
+	long long idx;
+	size_t len;
+
+	node = unode != NULL ? (const struct uclua_snap_node *)unode :
+	    uclua_snap_node(snap, snap->root, NULL);
+	p = path;
+	while (node != NULL && *p != '\0') {
+		if (*p == '[') {
+			if ((p = uclua_path_index(p, &idx)) == NULL)
+				return (NULL);
+			if (node->type != UCL_ARRAY || idx < 1 ||
+			    (unsigned long long)idx > node->count)
+				return (NULL);
+			node = uclua_snap_node(snap,
+			    uclua_snap_children(node)[idx - 1], NULL);
+		} else {
+			len = strcspn(p, ".[");
+			if (len == 0 || node->type != UCL_OBJECT)
+				return (NULL);
+			node = uclua_snap_key(snap, node, p, len);
+			p += len;
+		}
+
+		if (*p == '.') {
+			p++;
+			if (*p == '\0' || *p == '.' || *p == '[')
+				return (NULL);
+		}
+	}
+
+	return ((const uclua_snapnode *)node);
+}
+
+/*
+ * Walk the entries of an array or object; `*it` should start at 0.  Objects'
+ * keys come back in sorted order, arrays' as NULL.
+ */
+const uclua_snapnode *
+uclua_snapshot_iterate(const struct uclua_snapshot *snap,
+    const uclua_snapnode *unode, size_t *it, const char **keyp)
+{
+	const struct uclua_snap_node *node;
+	const struct uclua_snap_entry *ent;
+
+	node = (const struct uclua_snap_node *)unode;
+	if (keyp != NULL)
+		*keyp = NULL;
+	if ((node->type != UCL_ARRAY && node->type != UCL_OBJECT) ||
+	    *it >= node->count)
+		return (NULL);
+
+	if (node->type == UCL_ARRAY)
+		return ((const uclua_snapnode *)uclua_snap_node(snap,
+		    uclua_snap_children(node)[(*it)++], NULL));
+
+	ent = &uclua_snap_entries(node)[(*it)++];
+	if (keyp != NULL &&
+	    (*keyp = uclua_snap_string(snap, ent->key, ent->keylen)) == NULL)
+		return (NULL);
+	return ((const uclua_snapnode *)uclua_snap_node(snap, ent->val, NULL));
+}
+
+ucl_type_t
+uclua_snapshot_type(const uclua_snapnode *unode)
+{
+
+	return ((ucl_type_t)((const struct uclua_snap_node *)unode)->type);
+}
+
+/* Entries in an array or object, or a string's length. */
+size_t
+uclua_snapshot_count(const uclua_snapnode *unode)
+{
+	const struct uclua_snap_node *node;
+
+	node = (const struct uclua_snap_node *)unode;
+	switch (node->type) {
+	case UCL_ARRAY:
+	case UCL_OBJECT:
+	case UCL_STRING:
+		return (node->count);
+	default:
+		return (0);
+	}
+}
+
+int64_t
+uclua_snapshot_toint(const uclua_snapnode *unode)
+{
+	const struct uclua_snap_node *node;
+	int64_t iv;
+	double dv;
+
+	node = (const struct uclua_snap_node *)unode;
+	switch (node->type) {
+	case UCL_INT:
+		memcpy(&iv, node + 1, sizeof(iv));
+		return (iv);
+	case UCL_FLOAT:
+		memcpy(&dv, node + 1, sizeof(dv));
+		return ((int64_t)dv);
+	case UCL_BOOLEAN:
+		return (node->count);
+	default:
+		return (0);
+	}
+}
+
+double
+uclua_snapshot_todouble(const uclua_snapnode *unode)
+{
+	const struct uclua_snap_node *node;
+	double dv;
+
+	node = (const struct uclua_snap_node *)unode;
+	if (node->type != UCL_FLOAT)
+		return ((double)uclua_snapshot_toint(unode));
+	memcpy(&dv, node + 1, sizeof(dv));
+	return (dv);
+}
+
+bool
+uclua_snapshot_toboolean(const uclua_snapnode *unode)
+{
+
+	return (uclua_snapshot_toint(unode) != 0);
+}
+
+/* Points into the mapping; valid until uclua_snapshot_close(). */
+const char *
+uclua_snapshot_tostring(const struct uclua_snapshot *snap,
+    const uclua_snapnode *unode, size_t *lenp)
+{
+	const struct uclua_snap_node *node;
+	uint32_t off;
+
+	node = (const struct uclua_snap_node *)unode;
+	if (node->type != UCL_STRING)
+		return (NULL);
+	memcpy(&off, node + 1, sizeof(off));
+	if (lenp != NULL)
+		*lenp = node->count;
+	return (uclua_snap_string(snap, off, node->count));
+}
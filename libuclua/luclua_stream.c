@@ -0,0 +1,417 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Streaming output.  A coroutine assigned to a global is a generator: rather
+ * than being converted along with everything else, it's resumed until it
+ * finishes and each value that it yields is converted and written out on its
+ * own, so that only one element needs to exist at a time.
+ *
+ * With UCLUAD_JSON, the environment is written out an entry at a time as
+ * compact JSON and each generator becomes an array.  With UCLUAD_NDJSON, all
+ * of the other entries make up the first line and every element yielded is a
+ * line of its own.
+ *
+ * Streaming is only ever asked for with uclua_dump_stream(); uclua_dump()
+ * builds the whole tree, even for UCLUAD_NDJSON.
+ */
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luclua_internal.h"
+
+static int
+uclua_stream_write(FILE *f, const char *buf, size_t len, uclua_error *error)
+{
+
+	if (fwrite(buf, 1, len, f) == len)
+		return (0);
+
+	if (feof(f) != 0) {
+		*error = UCLUE_DUMP_NOSPC;
+		return (ENOSPC);
+	}
+
+	switch (errno) {
+	case EFBIG:
+	case EDQUOT:
+	case ENOSPC:
+		*error = UCLUE_DUMP_NOSPC;
+		break;
+	default:
+		*error = UCLUE_DUMP_WRITEFAIL;
+		break;
+	}
+
+	return (errno);
+}
+
+static int
+uclua_stream_value(const ucl_object_t *obj, FILE *f, uclua_error *error)
+{
+	char *emission;
+	int ret;
+
+	emission = (char *)ucl_object_emit(obj, UCL_EMIT_JSON_COMPACT);
+	if (emission == NULL) {
+		*error = UCLUE_DUMP_EMITFAIL;
+		return (EINVAL);
+	}
+
+	ret = uclua_stream_write(f, emission, strlen(emission), error);
+	free(emission);
+	return (ret);
+}
+
+/* Quote the key below the value at the top of the stack, by way of libucl. */
+static int
+uclua_stream_key(lcookie_t *lcook, FILE *f, uclua_error *error)
+{
+	lua_State *L;
+	ucl_object_t *obj;
+	int ret;
+
+	L = lcook->L;
+	obj = ucl_object_fromstring(luaL_tolstring(L, -2, NULL));
+	lua_pop(L, 1);
+	if (obj == NULL) {
+		*error = UCLUE_NOMEM;
+		return (ENOMEM);
+	}
+
+	ret = uclua_stream_value(obj, f, error);
+	ucl_object_unref(obj);
+	if (ret == 0)
+		ret = uclua_stream_write(f, ":", 1, error);
+	return (ret);
+}
+
+static bool
+uclua_stream_isgen(lua_State *L, int idx)
+{
+
+	return (lua_type(L, idx) == LUA_TTHREAD);
+}
+
+/* Values that uclua_process_pair() would skip are left out here, too. */
+static bool
+uclua_stream_skip(lua_State *L, int idx)
+{
+
+	switch (lua_type(L, idx)) {
+	case LUA_TBOOLEAN:
+	case LUA_TNUMBER:
+	case LUA_TSTRING:
+	case LUA_TTABLE:
+	case LUA_TTHREAD:
+		return (false);
+	default:
+		return (true);
+	}
+}
+
+/*
+ * Run the generator at the top of the stack to completion, writing out each
+ * value that it yields as an array element or as a line.  Only the first of
+ * several values yielded at once is used, and nils are skipped.  A generator
+ * that's already finished simply has nothing more to give.
+ */
+static int
+uclua_stream_generator(lcookie_t *lcook, FILE *f, bool ndjson,
+    uclua_error *error)
+{
+	lua_State *L, *co;
+	ucl_object_t *obj;
+	int lerr, nres, ret;
+	bool first;
+
+	L = lcook->L;
+	co = lua_tothread(L, -1);
+	first = true;
+	while (lua_status(co) != LUA_OK || lua_gettop(co) != 0) {
+		lerr = uclua_resume_nres(co, L, 0, &nres);
+		if (lerr != LUA_OK && lerr != LUA_YIELD) {
+			lua_settop(co, 0);
+			*error = UCLUE_LUA_ERROR;
+			return (EINVAL);
+		}
+
+		if (nres == 0 || lua_isnil(co, -nres)) {
+			lua_pop(co, nres);
+			if (lerr == LUA_OK)
+				break;
+			continue;
+		}
+
+		/* Anything returned at the end counts as the last element. */
+		lua_pop(co, nres - 1);
+		lua_xmove(co, L, 1);
+		obj = uclua_convert(lcook, -1);
+		lua_pop(L, 1);
+		if (obj == NULL) {
+			*error = lcook->error;
+			return (EINVAL);
+		}
+
+		ret = 0;
+		if (!first && !ndjson)
+			ret = uclua_stream_write(f, ",", 1, error);
+		if (ret == 0)
+			ret = uclua_stream_value(obj, f, error);
+		if (ret == 0 && ndjson)
+			ret = uclua_stream_write(f, "\n", 1, error);
+		ucl_object_unref(obj);
+		if (ret != 0)
+			return (ret);
+		first = false;
+		if (lerr == LUA_OK)
+			break;
+	}
+
+	return (0);
+}
+
+/*
+ * Generators may well assign globals as they go, which would upset a lua_next()
+ * traversal of the environment; we walk a list of its keys instead.
+ */
+static void
+uclua_stream_keys(lua_State *L, int envidx)
+{
+	lua_Integer n;
+
+	lua_newtable(L);
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, envidx) != 0) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, ++n);
+	}
+}
+
+static int
+uclua_stream_json(lcookie_t *lcook, FILE *f, int envidx, int keys, bool array,
+    uclua_error *error)
+{
+	lua_State *L;
+	ucl_object_t *obj;
+	lua_Integer i;
+	int ret, top;
+	bool first;
+
+	L = lcook->L;
+	top = lua_gettop(L);
+	ret = uclua_stream_write(f, array ? "[" : "{", 1, error);
+	first = true;
+	for (i = 1; ret == 0 && lua_rawgeti(L, keys, i) != LUA_TNIL; i++) {
+		lua_pushvalue(L, -1);
+		lua_rawget(L, envidx);
+		if (lua_type(L, -2) != LUA_TSTRING &&
+		    lua_type(L, -2) != LUA_TNUMBER) {
+			*error = UCLUE_BADKEYTYPE;
+			ret = EINVAL;
+			break;
+		}
+		if (!uclua_lazy_value(lcook, L, -1)) {
+			*error = lcook->error;
+			ret = EINVAL;
+			break;
+		}
+		if (uclua_stream_skip(L, -1)) {
+			lua_settop(L, top);
+			continue;
+		}
+
+		if (!first)
+			ret = uclua_stream_write(f, ",", 1, error);
+		if (ret == 0 && !array)
+			ret = uclua_stream_key(lcook, f, error);
+		first = false;
+		if (ret == 0 && uclua_stream_isgen(L, -1)) {
+			ret = uclua_stream_write(f, "[", 1, error);
+			if (ret == 0)
+				ret = uclua_stream_generator(lcook, f, false,
+				    error);
+			if (ret == 0)
+				ret = uclua_stream_write(f, "]", 1, error);
+		} else if (ret == 0) {
+			if ((obj = uclua_convert(lcook, -1)) == NULL) {
+				*error = lcook->error;
+				ret = EINVAL;
+			} else {
+				ret = uclua_stream_value(obj, f, error);
+				ucl_object_unref(obj);
+			}
+		}
+		lua_settop(L, top);
+	}
+	lua_settop(L, top);
+
+	if (ret == 0)
+		ret = uclua_stream_write(f, array ? "]\n" : "}\n", 2, error);
+	return (ret);
+}
+
+static int
+uclua_stream_ndjson(lcookie_t *lcook, FILE *f, int envidx, int keys,
+    bool array, uclua_error *error)
+{
+	lua_State *L;
+	const char *key;
+	ucl_object_t *obj, *rest;
+	lua_Integer i;
+	int ret, top;
+	bool inserted;
+
+	L = lcook->L;
+	top = lua_gettop(L);
+	rest = ucl_object_typed_new(array ? UCL_ARRAY : UCL_OBJECT);
+	if (rest == NULL) {
+		*error = UCLUE_NOMEM;
+		return (ENOMEM);
+	}
+
+	/* Everything that isn't a generator goes on the first line. */
+	ret = 0;
+	for (i = 1; ret == 0 && lua_rawgeti(L, keys, i) != LUA_TNIL; i++) {
+		lua_pushvalue(L, -1);
+		lua_rawget(L, envidx);
+		if (lua_type(L, -2) != LUA_TSTRING &&
+		    lua_type(L, -2) != LUA_TNUMBER) {
+			*error = UCLUE_BADKEYTYPE;
+			ret = EINVAL;
+		} else if (!uclua_lazy_value(lcook, L, -1)) {
+			*error = lcook->error;
+			ret = EINVAL;
+		} else if (uclua_stream_skip(L, -1) ||
+		    uclua_stream_isgen(L, -1)) {
+			/* Later. */
+		} else if ((obj = uclua_convert(lcook, -1)) == NULL) {
+			*error = lcook->error;
+			ret = EINVAL;
+		} else {
+			if (array) {
+				inserted = ucl_array_append(rest, obj);
+			} else {
+				key = luaL_tolstring(L, -2, NULL);
+				inserted = ucl_object_insert_key(rest, obj, key,
+				    0, true);
+				lua_pop(L, 1);
+			}
+			if (!inserted) {
+				ucl_object_unref(obj);
+				*error = UCLUE_MUTATE;
+				ret = EINVAL;
+			}
+		}
+		lua_settop(L, top);
+	}
+	lua_settop(L, top);
+
+	if (ret == 0 && rest->len != 0) {
+		ret = uclua_stream_value(rest, f, error);
+		if (ret == 0)
+			ret = uclua_stream_write(f, "\n", 1, error);
+	}
+	ucl_object_unref(rest);
+
+	for (i = 1; ret == 0 && lua_rawgeti(L, keys, i) != LUA_TNIL; i++) {
+		lua_rawget(L, envidx);
+		if (!uclua_lazy_value(lcook, L, -1)) {
+			*error = lcook->error;
+			ret = EINVAL;
+		} else if (uclua_stream_isgen(L, -1)) {
+			ret = uclua_stream_generator(lcook, f, true, error);
+		}
+		lua_settop(L, top);
+	}
+	lua_settop(L, top);
+
+	return (ret);
+}
+
+int
+uclua_dump_stream(lcookie_t *lcook, uclua_dump_type type, FILE *f)
+{
+	lua_State *L;
+	const ucl_object_t *obj;
+	uclua_error error;
+	int envidx, ret, top;
+	bool array;
+
+	if (type != UCLUAD_JSON && type != UCLUAD_NDJSON) {
+		(void)uclua_set_error(lcook, UCLUE_DUMP_EMITFAIL);
+		return (EINVAL);
+	}
+	if (lcook->co != NULL) {
+		(void)uclua_set_error(lcook, UCLUE_BUSY);
+		return (EBUSY);
+	}
+	/* Entries are written as they're converted, before it's all checked. */
+	if (lcook->schema_root != NULL) {
+		(void)uclua_set_error(lcook, UCLUE_DUMP_NOSTREAM);
+		return (EINVAL);
+	}
+
+	L = lcook->L;
+	top = lua_gettop(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, LENV_IDX);
+	envidx = lua_gettop(L);
+	if (uclua_cow_proxy(L, envidx)) {
+		/* Checkpoint overlays don't stream; no generators, either. */
+		lua_settop(L, top);
+		if ((obj = uclua_ucl(lcook)) == NULL)
+			return (EINVAL);
+		return (uclua_dump_ucl(lcook, obj, type, f));
+	}
+
+	array = uclua_is_array(L, envidx);
+	uclua_stream_keys(L, envidx);
+
+	error = UCLUE_OK;
+	if (type == UCLUAD_NDJSON)
+		ret = uclua_stream_ndjson(lcook, f, envidx, envidx + 1, array,
+		    &error);
+	else
+		ret = uclua_stream_json(lcook, f, envidx, envidx + 1, array,
+		    &error);
+	lua_settop(L, top);
+
+	/* Generators can't be run again, so what we have now is stale. */
+	uclua_ucl_free(lcook);
+	lcook->dirty = true;
+
+	if (ret != 0)
+		(void)uclua_set_error(lcook, error);
+	return (ret);
+}
@@ -29,9 +29,14 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "luclua_internal.h"
 
+#define	LCONV_IDX		"uclua_conv_key"
+#define	LMEMO_IDX		"uclua_conv_memo"
+
 typedef ucl_object_t *(uclua_process_type_func)(lcookie_t *, int);
 
 static uclua_process_type_func uclua_process_table;
@@ -39,6 +44,11 @@ static uclua_process_type_func uclua_process_bool;
 static uclua_process_type_func uclua_process_number;
 static uclua_process_type_func uclua_process_string;
 
+static bool uclua_process_pair(lcookie_t *, ucl_object_t *, bool);
+static ucl_object_t *uclua_process_value(lcookie_t *, int);
+static int uclua_emit_one(const ucl_object_t *, uclua_dump_type, FILE *,
+    uclua_error *);
+
 static uclua_process_type_func *uclua_processors[] = {
 	[LUA_TBOOLEAN] = uclua_process_bool,
 	[LUA_TNUMBER] = uclua_process_number,
@@ -49,46 +59,196 @@ static uclua_process_type_func *uclua_processors[] = {
 ucl_object_t *
 uclua_ucl(lcookie_t *lcook)
 {
-	ucl_object_t *obj;
+	bool ok;
+
+	UCLUA_PROBE(convert_start);
+	ok = uclua_ucl_step(lcook, 0) == UCLUAS_DONE;
+	UCLUA_PROBE2(convert_done, ok,
+	    ok && lcook->ucl != NULL ? lcook->ucl->len : 0);
+
+	/* XXX May be NULL if no files consumed! */
+	if (!ok)
+		return (NULL);
+	return (lcook->ucl);
+}
+
+/*
+ * Convert up to `budget` entries of the environment, resuming where the last
+ * call left off; a budget of zero or less converts everything that remains.
+ * The key we stopped at is stashed in the registry so that lua_next() can pick
+ * the traversal back up.
+ */
+uclua_step
+uclua_ucl_step(lcookie_t *lcook, int budget)
+{
 	lua_State *L;
+	ucl_object_t *obj;
+	int envidx, top;
+	bool ok, serial;
 
 	if (!lcook->dirty)
-		/* XXX May be NULL if no files consumed! */
-		return (lcook->ucl);
+		return (UCLUAS_DONE);
 
 	L = lcook->L;
+	top = lua_gettop(L);
 	lua_getfield(L, LUA_REGISTRYINDEX, LENV_IDX);
-	if ((obj = uclua_process_table(lcook, lua_gettop(L))) != NULL) {
-		uclua_ucl_free(lcook);
-		lcook->dirty = false;
-		lcook->ucl = obj;
-		return (lcook->ucl);
+	envidx = lua_gettop(L);
+	if (lcook->pending == NULL) {
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, LMEMO_IDX);
+		/* Nothing hashed so far is going to be looked up again. */
+		uclua_hash_clear(lcook);
 	}
 
-	assert(lcook->error != UCLUE_OK);
-	return (NULL);
+	if (lcook->pending == NULL && uclua_cow_proxy(L, envidx)) {
+		/* Checkpoint overlays are converted in one go. */
+		lcook->schema = lcook->schema_root;
+		obj = uclua_process_table(lcook, envidx);
+		lcook->schema = NULL;
+		lua_settop(L, top);
+		uclua_ucl_abort(lcook);
+		if (obj == NULL)
+			return (UCLUAS_ERROR);
+		goto out;
+	} else if (lcook->pending == NULL && budget <= 0 &&
+	    lcook->threads > 1 && lcook->schema_root == NULL &&
+	    !lcook->hash_tree && !lcook->module_views) {
+		/*
+		 * uclua_parallel_convert() can't validate or hash as it goes,
+		 * nor see through views of cached modules.  Environments with
+		 * shared tables are handed back to us.
+		 */
+		obj = uclua_parallel_convert(lcook, envidx, &serial);
+		if (!serial) {
+			lua_settop(L, top);
+			uclua_ucl_abort(lcook);
+			if (obj == NULL)
+				return (UCLUAS_ERROR);
+			goto out;
+		}
+	}
+
+	if (lcook->pending == NULL) {
+		lcook->pending_array = uclua_is_array(L, envidx);
+		lcook->pending = ucl_object_typed_new(lcook->pending_array ?
+		    UCL_ARRAY : UCL_OBJECT);
+		if (lcook->pending == NULL) {
+			lua_settop(L, top);
+			(void)uclua_set_error(lcook, UCLUE_NOMEM);
+			return (UCLUAS_ERROR);
+		}
+
+		lua_pushnil(L);
+	} else {
+		lua_getfield(L, LUA_REGISTRYINDEX, LCONV_IDX);
+	}
+
+	obj = lcook->pending;
+	while (lua_next(L, envidx) != 0) {
+		lcook->schema = lcook->schema_root;
+		lcook->hashing = lcook->hash_tree;
+		ok = uclua_process_entry(lcook, obj, lcook->pending_array);
+		lcook->hashing = false;
+		lcook->schema = NULL;
+		if (!ok) {
+			lua_settop(L, top);
+			uclua_ucl_abort(lcook);
+			assert(lcook->error != UCLUE_OK);
+			return (UCLUAS_ERROR);
+		}
+
+		lua_pop(L, 1);
+		if (budget > 0 && --budget == 0) {
+			lua_setfield(L, LUA_REGISTRYINDEX, LCONV_IDX);
+			lua_settop(L, top);
+			return (UCLUAS_AGAIN);
+		}
+	}
+
+	lua_settop(L, top);
+	if (lcook->schema_root != NULL &&
+	    !uclua_schema_check(lcook, lcook->schema_root, obj)) {
+		uclua_ucl_abort(lcook);
+		return (UCLUAS_ERROR);
+	}
+
+	if (lcook->hash_tree)
+		(void)uclua_hash(lcook, obj);
+	lcook->pending = NULL;
+	uclua_ucl_abort(lcook);
+out:
+	uclua_ucl_free(lcook);
+	lcook->dirty = false;
+	lcook->ucl = obj;
+	return (UCLUAS_DONE);
 }
 
 int
 uclua_dump(lcookie_t *lcook, uclua_dump_type dfmt, FILE *f)
 {
-	char *emission;
 	ucl_object_t *ucl;
+
+	ucl = uclua_ucl(lcook);
+	if (ucl == NULL)
+		return (EINVAL);
+
+	return (uclua_dump_ucl(lcook, ucl, dfmt, f));
+}
+
+int
+uclua_dump_ucl(lcookie_t *lcook, const ucl_object_t *ucl, uclua_dump_type dfmt,
+    FILE *f)
+{
+	uclua_error error;
+	int ret;
+
+	error = UCLUE_OK;
+	ret = uclua_emit(ucl, dfmt, f, &error);
+	if (ret != 0)
+		(void)uclua_set_error(lcook, error);
+	return (ret);
+}
+
+/*
+ * Emission only reads `ucl` and reports errors through `error` rather than a
+ * cookie, so it's safe to run several at once over the same tree.
+ */
+int
+uclua_emit(const ucl_object_t *ucl, uclua_dump_type dfmt, FILE *f,
+    uclua_error *error)
+{
+	int ret;
+
+	UCLUA_PROBE1(dump_start, dfmt);
+	ret = uclua_emit_one(ucl, dfmt, f, error);
+	UCLUA_PROBE2(dump_done, dfmt, ret);
+	return (ret);
+}
+
+static int
+uclua_emit_one(const ucl_object_t *ucl, uclua_dump_type dfmt, FILE *f,
+    uclua_error *error)
+{
+	char *emission;
 	size_t nb, sb;
 	enum ucl_emitter emitter;
 	int serrno;
 
 	if (dfmt == UCLUAD_LUA)
-		return (uclua_dump_lua(lcook, f));
-
-	ucl = uclua_ucl(lcook);
-	if (ucl == NULL)
-		return (EINVAL);
+		return (uclua_dump_lua(ucl, f, error));
+	if (dfmt == UCLUAD_LUAC)
+		return (uclua_dump_luac(ucl, f, error));
+	if (dfmt == UCLUAD_SNAPSHOT)
+		return (uclua_dump_snapshot(ucl, f, error));
 
 	switch (dfmt) {
 	case UCLUAD_JSON:
 		emitter = UCL_EMIT_JSON;
 		break;
+	case UCLUAD_NDJSON:
+		/* A whole tree is just the one record. */
+		emitter = UCL_EMIT_JSON_COMPACT;
+		break;
 	case UCLUAD_UCL:
 		emitter = UCL_EMIT_CONFIG;
 		break;
@@ -96,6 +256,8 @@ uclua_dump(lcookie_t *lcook, uclua_dump_type dfmt, FILE *f)
 		emitter = UCL_EMIT_YAML;
 		break;
 	case UCLUAD_LUA:
+	case UCLUAD_LUAC:
+	case UCLUAD_SNAPSHOT:
 	default:
 		/* UNREACHABLE */
 		abort();
@@ -103,28 +265,30 @@ uclua_dump(lcookie_t *lcook, uclua_dump_type dfmt, FILE *f)
 
 	emission = (char *)ucl_object_emit(ucl, emitter);
 	if (emission == NULL) {
-		(void)uclua_set_error(lcook, UCLUE_DUMP_EMITFAIL);
+		*error = UCLUE_DUMP_EMITFAIL;
 		return (EINVAL);
 	}
 
 	sb = strlen(emission);
 	nb = fwrite(emission, 1, sb, f);
+	if (nb == sb && dfmt == UCLUAD_NDJSON && fputc('\n', f) == EOF)
+		nb--;
 	serrno = errno;
 	free(emission);
 	if (nb < sb) {
 		/* ?? */
 		if (feof(f) != 0) {
-			(void)uclua_set_error(lcook, UCLUE_DUMP_NOSPC);
+			*error = UCLUE_DUMP_NOSPC;
 			return (ENOSPC);
 		} else {
 			switch (serrno) {
 			case EFBIG:
 			case EDQUOT:
 			case ENOSPC:
-				(void)uclua_set_error(lcook, UCLUE_DUMP_NOSPC);
+				*error = UCLUE_DUMP_NOSPC;
 				break;
 			default:
-				(void)uclua_set_error(lcook, UCLUE_DUMP_WRITEFAIL);
+				*error = UCLUE_DUMP_WRITEFAIL;
 				break;
 			}
 			return (serrno);
@@ -144,7 +308,134 @@ uclua_ucl_free(lcookie_t *lcook)
 	lcook->ucl = NULL;
 }
 
-static bool
+/*
+ * Parse the bracketed component at `p`, which may only hold digits and has to
+ * be followed by another component or the end of the path.  Returns what's
+ * left of the path, or NULL if it's malformed.
+ */
+const char *
+uclua_path_index(const char *p, long long *idxp)
+{
+	const char *digits;
+
+	digits = ++p;
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (p == digits || *p != ']')
+		return (NULL);
+
+	errno = 0;
+	*idxp = strtoll(digits, NULL, 10);
+	if (errno != 0)
+		return (NULL);
+
+	p++;
+	if (*p != '\0' && *p != '.' && *p != '[')
+		return (NULL);
+	return (p);
+}
+
+/*
+ * Walk a path like "a.b[3].c" down from the environment and convert only what
+ * it addresses.  Bracketed components are integer keys, anything else is a
+ * string key.  The caller owns the returned object.
+ */
+ucl_object_t *
+uclua_lookup(lcookie_t *lcook, const char *path)
+{
+	lua_State *L;
+	const char *p;
+	ucl_object_t *obj;
+	long long ikey;
+	size_t len;
+	int top;
+
+	L = lcook->L;
+	top = lua_gettop(L);
+	obj = NULL;
+	lua_getfield(L, LUA_REGISTRYINDEX, LENV_IDX);
+
+	p = path;
+	while (*p != '\0') {
+		if (*p == '[') {
+			if ((p = uclua_path_index(p, &ikey)) == NULL)
+				goto badpath;
+			lua_pushinteger(L, (lua_Integer)ikey);
+		} else {
+			len = strcspn(p, ".[");
+			if (len == 0)
+				goto badpath;
+			lua_pushlstring(L, p, len);
+			p += len;
+		}
+
+		if (*p == '.') {
+			p++;
+			if (*p == '\0' || *p == '.' || *p == '[')
+				goto badpath;
+		}
+
+		if (!lua_istable(L, -2) ||
+		    uclua_cow_rawget(L, -2) == LUA_TNIL) {
+			(void)uclua_set_error(lcook, UCLUE_NOTFOUND);
+			goto out;
+		}
+		lua_remove(L, -2);
+		if (!uclua_lazy_value(lcook, L, -1))
+			goto out;
+	}
+
+	obj = uclua_convert(lcook, -1);
+	goto out;
+badpath:
+	(void)uclua_set_error(lcook, UCLUE_BADPATH);
+out:
+	lua_settop(L, top);
+	return (obj);
+}
+
+/*
+ * Convert a single value outside of uclua_ucl_step(), with a private memo so
+ * that we don't leave pointers to our result behind in a sliced conversion
+ * that's still in progress.
+ */
+ucl_object_t *
+uclua_convert(lcookie_t *lcook, int idx)
+{
+	lua_State *L;
+	ucl_object_t *obj;
+
+	L = lcook->L;
+	idx = lua_absindex(L, idx);
+	lua_getfield(L, LUA_REGISTRYINDEX, LMEMO_IDX);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LMEMO_IDX);
+
+	obj = uclua_process_value(lcook, idx);
+
+	lua_setfield(L, LUA_REGISTRYINDEX, LMEMO_IDX);
+	return (obj);
+}
+
+/* Discard any partial conversion in progress. */
+void
+uclua_ucl_abort(lcookie_t *lcook)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LCONV_IDX);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LMEMO_IDX);
+
+	if (lcook->pending == NULL)
+		return;
+	ucl_object_unref(lcook->pending);
+	lcook->pending = NULL;
+}
+
+bool
 uclua_is_array(lua_State *L, int idx)
 {
 	int ltype, cidx, nidx;
@@ -172,60 +463,477 @@ uclua_is_array(lua_State *L, int idx)
 }
 
 static ucl_object_t *
-uclua_process_table(lcookie_t *lcook, int idx)
+uclua_process_value(lcookie_t *lcook, int idx)
+{
+	uclua_process_type_func *processor;
+	ucl_object_t *val;
+	int ltype;
+
+	ltype = lua_type(lcook->L, idx);
+	if (ltype < 0 || (size_t)ltype >= nitems(uclua_processors) ||
+	    (processor = uclua_processors[ltype]) == NULL) {
+		(void)uclua_set_error(lcook, UCLUE_NOTYPE);
+		return (NULL);
+	}
+
+	if ((val = (*processor)(lcook, idx)) == NULL &&
+	    lcook->error == UCLUE_OK)
+		(void)uclua_set_error(lcook, UCLUE_BADCONV);
+	return (val);
+}
+
+static bool
+uclua_check_key(lcookie_t *lcook)
+{
+	int ltype;
+
+	ltype = lua_type(lcook->L, -2);
+	if (ltype != LUA_TSTRING && ltype != LUA_TNUMBER) {
+		(void)uclua_set_error(lcook, UCLUE_BADKEYTYPE);
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Add `val` to `obj`, keyed by the key just below the value at the top of the
+ * stack.  `val` is released on failure.
+ */
+static bool
+uclua_insert(lcookie_t *lcook, ucl_object_t *obj, bool array,
+    ucl_object_t *val)
 {
 	lua_State *L;
 	const char *key;
+	bool inserted;
+
+	L = lcook->L;
+	if (array) {
+		inserted = ucl_array_append(obj, val);
+	} else {
+		key = luaL_tolstring(L, -2, NULL);
+		inserted = ucl_object_insert_key(obj, val, key, 0, true);
+		lua_pop(L, 1);
+	}
+
+	if (!inserted) {
+		ucl_object_unref(val);
+		(void)uclua_set_error(lcook, UCLUE_MUTATE);
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Each conversion keeps a memo mapping tables to what they were converted to,
+ * so that a table referenced from many places is only converted once.  A table
+ * maps to false while it's still being converted, so running into that again
+ * means we've found a cycle.
+ */
+static bool
+uclua_memo_check(lcookie_t *lcook, int tidx, int midx,
+    const ucl_object_t **sharedp)
+{
+	lua_State *L;
+
+	L = lcook->L;
+	*sharedp = NULL;
+	if (!lua_istable(L, midx))
+		return (true);
+
+	lua_pushvalue(L, tidx);
+	switch (lua_rawget(L, midx)) {
+	case LUA_TBOOLEAN:
+		lua_pop(L, 1);
+		(void)uclua_set_error(lcook, UCLUE_CYCLE);
+		return (false);
+	case LUA_TLIGHTUSERDATA:
+		*sharedp = lua_touserdata(L, -1);
+		break;
+	}
+
+	lua_pop(L, 1);
+	return (true);
+}
+
+/*
+ * Add an already converted table to `obj` again.  libucl objects carry their
+ * own key, so a reference can only be shared where it lands under that same
+ * key (or in an array, where keys aren't emitted); anything else gets a copy.
+ */
+static bool
+uclua_share(lcookie_t *lcook, ucl_object_t *obj, bool array,
+    const ucl_object_t *shared)
+{
+	lua_State *L;
+	const char *key, *skey;
+	ucl_object_t *val;
+	size_t keylen, skeylen;
+	bool inserted;
+
+	L = lcook->L;
+	if (array)
+		return (uclua_insert(lcook, obj, true, ucl_object_ref(shared)));
+
+	key = luaL_tolstring(L, -2, &keylen);
+	skey = ucl_object_keyl(shared, &skeylen);
+	if (skey != NULL && skeylen == keylen &&
+	    memcmp(key, skey, keylen) == 0) {
+		val = ucl_object_ref(shared);
+		inserted = ucl_object_insert_key(obj, val, skey, skeylen,
+		    false);
+	} else if ((val = ucl_object_copy(shared)) != NULL) {
+		inserted = ucl_object_insert_key(obj, val, key, keylen, true);
+	} else {
+		lua_pop(L, 1);
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (false);
+	}
+	lua_pop(L, 1);
+
+	if (!inserted) {
+		ucl_object_unref(val);
+		(void)uclua_set_error(lcook, UCLUE_MUTATE);
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Convert the key/value pair at the top of the stack and add it to `obj`.  The
+ * pair is left on the stack for the caller's lua_next() traversal.  With a
+ * schema, lcook->schema is that of `obj` on the way in, and of the value while
+ * it's converted.
+ */
+bool
+uclua_process_entry(lcookie_t *lcook, ucl_object_t *obj, bool array)
+{
+	const struct uclua_schema *parent;
+	size_t plen;
+	bool ok;
+
+	parent = lcook->schema;
+	if (parent == NULL)
+		return (uclua_process_pair(lcook, obj, array));
+
+	plen = lcook->schema_pathlen;
+	lcook->schema = uclua_schema_enter(lcook, parent, array);
+	ok = lcook->schema != NULL && uclua_process_pair(lcook, obj, array);
+	lcook->schema = parent;
+	uclua_schema_leave(lcook, plen);
+	return (ok);
+}
+
+static bool
+uclua_process_pair(lcookie_t *lcook, ucl_object_t *obj, bool array)
+{
+	lua_State *L;
 	uclua_process_type_func *processor;
-	ucl_object_t *obj, *val;
+	const ucl_object_t *shared;
+	ucl_object_t *val;
 	int ltype;
+	bool ok;
+
+	L = lcook->L;
+	if (!uclua_check_key(lcook))
+		return (false);
+
+	/* Converting a lazily required module is what finally loads it. */
+	if (!uclua_lazy_value(lcook, L, -1))
+		return (false);
+
+	ltype = lua_type(L, -1);
+	if (ltype < 0 || (size_t)ltype >= nitems(uclua_processors)) {
+		(void)uclua_set_error(lcook, UCLUE_NOTYPE);
+		return (false);
+	}
+
+	if (ltype == LUA_TTABLE) {
+		lua_getfield(L, LUA_REGISTRYINDEX, LMEMO_IDX);
+		ok = uclua_memo_check(lcook, -2, lua_gettop(L), &shared);
+		lua_pop(L, 1);
+		if (!ok)
+			return (false);
+		if (shared != NULL && lcook->schema != NULL &&
+		    !uclua_schema_validate(lcook, lcook->schema, shared))
+			return (false);
+		if (shared != NULL)
+			return (uclua_share(lcook, obj, array, shared));
+	}
+
+	processor = uclua_processors[ltype];
+	if (processor == NULL)
+		return (true);
+
+	if ((val = (*processor)(lcook, lua_gettop(L))) == NULL) {
+		if (lcook->error == UCLUE_OK)
+			(void)uclua_set_error(lcook, UCLUE_BADCONV);
+		return (false);
+	}
+
+	/* Tables were checked as they were built. */
+	if (ltype != LUA_TTABLE && lcook->schema != NULL &&
+	    !uclua_schema_check(lcook, lcook->schema, val)) {
+		ucl_object_unref(val);
+		return (false);
+	}
+	if (ltype != LUA_TTABLE && lcook->hashing)
+		(void)uclua_hash(lcook, val);
+
+	return (uclua_insert(lcook, obj, array, val));
+}
+
+/*
+ * Nested tables are converted without recursing: each table being traversed
+ * gets a frame here, while the table itself and its current lua_next() key
+ * live in a work table at slots 2n - 1 and 2n.  The Lua stack thus stays the
+ * same size no matter how deep the tables go.
+ */
+struct uclua_conv_frame {
+	ucl_object_t			*obj;
+	const struct uclua_schema	*schema;
+	size_t				 pathlen;	/* to restore on pop */
+	bool				 array;
+};
+
+struct uclua_conv {
+	struct uclua_conv_frame	*frames;
+	size_t			 nframes;
+	size_t			 maxframes;
+	int			 memo;
+	int			 work;
+};
+
+/*
+ * Start a frame for the table at the top of the stack.  The new container is
+ * returned for the caller to link into its parent.
+ */
+static ucl_object_t *
+uclua_conv_push(lcookie_t *lcook, struct uclua_conv *cv,
+    const struct uclua_schema *schema, size_t pathlen)
+{
+	lua_State *L;
+	struct uclua_conv_frame *frame;
+	ucl_object_t *obj;
+	size_t maxframes;
 	bool array;
 
 	L = lcook->L;
-	array = uclua_is_array(L, idx);
+	if (lcook->max_depth != 0 &&
+	    lcook->depth + cv->nframes + 1 > lcook->max_depth) {
+		(void)uclua_set_error(lcook, UCLUE_TOODEEP);
+		return (NULL);
+	}
+
+	if (cv->nframes == cv->maxframes) {
+		maxframes = cv->maxframes == 0 ? 16 : cv->maxframes * 2;
+		frame = reallocarray(cv->frames, maxframes, sizeof(*frame));
+		if (frame == NULL) {
+			(void)uclua_set_error(lcook, UCLUE_NOMEM);
+			return (NULL);
+		}
+
+		cv->frames = frame;
+		cv->maxframes = maxframes;
+	}
+
+	array = uclua_is_array(L, lua_gettop(L));
 	obj = ucl_object_typed_new(array ? UCL_ARRAY : UCL_OBJECT);
 	if (obj == NULL) {
 		(void)uclua_set_error(lcook, UCLUE_NOMEM);
 		return (NULL);
 	}
 
+	frame = &cv->frames[cv->nframes++];
+	frame->obj = obj;
+	frame->schema = schema;
+	frame->pathlen = pathlen;
+	frame->array = array;
+
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, cv->work, 2 * cv->nframes - 1);
+	lua_pushvalue(L, -1);
+	lua_pushboolean(L, 0);
+	lua_rawset(L, cv->memo);
+	return (obj);
+}
+
+/* The frame's table is complete, so this is where it's validated. */
+static bool
+uclua_conv_pop(lcookie_t *lcook, struct uclua_conv *cv)
+{
+	lua_State *L;
+	struct uclua_conv_frame *frame;
+
+	L = lcook->L;
+	frame = &cv->frames[cv->nframes - 1];
+	if (frame->schema != NULL &&
+	    !uclua_schema_check(lcook, frame->schema, frame->obj))
+		return (false);
+	uclua_schema_leave(lcook, frame->pathlen);
+	if (lcook->hashing)
+		(void)uclua_hash(lcook, frame->obj);
+
+	lua_rawgeti(L, cv->work, 2 * cv->nframes - 1);
+	lua_pushlightuserdata(L, cv->frames[cv->nframes - 1].obj);
+	lua_rawset(L, cv->memo);
+
 	lua_pushnil(L);
-	while (lua_next(L, idx) != 0) {
-		ltype = lua_type(L, -2);
-		if (ltype != LUA_TSTRING && ltype != LUA_TNUMBER) {
-			(void)uclua_set_error(lcook, UCLUE_BADKEYTYPE);
-			return (NULL);
+	lua_rawseti(L, cv->work, 2 * cv->nframes);
+	lua_pushnil(L);
+	lua_rawseti(L, cv->work, 2 * cv->nframes - 1);
+	cv->nframes--;
+	return (true);
+}
+
+static ucl_object_t *
+uclua_process_table(lcookie_t *lcook, int idx)
+{
+	struct uclua_conv cv;
+	lua_State *L;
+	struct uclua_conv_frame *frame;
+	const struct uclua_schema *cschema, *schema;
+	const ucl_object_t *shared;
+	ucl_object_t *child, *root;
+	size_t plen, rootplen;
+	unsigned int depth;
+	int top;
+	bool ok, ownmemo;
+
+	L = lcook->L;
+	schema = lcook->schema;
+	if (uclua_cow_proxy(L, idx)) {
+		/* Overlays are converted a level at a time; check after. */
+		lcook->schema = NULL;
+		root = uclua_cow_process(lcook, idx);
+		lcook->schema = schema;
+		if (root != NULL && schema != NULL &&
+		    !uclua_schema_validate(lcook, schema, root)) {
+			ucl_object_unref(root);
+			root = NULL;
 		}
-		key = luaL_tolstring(L, -2, NULL);
-		ltype = lua_type(L, -2);
-		if (ltype < 0 || (size_t)ltype > nitems(uclua_processors)) {
-			(void)uclua_set_error(lcook, UCLUE_NOTYPE);
+		return (root);
+	} else if (uclua_lazy_proxy(L, idx)) {
+		/* Not necessarily a table once it's loaded, or not ours. */
+		if (lcook->recursion == UCLUA_MAX_RECURSION) {
+			(void)uclua_set_error(lcook, UCLUE_TOODEEP);
 			return (NULL);
 		}
 
-		processor = uclua_processors[ltype];
-		if (processor != NULL) {
-			if ((val = (*processor)(lcook, lua_gettop(L) - 1)) == NULL) {
-				if (lcook->error == UCLUE_OK)
-					(void)uclua_set_error(lcook, UCLUE_BADCONV);
-				return (NULL);
-			}
+		lua_pushvalue(L, idx);
+		root = NULL;
+		lcook->recursion++;
+		if (uclua_lazy_value(lcook, L, -1))
+			root = uclua_process_value(lcook, lua_gettop(L));
+		lcook->recursion--;
+		lua_pop(L, 1);
+		return (root);
+	}
 
-			if (array) {
-				if (!ucl_array_append(obj, val)) {
-					(void)uclua_set_error(lcook, UCLUE_MUTATE);
-					return (NULL);
-				}
-			} else if (!ucl_object_insert_key(obj, val, key, 0, true)) {
-				(void)uclua_set_error(lcook, UCLUE_MUTATE);
-				return (NULL);
-			}
+	if (!lua_checkstack(L, LUA_MINSTACK)) {
+		(void)uclua_set_error(lcook, UCLUE_NOMEM);
+		return (NULL);
+	}
+
+	top = lua_gettop(L);
+	depth = lcook->depth;
+	memset(&cv, 0, sizeof(cv));
+
+	ownmemo = lua_getfield(L, LUA_REGISTRYINDEX, LMEMO_IDX) == LUA_TNIL;
+	if (ownmemo) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LMEMO_IDX);
+	}
+	cv.memo = lua_gettop(L);
+
+	lua_newtable(L);
+	cv.work = lua_gettop(L);
+	lua_pushvalue(L, idx);
+	rootplen = lcook->schema_pathlen;
+	if ((root = uclua_conv_push(lcook, &cv, schema, rootplen)) == NULL)
+		goto out;
+
+	while (cv.nframes > 0) {
+		lua_settop(L, cv.work);
+		lua_rawgeti(L, cv.work, 2 * cv.nframes - 1);
+		lua_rawgeti(L, cv.work, 2 * cv.nframes);
+		if (lua_next(L, cv.work + 1) == 0) {
+			if (!uclua_conv_pop(lcook, &cv))
+				goto fail;
+			continue;
+		}
+
+		lua_pushvalue(L, -2);
+		lua_rawseti(L, cv.work, 2 * cv.nframes);
+
+		/* Modules are swapped in here so that they get a frame, too. */
+		if (!uclua_lazy_value(lcook, L, -1))
+			goto fail;
+
+		frame = &cv.frames[cv.nframes - 1];
+		if (lua_type(L, -1) != LUA_TTABLE || uclua_cow_proxy(L, -1) ||
+		    uclua_lazy_proxy(L, -1)) {
+			lcook->depth = depth + cv.nframes;
+			lcook->schema = frame->schema;
+			ok = uclua_process_entry(lcook, frame->obj,
+			    frame->array);
+			lcook->schema = schema;
+			lcook->depth = depth;
+			if (!ok)
+				goto fail;
+			continue;
 		}
 
-		lua_pop(L, 2);
+		if (!uclua_check_key(lcook))
+			goto fail;
+		cschema = NULL;
+		plen = lcook->schema_pathlen;
+		if (frame->schema != NULL &&
+		    (cschema = uclua_schema_enter(lcook, frame->schema,
+		    frame->array)) == NULL)
+			goto fail;
+		if (!uclua_memo_check(lcook, -1, cv.memo, &shared))
+			goto fail;
+		if (shared != NULL) {
+			if (cschema != NULL &&
+			    !uclua_schema_validate(lcook, cschema, shared))
+				goto fail;
+			uclua_schema_leave(lcook, plen);
+			if (!uclua_share(lcook, frame->obj, frame->array,
+			    shared))
+				goto fail;
+			continue;
+		}
+		child = uclua_conv_push(lcook, &cv, cschema, plen);
+		if (child == NULL)
+			goto fail;
+
+		/* The parent may have moved if the frames were reallocated. */
+		frame = &cv.frames[cv.nframes - 2];
+		if (!uclua_insert(lcook, frame->obj, frame->array, child)) {
+			cv.nframes--;
+			goto fail;
+		}
 	}
 
-	return (obj);
+	goto out;
+fail:
+	ucl_object_unref(root);
+	root = NULL;
+out:
+	uclua_schema_leave(lcook, rootplen);
+	if (ownmemo) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, LMEMO_IDX);
+	}
+	lua_settop(L, top);
+	free(cv.frames);
+	return (root);
 }
 
 static ucl_object_t *
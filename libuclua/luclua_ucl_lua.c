@@ -29,8 +29,13 @@
 #include <sys/mman.h>
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "luclua_internal.h"
@@ -38,28 +43,306 @@
 #define	uclua_padding(depth)	((depth) * 4)
 
 typedef struct {
-	lcookie_t *lcook;
+	uclua_error *error;
 	FILE *f;
 	int depth;
 } uclua_dump_info;
 
+typedef struct {
+	FILE *f;
+	int serrno;
+} uclua_luac_info;
+
 static int uclua_dump_object(const ucl_object_t *, bool, uclua_dump_info *);
 static int uclua_dump_object_value(const ucl_object_t *, uclua_dump_info *);
+static int uclua_emit_string(uclua_dump_info *, const char *, ...)
+    __printflike(2, 3);
 
 int
-uclua_dump_lua(lcookie_t *lcook, FILE *f)
+uclua_dump_lua(const ucl_object_t *ucl, FILE *f, uclua_error *error)
 {
 	uclua_dump_info info;
-	ucl_object_t *ucl;
-
-	ucl = uclua_ucl(lcook);
-	if (ucl == NULL)
-		return (EINVAL);
+	int ret;
 
-	info.lcook = lcook;
+	info.error = error;
 	info.f = f;
 	info.depth = 0;
-	return (uclua_dump_object(ucl, true, &info));
+	if (ucl_object_type(ucl) == UCL_OBJECT)
+		return (uclua_dump_object(ucl, true, &info));
+
+	/* Anything else, e.g. from uclua_lookup(), isn't a set of globals. */
+	if ((ret = uclua_emit_string(&info, "return ")) != 0)
+		return (ret);
+	if ((ret = uclua_dump_object_value(ucl, &info)) != 0)
+		return (ret);
+	return (uclua_emit_string(&info, "\n"));
+}
+
+static int
+uclua_luac_write(lua_State *L __unused, const void *p, size_t sz, void *ud)
+{
+	uclua_luac_info *info;
+
+	info = ud;
+	if (fwrite(p, 1, sz, info->f) == sz)
+		return (0);
+	info->serrno = feof(info->f) ? ENOSPC : errno;
+	return (1);
+}
+
+static bool
+uclua_luac_ident(const char *key, size_t len)
+{
+	static const char *reserved[] = {
+		"and", "break", "do", "else", "elseif", "end", "false", "for",
+		"function", "goto", "if", "in", "local", "nil", "not", "or",
+		"repeat", "return", "then", "true", "until", "while",
+	};
+
+	if (len == 0 || (!isalpha((unsigned char)key[0]) && key[0] != '_'))
+		return (false);
+	for (size_t i = 1; i < len; i++) {
+		if (!isalnum((unsigned char)key[i]) && key[i] != '_')
+			return (false);
+	}
+	for (size_t i = 0; i < nitems(reserved); i++) {
+		if (strlen(reserved[i]) == len &&
+		    memcmp(reserved[i], key, len) == 0)
+			return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Quote a string so that it reads back byte for byte: anything that isn't
+ * printable ASCII is written as a three digit decimal escape, which every Lua
+ * we support understands and which can't run into a digit that follows.
+ */
+static int
+uclua_luac_string(uclua_dump_info *info, const char *str, size_t len)
+{
+	size_t run;
+	int ret;
+	unsigned char c;
+
+	if ((ret = uclua_emit_string(info, "\"")) != 0)
+		return (ret);
+	while (len > 0) {
+		for (run = 0; run < len; run++) {
+			c = (unsigned char)str[run];
+			if (c < 0x20 || c > 0x7e || c == '"' || c == '\\')
+				break;
+		}
+		if (run > 0 &&
+		    (ret = uclua_emit_string(info, "%.*s", (int)run, str)) != 0)
+			return (ret);
+		str += run;
+		len -= run;
+		if (len == 0)
+			break;
+
+		if (*str == '"' || *str == '\\')
+			ret = uclua_emit_string(info, "\\%c", *str);
+		else
+			ret = uclua_emit_string(info, "\\%03u",
+			    (unsigned char)*str);
+		if (ret != 0)
+			return (ret);
+		str++;
+		len--;
+	}
+
+	return (uclua_emit_string(info, "\""));
+}
+
+/*
+ * %.17g is enough to get every double back exactly, but a float that happens
+ * to be integral needs a fraction to stay a float in 5.3 and later.
+ */
+static int
+uclua_luac_float(uclua_dump_info *info, double d)
+{
+	char buf[32];
+	int len;
+
+	if (isnan(d))
+		return (uclua_emit_string(info, "(0/0)"));
+	else if (isinf(d))
+		return (uclua_emit_string(info, "(%s1/0)", d < 0 ? "-" : ""));
+
+	len = snprintf(buf, sizeof(buf), "%.17g", d);
+	return (uclua_emit_string(info, "%s%s", buf,
+	    strspn(buf, "-0123456789") == (size_t)len ? ".0" : ""));
+}
+
+static int
+uclua_luac_value(const ucl_object_t *obj, uclua_dump_info *info)
+{
+	ucl_object_iter_t it;
+	const ucl_object_t *elt;
+	const char *str;
+	size_t len;
+	int64_t iv;
+	int ret;
+
+	switch (ucl_object_type(obj)) {
+	case UCL_OBJECT:
+	case UCL_ARRAY:
+		if ((ret = uclua_emit_string(info, "{")) != 0)
+			return (ret);
+		it = NULL;
+		while ((elt = ucl_object_iterate(obj, &it, true)) != NULL) {
+			if (ucl_object_type(obj) == UCL_OBJECT) {
+				str = ucl_object_keyl(elt, &len);
+				if ((ret = uclua_emit_string(info, "[")) != 0 ||
+				    (ret = uclua_luac_string(info, str,
+				    len)) != 0 ||
+				    (ret = uclua_emit_string(info, "]=")) != 0)
+					return (ret);
+			}
+			if ((ret = uclua_luac_value(elt, info)) != 0 ||
+			    (ret = uclua_emit_string(info, ",")) != 0)
+				return (ret);
+		}
+		return (uclua_emit_string(info, "}"));
+	case UCL_INT:
+		/* -2^63 would read as the negation of a too-large integer. */
+		iv = ucl_object_toint(obj);
+		if (iv == INT64_MIN)
+			return (uclua_emit_string(info, "(%jd-1)",
+			    (intmax_t)(iv + 1)));
+		return (uclua_emit_string(info, "%jd", (intmax_t)iv));
+	case UCL_FLOAT:
+		return (uclua_luac_float(info, ucl_object_todouble(obj)));
+	case UCL_BOOLEAN:
+		return (uclua_emit_string(info, "%s",
+		    ucl_object_toboolean(obj) ? "true" : "false"));
+	case UCL_STRING:
+		str = ucl_object_tolstring(obj, &len);
+		return (uclua_luac_string(info, str, len));
+	default:
+		*info->error = UCLUE_NOTYPE;
+		return (EINVAL);
+	}
+}
+
+/*
+ * The source that uclua_dump_luac() compiles.  It's never read by anyone, so
+ * unlike uclua_dump_lua() it doesn't bother with layout, but it's exact:
+ * strings and floats come back as they went in, and keys that aren't names
+ * are assigned by index.
+ */
+static int
+uclua_luac_source(const ucl_object_t *ucl, uclua_dump_info *info)
+{
+	ucl_object_iter_t it;
+	const ucl_object_t *elt;
+	const char *key;
+	size_t len;
+	int ret;
+
+	if (ucl_object_type(ucl) != UCL_OBJECT) {
+		if ((ret = uclua_emit_string(info, "return ")) != 0 ||
+		    (ret = uclua_luac_value(ucl, info)) != 0)
+			return (ret);
+		return (uclua_emit_string(info, "\n"));
+	}
+
+	it = NULL;
+	while ((elt = ucl_object_iterate(ucl, &it, true)) != NULL) {
+		key = ucl_object_keyl(elt, &len);
+		if (uclua_luac_ident(key, len)) {
+			ret = uclua_emit_string(info, "%.*s=", (int)len, key);
+		} else {
+#if LUA_VERSION_NUM >= 502
+			ret = uclua_emit_string(info, "_ENV[");
+#else
+			ret = uclua_emit_string(info, "getfenv(1)[");
+#endif
+			if (ret == 0)
+				ret = uclua_luac_string(info, key, len);
+			if (ret == 0)
+				ret = uclua_emit_string(info, "]=");
+		}
+		if (ret != 0 || (ret = uclua_luac_value(elt, info)) != 0 ||
+		    (ret = uclua_emit_string(info, "\n")) != 0)
+			return (ret);
+	}
+
+	return (0);
+}
+
+/*
+ * As uclua_dump_lua(), but precompiled: the configuration is written out as
+ * Lua, compiled here and written out with lua_dump(), so that consumers skip
+ * parsing it.  The chunk's header carries the version and number format of
+ * the Lua we're built against, and other versions will refuse to load it.
+ */
+int
+uclua_dump_luac(const ucl_object_t *ucl, FILE *f, uclua_error *error)
+{
+	uclua_dump_info sinfo;
+	uclua_luac_info info;
+	lua_State *L;
+	FILE *src;
+	char *buf;
+	size_t len;
+	int ret;
+
+	buf = NULL;
+	len = 0;
+	src = open_memstream(&buf, &len);
+	if (src == NULL) {
+		*error = UCLUE_NOMEM;
+		return (ENOMEM);
+	}
+
+	sinfo.error = error;
+	sinfo.f = src;
+	sinfo.depth = 0;
+	ret = uclua_luac_source(ucl, &sinfo);
+	if (fclose(src) != 0 && ret == 0) {
+		*error = UCLUE_NOMEM;
+		ret = ENOMEM;
+	}
+	if (ret != 0) {
+		free(buf);
+		return (ret);
+	}
+
+	/* Emission may be threaded, so compile in a state of our own. */
+	L = luaL_newstate();
+	if (L == NULL) {
+		free(buf);
+		*error = UCLUE_NOMEM;
+		return (ENOMEM);
+	}
+
+	if (luaL_loadbuffer(L, buf, len, "=config") != LUA_OK) {
+		*error = UCLUE_DUMP_EMITFAIL;
+		ret = EINVAL;
+	} else {
+		info.f = f;
+		info.serrno = 0;
+		if (uclua_lua_dump(L, uclua_luac_write, &info, 1) != 0) {
+			ret = info.serrno != 0 ? info.serrno : EIO;
+			switch (ret) {
+			case ENOSPC:
+			case EFBIG:
+			case EDQUOT:
+				*error = UCLUE_DUMP_NOSPC;
+				break;
+			default:
+				*error = UCLUE_DUMP_WRITEFAIL;
+				break;
+			}
+		}
+	}
+
+	lua_close(L);
+	free(buf);
+	return (ret);
 }
 
 static int __printflike(2, 3)
@@ -82,10 +365,10 @@ uclua_emit_string(uclua_dump_info *info, const char *fmt, ...)
 	case ENOSPC:
 	case EFBIG:
 	case EDQUOT:
-		(void)uclua_set_error(info->lcook, UCLUE_DUMP_NOSPC);
+		*info->error = UCLUE_DUMP_NOSPC;
 		break;
 	default:
-		(void)uclua_set_error(info->lcook, UCLUE_DUMP_WRITEFAIL);
+		*info->error = UCLUE_DUMP_WRITEFAIL;
 		break;
 	}
 
@@ -128,7 +411,7 @@ uclua_dump_object_value(const ucl_object_t *obj, uclua_dump_info *info)
 		break;
 	default:
 		/* Shouldn't happen, type was checked back in uclua_object_key. */
-		(void)uclua_set_error(info->lcook, UCLUE_NOTYPE);
+		*info->error = UCLUE_NOTYPE;
 		ret = EINVAL;
 		break;
 	}
@@ -199,7 +482,7 @@ uclua_dump_object(const ucl_object_t *obj, bool keys, uclua_dump_info *info)
 		case UCL_STRING:
 			break;
 		default:
-			(void)uclua_set_error(info->lcook, UCLUE_NOTYPE);
+			*info->error = UCLUE_NOTYPE;
 			return (EINVAL);
 		}
 
@@ -210,7 +493,7 @@ uclua_dump_object(const ucl_object_t *obj, bool keys, uclua_dump_info *info)
 			uclkey = uclua_object_key(obj);
 			if (uclkey == NULL) {
 				ret = ENOMEM;
-				(void)uclua_set_error(info->lcook, UCLUE_NOMEM);
+				*info->error = UCLUE_NOMEM;
 			} else if (info->depth == 0) {
 				ret = uclua_emit_string(info, "%*s%s = ", uclua_padding(info->depth), "", uclkey);
 			} else {
@@ -0,0 +1,2 @@
+a.x = 2
+b = 3
@@ -0,0 +1,64 @@
+/*
+ * Changes made after uclua_checkpoint() are dropped by uclua_rollback(), which
+ * can be done any number of times, and the checkpoint itself is taken once.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <uclua.h>
+
+static bool
+parse(lcookie_t *lcook, const char *path)
+{
+	FILE *f;
+	bool ok;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return (false);
+	ok = uclua_parse_file(lcook, f);
+	fclose(f);
+	return (ok);
+}
+
+static bool
+show(lcookie_t *lcook)
+{
+	const ucl_object_t *root;
+
+	if ((root = uclua_ucl(lcook)) == NULL)
+		return (false);
+	printf("a.x = %jd, b %s\n",
+	    (intmax_t)ucl_object_toint(ucl_object_lookup_path(root, "a.x")),
+	    ucl_object_lookup(root, "b") != NULL ? "set" : "unset");
+	return (true);
+}
+
+int
+main(void)
+{
+	lcookie_t *lcook;
+	int i;
+
+	if ((lcook = uclua_new()) == NULL)
+		return (1);
+	if (uclua_rollback(lcook))
+		return (1);
+	printf("%s\n", uclua_error_string(uclua_get_error(lcook)));
+
+	if (!parse(lcook, "base.lua") || !uclua_checkpoint(lcook))
+		return (1);
+	if (uclua_checkpoint(lcook))
+		return (1);
+	printf("%s\n", uclua_error_string(uclua_get_error(lcook)));
+
+	for (i = 0; i < 2; i++) {
+		if (!parse(lcook, "change.lua") || !show(lcook))
+			return (1);
+		if (!uclua_rollback(lcook) || !show(lcook))
+			return (1);
+	}
+
+	uclua_free(lcook);
+	return (0);
+}
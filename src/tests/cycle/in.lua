@@ -0,0 +1,2 @@
+local s = { 1 }
+out = { s, { s } }
@@ -0,0 +1,2 @@
+loop = { 1 }
+loop[2] = { loop }
@@ -0,0 +1,47 @@
+/*
+ * A table reached twice converts the same both times, but a table that
+ * contains itself can't be converted at all.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <uclua.h>
+
+static const char *
+convert(const char *path)
+{
+	FILE *f;
+	lcookie_t *lcook;
+	const ucl_object_t *root;
+	static char buf[64];
+
+	if ((lcook = uclua_new()) == NULL)
+		return ("no cookie");
+	if ((f = fopen(path, "r")) == NULL || !uclua_parse_file(lcook, f))
+		return ("not parsed");
+	fclose(f);
+
+	if ((root = uclua_ucl(lcook)) == NULL) {
+		snprintf(buf, sizeof(buf), "%s",
+		    uclua_error_string(uclua_get_error(lcook)));
+	} else {
+		snprintf(buf, sizeof(buf), "%jd %jd",
+		    (intmax_t)ucl_object_toint(
+		    ucl_object_lookup_path(root, "out.0.0")),
+		    (intmax_t)ucl_object_toint(
+		    ucl_object_lookup_path(root, "out.1.0.0")));
+	}
+
+	uclua_free(lcook);
+	return (buf);
+}
+
+int
+main(void)
+{
+
+	printf("in.lua: %s\n", convert("in.lua"));
+	printf("loop.lua: %s\n", convert("loop.lua"));
+	return (0);
+}
@@ -0,0 +1 @@
+cfg = { a = 1, b = 3 }
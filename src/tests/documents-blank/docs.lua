@@ -0,0 +1,7 @@
+---
+x = 1
+---
+
+---
+x = 2
+---
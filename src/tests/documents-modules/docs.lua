@@ -0,0 +1,5 @@
+local mod = require("mod")
+out = { seen, mod.seen() }
+---
+local mod = require("mod")
+out = { seen, mod.seen() }
@@ -0,0 +1,5 @@
+-- Sets a global in the environment of whichever document loads it.
+seen = (seen or 0) + 1
+return {
+	seen = function() return seen end,
+}
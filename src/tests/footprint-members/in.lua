@@ -0,0 +1 @@
+cfg = { 1, 2, { 3 } }
@@ -0,0 +1 @@
+t = { { 1 }, { 2 } }
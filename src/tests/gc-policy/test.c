@@ -0,0 +1,60 @@
+/*
+ * Collector modes that this Lua doesn't have are refused, and the full
+ * collections asked for at uclua_reset() show up in uclua_gc_stats().
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <uclua.h>
+
+int
+main(void)
+{
+	struct uclua_gc_policy policy = { 0 };
+	FILE *f;
+	lcookie_t *lcook;
+	ucl_object_t *stats;
+	int64_t collections, cycles;
+	int i;
+
+	if ((lcook = uclua_new()) == NULL)
+		return (1);
+
+	policy.mode = (uclua_gc_mode)-1;
+	if (uclua_set_gc_policy(lcook, &policy))
+		return (1);
+	printf("%s\n", uclua_error_string(uclua_get_error(lcook)));
+
+	/* Only Lua 5.4 has a generational mode. */
+	policy.mode = UCLUA_GC_GENERATIONAL;
+	if (!uclua_set_gc_policy(lcook, &policy) &&
+	    uclua_get_error(lcook) != UCLUE_GC_UNSUPPORTED)
+		return (1);
+
+	policy.mode = UCLUA_GC_INCREMENTAL;
+	policy.pause = 150;
+	policy.flags = UCLUA_GC_PARSE_STOP | UCLUA_GC_RESET_COLLECT;
+	if (!uclua_set_gc_policy(lcook, &policy))
+		return (1);
+	for (i = 0; i < 2; i++) {
+		if ((f = fopen("in.lua", "r")) == NULL)
+			return (1);
+		if (!uclua_parse_file(lcook, f) || uclua_ucl(lcook) == NULL)
+			return (1);
+		fclose(f);
+		uclua_reset(lcook);
+	}
+
+	if ((stats = uclua_gc_stats(lcook)) == NULL)
+		return (1);
+	collections = ucl_object_toint(ucl_object_lookup(stats,
+	    "collections"));
+	cycles = ucl_object_toint(ucl_object_lookup(stats, "cycles"));
+	printf("%jd collections, %s\n", (intmax_t)collections,
+	    cycles >= collections ? "all counted" : "missed some");
+	ucl_object_unref(stats);
+
+	uclua_free(lcook);
+	return (0);
+}
@@ -0,0 +1,6 @@
+local t = { 1 }
+for i = 2, 511 do
+	t = { t }
+end
+x = t
+y = 1
@@ -0,0 +1,2 @@
+local t = { 1 }
+out = { t, t, { t } }
@@ -0,0 +1 @@
+return { key = { 1, 2 } }
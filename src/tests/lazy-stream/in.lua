@@ -0,0 +1 @@
+mod = require("mod")
@@ -0,0 +1,4 @@
+a = { 1, -2.5, 0x10, 1e3, "x", 'y', [[long]], true, false, { { } } }
+b = { key = { 3 }, ["a key"] = -4 }
+c = "str"
+c = "again"
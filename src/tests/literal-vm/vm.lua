@@ -0,0 +1,6 @@
+-- Anything but a literal sends the chunk through the VM.
+local _
+a = { 1, -2.5, 0x10, 1e3, "x", 'y', [[long]], true, false, { { } } }
+b = { key = { 3 }, ["a key"] = -4 }
+c = "str"
+c = "again"
@@ -0,0 +1,6 @@
+ok = {
+	s == "a]]b\n\"q\"\\\t\195\169",
+	f[1] == 0.1, f[2] == 1e300, f[3] == 2.0, f[4] == -1 / 3,
+	tostring(f[3]) == tostring(2.0),
+	t["a-b"] == 1, t["end"][1] == 2, t["]]"] == "x",
+}
@@ -0,0 +1,5 @@
+s = "a]]b\n\"q\"\\\t\195\169"
+f = { 0.1, 1e300, 2.0, -1 / 3 }
+t = { ["a-b"] = 1, ["end"] = { 2 }, ["]]"] = "x" }
+local env = _ENV or getfenv(1)
+env["a-b"] = 3
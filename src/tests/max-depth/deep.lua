@@ -0,0 +1,6 @@
+deep = {}
+local n = deep
+for i = 1, 10000 do
+	n[1] = {}
+	n = n[1]
+end
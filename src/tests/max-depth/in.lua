@@ -0,0 +1 @@
+t = { { 1 } }
@@ -0,0 +1,50 @@
+/*
+ * The environment counts against uclua_set_max_depth(), and without a limit
+ * nesting is only bounded by memory.
+ */
+
+#include <stdio.h>
+
+#include <uclua.h>
+
+static bool
+parse(lcookie_t *lcook, const char *path)
+{
+	FILE *f;
+	bool ok;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return (false);
+	ok = uclua_parse_file(lcook, f);
+	fclose(f);
+	return (ok);
+}
+
+static void
+convert(lcookie_t *lcook, unsigned int depth)
+{
+
+	uclua_set_max_depth(lcook, depth);
+	printf("%u: %s\n", depth, uclua_ucl(lcook) != NULL ? "converted" :
+	    uclua_error_string(uclua_get_error(lcook)));
+}
+
+int
+main(void)
+{
+	lcookie_t *lcook;
+
+	if ((lcook = uclua_new()) == NULL)
+		return (1);
+	if (!parse(lcook, "in.lua"))
+		return (1);
+	convert(lcook, 2);
+	convert(lcook, 3);
+
+	if (!parse(lcook, "deep.lua"))
+		return (1);
+	convert(lcook, 0);
+
+	uclua_free(lcook);
+	return (0);
+}
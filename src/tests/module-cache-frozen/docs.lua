@@ -0,0 +1,7 @@
+local mod = require("mod")
+out = { mod.n, (pcall(mod.bump)) }
+mod.n = 5
+---
+local mod = require("mod")
+out = { mod.n, (pcall(mod.bump)) }
+mod.n = 5
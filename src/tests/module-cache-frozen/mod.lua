@@ -0,0 +1,7 @@
+-- uclua: pure
+local M = { n = 0 }
+function M.bump()
+	M.n = M.n + 1
+	return M.n
+end
+return M
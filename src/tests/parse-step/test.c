@@ -0,0 +1,48 @@
+/*
+ * A document runs a budget at a time under uclua_parse_step(), and another
+ * can't be started on the cookie until it's done.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <uclua.h>
+
+int
+main(void)
+{
+	FILE *f;
+	lcookie_t *lcook;
+	const ucl_object_t *obj;
+	uclua_step status;
+	int steps;
+
+	if ((lcook = uclua_new()) == NULL)
+		return (1);
+	if ((f = fopen("in.lua", "r")) == NULL)
+		return (1);
+	if (!uclua_parse_begin(lcook, f))
+		return (1);
+
+	steps = 0;
+	while ((status = uclua_parse_step(lcook, 100)) == UCLUAS_AGAIN) {
+		if (steps++ != 0)
+			continue;
+		rewind(f);
+		if (uclua_parse_begin(lcook, f))
+			return (1);
+		printf("%s\n", uclua_error_string(uclua_get_error(lcook)));
+	}
+
+	fclose(f);
+	if (status != UCLUAS_DONE)
+		return (1);
+	printf("%s\n", steps > 1 ? "stepped" : "ran");
+	if ((obj = uclua_ucl(lcook)) == NULL)
+		return (1);
+	printf("n = %jd\n", (intmax_t)ucl_object_toint(
+	    ucl_object_lookup(obj, "n")));
+
+	uclua_free(lcook);
+	return (0);
+}
@@ -0,0 +1 @@
+a = { b = { 10, { c = "str" }, 2.5, true } }
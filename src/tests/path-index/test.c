@@ -0,0 +1,76 @@
+/*
+ * Paths compiled against an index find what uclua_lookup() would, with the
+ * value already decoded.
+ */
+
+#include <sys/param.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <uclua.h>
+
+static const char *paths[] = {
+	"", "a", "a.b", "a.b[1]", "a.b[2].c", "a.b[3]", "a.b[4]", "a.b[5]",
+	"a.c",
+};
+
+static void
+show(const struct uclua_index *idx, const char *path)
+{
+	const uclua_path *p;
+
+	printf("\"%s\": ", path);
+	if ((p = uclua_path_compile(idx, path)) == NULL) {
+		printf("not found\n");
+		return;
+	}
+
+	switch (uclua_path_type(p)) {
+	case UCL_OBJECT:
+	case UCL_ARRAY:
+		printf("%zu entries\n", uclua_path_count(p));
+		break;
+	case UCL_INT:
+		printf("%jd\n", (intmax_t)uclua_path_toint(p));
+		break;
+	case UCL_FLOAT:
+		printf("%g\n", uclua_path_todouble(p));
+		break;
+	case UCL_BOOLEAN:
+		printf("%s\n", uclua_path_toboolean(p) ? "true" : "false");
+		break;
+	case UCL_STRING:
+		printf("%s\n", uclua_path_tostring(p, NULL));
+		break;
+	default:
+		printf("type %d\n", uclua_path_type(p));
+		break;
+	}
+}
+
+int
+main(void)
+{
+	FILE *f;
+	lcookie_t *lcook;
+	struct uclua_index *idx;
+	size_t i;
+
+	if ((lcook = uclua_new()) == NULL)
+		return (1);
+	if ((f = fopen("in.lua", "r")) == NULL || !uclua_parse_file(lcook, f))
+		return (1);
+	fclose(f);
+
+	/* The index keeps its own reference to the tree. */
+	if ((idx = uclua_index_new(uclua_ucl(lcook))) == NULL)
+		return (1);
+	uclua_free(lcook);
+
+	for (i = 0; i < nitems(paths); i++)
+		show(idx, paths[i]);
+
+	uclua_index_free(idx);
+	return (0);
+}
@@ -0,0 +1,9 @@
+local function busy(n)
+	local sum = 0
+	for i = 1, n do
+		sum = sum + i
+	end
+	return sum
+end
+
+out = busy(100000)
@@ -0,0 +1,42 @@
+/*
+ * Profiles are only kept once asked for, and samples land on the function
+ * doing the work.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <uclua.h>
+
+int
+main(void)
+{
+	char line[256];
+	FILE *f, *folded;
+	lcookie_t *lcook;
+	bool found;
+
+	if ((lcook = uclua_new()) == NULL)
+		return (1);
+	if (uclua_profile(lcook) != NULL)
+		return (1);
+	printf("%s\n", uclua_error_string(uclua_get_error(lcook)));
+
+	uclua_set_profile(lcook, 100);
+	if ((f = fopen("in.lua", "r")) == NULL || !uclua_parse_file(lcook, f))
+		return (1);
+	fclose(f);
+
+	if ((folded = tmpfile()) == NULL ||
+	    uclua_profile_folded(lcook, folded) != 0)
+		return (1);
+	rewind(folded);
+	found = false;
+	while (!found && fgets(line, sizeof(line), folded) != NULL)
+		found = strstr(line, ";busy (") != NULL;
+	fclose(folded);
+	printf("busy %s\n", found ? "sampled" : "missing");
+
+	uclua_free(lcook);
+	return (0);
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Regression tests for uclua and libuclua.  Each directory here is a test:
+# uclua is run from within it, with the sandbox defaulting to it, on the
+# arguments in its `args`, and what it writes to stdout must match its
+# `expected`.  Tests that need to pick their output apart have a `run` script
+# instead, which gets the path to uclua as its argument.  Tests of the library
+# itself are a `test.c`, built with $CC, $CFLAGS and $LDFLAGS and run the same
+# way.
+#
+# usage: run.sh path/to/uclua, or `make check` in src/
+
+if [ $# -ne 1 ]; then
+	echo "usage: $0 uclua" >&2
+	exit 2
+fi
+
+uclua=$(realpath "$1") || exit 2
+tests=$(dirname "$(realpath "$0")")
+out=$(mktemp) || exit 2
+bin=$(mktemp) || exit 2
+trap 'rm -f "$out" "$bin"' EXIT
+
+fail=0
+for dir in "$tests"/*/; do
+	name=$(basename "$dir")
+	if [ -f "$dir/test.c" ]; then
+		${CC:-cc} ${CFLAGS} -o "$bin" "$dir/test.c" ${LDFLAGS} &&
+		    (cd "$dir" && "$bin")
+	elif [ -f "$dir/run" ]; then
+		(cd "$dir" && sh ./run "$uclua")
+	else
+		(cd "$dir" && eval "set -- $(cat args)" && "$uclua" "$@")
+	fi > "$out" 2>/dev/null
+	if diff -u "$dir/expected" "$out"; then
+		echo "ok - $name"
+	else
+		echo "not ok - $name"
+		fail=1
+	fi
+done
+
+exit $fail
@@ -0,0 +1 @@
+ok = pcall(require, "mod")
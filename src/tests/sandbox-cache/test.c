@@ -0,0 +1,84 @@
+/*
+ * A module that isn't in the sandbox stays missing while the sandbox's mtime
+ * says nothing has changed, until uclua_sandbox_flush() forgets about it.
+ */
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <uclua.h>
+
+static char dir[] = "/tmp/uclua-test.XXXXXX";
+static char mod[sizeof(dir) + 8];
+
+static bool
+touch(void)
+{
+	struct timespec ts[2];
+
+	ts[0].tv_sec = ts[1].tv_sec = 1000000000;
+	ts[0].tv_nsec = ts[1].tv_nsec = 0;
+	return (utimensat(AT_FDCWD, dir, ts, 0) == 0);
+}
+
+static void
+require(lcookie_t *lcook)
+{
+	FILE *f;
+	const ucl_object_t *root;
+
+	root = NULL;
+	if ((f = fopen("in.lua", "r")) != NULL) {
+		if (uclua_parse_file(lcook, f))
+			root = uclua_ucl(lcook);
+		fclose(f);
+	}
+
+	if (root == NULL)
+		printf("error\n");
+	else if (ucl_object_toboolean(ucl_object_lookup(root, "ok")))
+		printf("found\n");
+	else
+		printf("missing\n");
+}
+
+int
+main(void)
+{
+	FILE *f;
+	lcookie_t *lcook;
+	int ret;
+
+	if (mkdtemp(dir) == NULL)
+		return (1);
+	snprintf(mod, sizeof(mod), "%s/mod.lua", dir);
+
+	ret = 1;
+	if ((lcook = uclua_new()) == NULL || !uclua_set_sandbox(lcook, dir))
+		goto out;
+	if (!touch())
+		goto out;
+	require(lcook);
+
+	/* Put the mtime back so that the miss still looks current. */
+	if ((f = fopen(mod, "w")) == NULL)
+		goto out;
+	fprintf(f, "return true\n");
+	fclose(f);
+	if (!touch())
+		goto out;
+	require(lcook);
+
+	uclua_sandbox_flush(lcook);
+	require(lcook);
+	ret = 0;
+out:
+	uclua_free(lcook);
+	unlink(mod);
+	rmdir(dir);
+	return (ret);
+}
@@ -0,0 +1,2 @@
+-- Item and property bounds are no business of strings, and vice versa.
+cfg = { name = "abc" }
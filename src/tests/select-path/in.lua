@@ -0,0 +1 @@
+a = { { x = 1 } }
@@ -0,0 +1 @@
+cfg = { name = "alpha" }
@@ -0,0 +1,2 @@
+-- Coerces strings before anything opens the string library.
+out = { "10" + 1, -"2", "3" * "4" }
@@ -26,29 +26,74 @@
  */
 
 #include <sys/param.h>
+#include <sys/stat.h>
 
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <getopt.h>
 
 #include <uclua.h>
 
+#include "uclua_serve.h"
+
 enum {
-	JSON_OPT = CHAR_MAX + 1,
+	CONNECT_OPT = CHAR_MAX + 1,
+	DIFF_OPT,
+	DOCUMENTS_OPT,
+	FOOTPRINT_OPT,
+	GC_OPT,
+	GCSTATS_OPT,
+	JSON_OPT,
+	LAZY_OPT,
 	LUA_OPT,
+	LUAC_OPT,
+	MODCACHE_OPT,
+	NDJSON_OPT,
+	PROFILE_OPT,
+	SCHEMA_OPT,
+	SELECT_OPT,
+	SERVE_OPT,
+	SNAPSHOT_OPT,
+	STREAM_OPT,
 	UCL_OPT,
 	YAML_OPT,
 };
 
-static const char *optstr = "o:s:";
+static const char *optstr = "j:o:s:";
+
+/* VM instructions between profiler samples. */
+#define	PROFILE_INTERVAL	1000
+
+/* Default --documents separator; a comment to Lua, should it be missed. */
+#define	DOCUMENT_DELIM	"---"
 
 static struct option longopts[] = {
-	{ "json",	no_argument,	NULL,	JSON_OPT },
-	{ "lua",	no_argument,	NULL,	LUA_OPT },
-	{ "ucl",	no_argument,	NULL,	UCL_OPT },
-	{ "yaml",	no_argument,	NULL,	YAML_OPT },
+	{ "connect",	required_argument,	NULL,	CONNECT_OPT },
+	{ "diff",	no_argument,	NULL,	DIFF_OPT },
+	{ "documents",	optional_argument,	NULL,	DOCUMENTS_OPT },
+	{ "footprint",	optional_argument,	NULL,	FOOTPRINT_OPT },
+	{ "gc",	required_argument,	NULL,	GC_OPT },
+	{ "gc-stats",	no_argument,	NULL,	GCSTATS_OPT },
+	{ "json",	optional_argument,	NULL,	JSON_OPT },
+	{ "lazy-require",	no_argument,	NULL,	LAZY_OPT },
+	{ "lua",	optional_argument,	NULL,	LUA_OPT },
+	{ "luac",	optional_argument,	NULL,	LUAC_OPT },
+	{ "module-cache",	optional_argument,	NULL,	MODCACHE_OPT },
+	{ "ndjson",	optional_argument,	NULL,	NDJSON_OPT },
+	{ "profile",	required_argument,	NULL,	PROFILE_OPT },
+	{ "schema",	required_argument,	NULL,	SCHEMA_OPT },
+	{ "select",	required_argument,	NULL,	SELECT_OPT },
+	{ "serve",	required_argument,	NULL,	SERVE_OPT },
+	{ "snapshot",	optional_argument,	NULL,	SNAPSHOT_OPT },
+	{ "stream",	no_argument,	NULL,	STREAM_OPT },
+	{ "ucl",	optional_argument,	NULL,	UCL_OPT },
+	{ "yaml",	optional_argument,	NULL,	YAML_OPT },
+	{ "jobs",	required_argument,	NULL,	'j' },
 	{ "output",	required_argument,	NULL,	'o' },
 	{ "sandbox",	required_argument,	NULL,	's' },
 };
@@ -57,8 +102,28 @@ static int
 usage(void)
 {
 
-	fprintf(stderr, "Usage: %s [--json | --lua | --ucl | --yaml] "
-	    "[-o output] [-s sandbox] [file ...]\n", getprogname());
+	fprintf(stderr, "Usage: %s [--json[=file] | --lua[=file] | "
+	    "--luac[=file] | --ndjson[=file] | --snapshot[=file] | "
+	    "--ucl[=file] | --yaml[=file]] [--footprint[=depth]] "
+	    "[--gc policy] [--gc-stats] [--lazy-require] [--profile file] "
+	    "[--schema file] [--select path] [-j jobs] [-o output] "
+	    "[-s sandbox] [file ...]\n"
+	    "       %s --diff [--json[=file] | --lua[=file] | --luac[=file] | "
+	    "--ndjson[=file] | --snapshot[=file] | --ucl[=file] | "
+	    "--yaml[=file]] [--lazy-require] [--schema file] [-o output] "
+	    "[-s sandbox] old new\n"
+	    "       %s --stream [--json | --ndjson] [--lazy-require] "
+	    "[-o output] [-s sandbox] [file ...]\n"
+	    "       %s --documents[=delimiter] --ndjson [--gc policy] "
+	    "[--gc-stats] [--lazy-require] [--module-cache[=dir]] "
+	    "[--schema file] [--select path] [-o output] [-s sandbox] "
+	    "[file ...]\n"
+	    "       %s --serve socket\n"
+	    "       %s --connect socket [--json | --lua | --luac | --ndjson | "
+	    "--snapshot | --ucl | --yaml] [--select path] [-o output] "
+	    "[-s sandbox] [file ...]\n",
+	    getprogname(), getprogname(), getprogname(), getprogname(),
+	    getprogname(), getprogname());
 	return (1);
 }
 
@@ -80,7 +145,8 @@ parse_one(lcookie_t *lcook, const char *name)
 	ret = 0;
 	if (!uclua_parse_file(lcook, cfg)) {
 		ret = 1;
-		fprintf(stderr, "Failed to parse from %s\n", cfg == stdin ? "stdin" : name);
+		fprintf(stderr, "Failed to parse from %s\n",
+		    cfg == stdin ? "stdin" : name);
 	}
 
 	if (cfg != stdin)
@@ -88,35 +154,537 @@ parse_one(lcookie_t *lcook, const char *name)
 	return (ret);
 }
 
+/*
+ * Evaluate one --documents document from a fresh environment and write its
+ * record.  Returns 1 if the document failed, and -1 if its record could not
+ * be written.
+ */
+static int
+write_document(lcookie_t *lcook, const char *buf, size_t len, size_t ndoc,
+    const char *selpath, FILE *out)
+{
+	ucl_object_t *obj;
+	FILE *f;
+	const char *err;
+	int ret;
+
+	uclua_reset(lcook);
+	obj = NULL;
+	err = NULL;
+	f = NULL;
+	if (len != 0 &&
+	    (f = fmemopen(__DECONST(char *, buf), len, "r")) == NULL)
+		err = strerror(errno);
+	else if (f != NULL && !uclua_parse_file(lcook, f))
+		err = uclua_error_string(uclua_get_error(lcook));
+	if (f != NULL)
+		fclose(f);
+
+	if (err == NULL) {
+		if (selpath != NULL)
+			obj = uclua_lookup(lcook, selpath);
+		else if ((obj = uclua_ucl(lcook)) != NULL)
+			obj = ucl_object_ref(obj);
+		if (obj == NULL)
+			err = uclua_get_error(lcook) == UCLUE_SCHEMA ?
+			    uclua_schema_error(lcook) :
+			    uclua_error_string(uclua_get_error(lcook));
+	}
+
+	ret = 0;
+	if (err != NULL) {
+		ret = 1;
+		obj = ucl_object_typed_new(UCL_OBJECT);
+		if (obj == NULL ||
+		    !ucl_object_insert_key(obj, ucl_object_fromint(ndoc),
+		    "document", 0, false) ||
+		    !ucl_object_insert_key(obj, ucl_object_fromstring(err),
+		    "error", 0, false)) {
+			fprintf(stderr, "out of memory\n");
+			ret = -1;
+		}
+	}
+
+	if (ret != -1 && uclua_dump_ucl(lcook, obj, UCLUAD_NDJSON, out) != 0) {
+		fprintf(stderr, "Failed to write document %zu: %s\n", ndoc,
+		    uclua_error_string(uclua_get_error(lcook)));
+		ret = -1;
+	}
+	if (obj != NULL)
+		ucl_object_unref(obj);
+	return (ret);
+}
+
+/* Nothing but whitespace, e.g. what precedes a leading delimiter. */
+static bool
+blank_document(const char *buf, size_t len)
+{
+
+	for (size_t i = 0; i < len; i++) {
+		if (!isspace((unsigned char)buf[i]))
+			return (false);
+	}
+	return (true);
+}
+
+/*
+ * Split `name` into documents at lines that are just `delim` and write one
+ * NDJSON record for each, numbering them on from *ndocp.  A document that
+ * fails gets an { document, error } record in its place, and blank ones are
+ * skipped.
+ */
+static int
+write_documents(lcookie_t *lcook, const char *name, const char *delim,
+    const char *selpath, FILE *out, size_t *ndocp)
+{
+	FILE *in;
+	char *doc, *line, *ndoc;
+	size_t doccap, doclen, dlen, linecap, len;
+	ssize_t linelen;
+	int ret, status;
+
+	if (strcmp(name, "-") == 0)
+		in = stdin;
+	else
+		in = fopen(name, "r");
+	if (in == NULL) {
+		fprintf(stderr, "Failed to open file '%s'\n", name);
+		return (1);
+	}
+
+	ret = 0;
+	doc = line = NULL;
+	doccap = doclen = linecap = 0;
+	dlen = strlen(delim);
+	while ((linelen = getline(&line, &linecap, in)) != -1) {
+		len = linelen;
+		if (len > 0 && line[len - 1] == '\n')
+			len--;
+		if (len == dlen && memcmp(line, delim, dlen) == 0) {
+			if (blank_document(doc, doclen)) {
+				doclen = 0;
+				continue;
+			}
+			status = write_document(lcook, doc, doclen, ++*ndocp,
+			    selpath, out);
+			if (status != 0)
+				ret = 1;
+			if (status == -1)
+				goto out;
+			doclen = 0;
+			continue;
+		}
+
+		if (doclen + linelen > doccap) {
+			ndoc = realloc(doc, MAX(doccap * 2, doclen + linelen));
+			if (ndoc == NULL) {
+				fprintf(stderr, "out of memory\n");
+				ret = 1;
+				goto out;
+			}
+			doc = ndoc;
+			doccap = MAX(doccap * 2, doclen + linelen);
+		}
+		memcpy(doc + doclen, line, linelen);
+		doclen += linelen;
+	}
+
+	if (ferror(in)) {
+		fprintf(stderr, "Failed to read from %s\n",
+		    in == stdin ? "stdin" : name);
+		ret = 1;
+	} else if (!blank_document(doc, doclen) &&
+	    write_document(lcook, doc, doclen, ++*ndocp, selpath, out) != 0) {
+		ret = 1;
+	}
+out:
+	free(doc);
+	free(line);
+	if (in != stdin)
+		fclose(in);
+	return (ret);
+}
+
+static int
+load_schema(lcookie_t *lcook, const char *path)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *schema;
+	int ret;
+
+	parser = ucl_parser_new(UCL_PARSER_DEFAULT);
+	if (parser == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return (1);
+	}
+
+	if (!ucl_parser_add_file(parser, path)) {
+		fprintf(stderr, "Failed to parse schema '%s': %s\n", path,
+		    ucl_parser_get_error(parser));
+		ucl_parser_free(parser);
+		return (1);
+	}
+
+	schema = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+
+	ret = 0;
+	if (!uclua_set_schema(lcook, schema)) {
+		fprintf(stderr, "Bad schema '%s': %s\n", path,
+		    uclua_schema_error(lcook));
+		ret = 1;
+	}
+
+	ucl_object_unref(schema);
+	return (ret);
+}
+
+/*
+ * Folded stacks go to the requested file for flamegraph.pl, while the per-line
+ * and per-module summary goes to stderr.
+ */
+static int
+write_profile(lcookie_t *lcook, const char *path)
+{
+	FILE *proff;
+	ucl_object_t *report;
+	int ret;
+
+	proff = fopen(path, "w");
+	if (proff == NULL) {
+		fprintf(stderr, "could not open '%s' for profile\n", path);
+		return (1);
+	}
+
+	ret = 0;
+	if (uclua_profile_folded(lcook, proff) != 0) {
+		fprintf(stderr, "Failed to write profile!\n");
+		ret = 1;
+	}
+	fclose(proff);
+
+	report = uclua_profile(lcook);
+	if (report == NULL ||
+	    uclua_dump_ucl(lcook, report, UCLUAD_UCL, stderr) != 0) {
+		fprintf(stderr, "Failed to dump profile!\n");
+		ret = 1;
+	}
+	if (report != NULL)
+		ucl_object_unref(report);
+	return (ret);
+}
+
+static int
+write_footprint(lcookie_t *lcook, unsigned int depth)
+{
+	ucl_object_t *report;
+	int ret;
+
+	ret = 0;
+	report = uclua_footprint(lcook, depth);
+	if (report == NULL ||
+	    uclua_dump_ucl(lcook, report, UCLUAD_UCL, stderr) != 0) {
+		fprintf(stderr, "Failed to dump footprint!\n");
+		ret = 1;
+	}
+	if (report != NULL)
+		ucl_object_unref(report);
+	return (ret);
+}
+
+static int
+write_gc_stats(lcookie_t *lcook)
+{
+	ucl_object_t *report;
+	int ret;
+
+	ret = 0;
+	report = uclua_gc_stats(lcook);
+	if (report == NULL ||
+	    uclua_dump_ucl(lcook, report, UCLUAD_UCL, stderr) != 0) {
+		fprintf(stderr, "Failed to dump gc stats!\n");
+		ret = 1;
+	}
+	if (report != NULL)
+		ucl_object_unref(report);
+	return (ret);
+}
+
+/* --gc may be given more than once, e.g. --gc generational --gc collect. */
+static bool
+gc_opt(const char *arg, struct uclua_gc_policy *policy)
+{
+
+	if (strcmp(arg, "incremental") == 0)
+		policy->mode = UCLUA_GC_INCREMENTAL;
+	else if (strcmp(arg, "generational") == 0)
+		policy->mode = UCLUA_GC_GENERATIONAL;
+	else if (strcmp(arg, "stop") == 0)
+		policy->flags |= UCLUA_GC_PARSE_STOP;
+	else if (strcmp(arg, "collect") == 0)
+		policy->flags |= UCLUA_GC_RESET_COLLECT;
+	else
+		return (false);
+	return (true);
+}
+
+/*
+ * `--json` and friends pick the format for -o, while `--json=file` adds another
+ * output of that format; once any of the latter are given, -o is only written
+ * if it or a bare format option was asked for, too.
+ */
+static void
+format_opt(uclua_dump_type type, uclua_dump_type *udump,
+    struct uclua_output *outs, const char **outpaths, size_t *nouts,
+    bool *defout)
+{
+
+	if (optarg == NULL) {
+		*udump = type;
+		*defout = true;
+		return;
+	}
+
+	outs[*nouts].type = type;
+	outpaths[(*nouts)++] = optarg;
+}
+
+static int
+output_stat(const char *path, struct stat *sb)
+{
+
+	if (strcmp(path, "-") == 0)
+		return (fstat(STDOUT_FILENO, sb));
+	return (stat(path, sb));
+}
+
+/* Outputs yet to be created are the same if they'd land in the same place. */
+static bool
+same_new_file(const char *a, const char *b)
+{
+	struct stat sa, sb;
+	const char *na, *nb;
+	char *da, *db;
+	bool same;
+
+	na = strrchr(a, '/');
+	nb = strrchr(b, '/');
+	if (strcmp(na != NULL ? na + 1 : a, nb != NULL ? nb + 1 : b) != 0)
+		return (false);
+
+	da = na != NULL ? strndup(a, na - a + 1) : strdup(".");
+	db = nb != NULL ? strndup(b, nb - b + 1) : strdup(".");
+	same = da != NULL && db != NULL && stat(da, &sa) == 0 &&
+	    stat(db, &sb) == 0 && sa.st_dev == sb.st_dev &&
+	    sa.st_ino == sb.st_ino;
+	free(da);
+	free(db);
+	return (same);
+}
+
+/*
+ * Outputs written through the same stream are just written one after the other,
+ * but separately opened ones would clobber each other.  This has to be settled
+ * before any of them are opened, since opening one truncates it.
+ */
+static bool
+same_output(const char *a, const char *b)
+{
+	struct stat sa, sb;
+	bool ea, eb;
+
+	if (strcmp(a, "-") == 0 && strcmp(b, "-") == 0)
+		return (false);
+
+	ea = output_stat(a, &sa) == 0;
+	eb = output_stat(b, &sb) == 0;
+	if (ea && eb)
+		return (sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino);
+	else if (ea || eb)
+		return (false);
+	return (same_new_file(a, b));
+}
+
+/* With `newcook`, we're writing out the changes from lcook to newcook. */
+static int
+dump_outputs(lcookie_t *lcook, lcookie_t *newcook, const char *selpath,
+    struct uclua_output *outs, const char **outpaths, size_t nouts)
+{
+	ucl_object_t *obj;
+	int ret;
+
+	if (newcook != NULL) {
+		obj = uclua_diff(lcook, newcook);
+		if (obj == NULL) {
+			fprintf(stderr, "Failed to diff: %s\n",
+			    uclua_get_error(lcook) == UCLUE_SCHEMA ?
+			    uclua_schema_error(lcook) :
+			    uclua_error_string(uclua_get_error(lcook)));
+			return (1);
+		}
+	} else if (selpath != NULL) {
+		obj = uclua_lookup(lcook, selpath);
+		if (obj == NULL) {
+			fprintf(stderr, "Failed to select '%s': %s\n", selpath,
+			    uclua_error_string(uclua_get_error(lcook)));
+			return (1);
+		}
+	} else {
+		obj = uclua_ucl(lcook);
+		if (obj == NULL && uclua_get_error(lcook) == UCLUE_SCHEMA) {
+			fprintf(stderr, "%s\n", uclua_schema_error(lcook));
+			return (1);
+		} else if (obj == NULL) {
+			fprintf(stderr, "Failed to dump!\n");
+			return (1);
+		}
+	}
+
+	ret = 0;
+	if (uclua_dump_outputs(lcook, obj, outs, nouts,
+	    nouts > 1 ? UCLUA_DUMP_THREADED : 0) != 0) {
+		for (size_t i = 0; i < nouts; i++) {
+			if (outs[i].status == 0)
+				continue;
+			fprintf(stderr, "Failed to dump to %s: %s\n",
+			    outpaths[i], uclua_error_string(outs[i].error));
+		}
+		ret = 1;
+	}
+
+	if (newcook != NULL || selpath != NULL)
+		ucl_object_unref(obj);
+	return (ret);
+}
+
 int
 main(int argc, char *argv[])
 {
-	lcookie_t *lcook;
-	FILE *outf;
-	const char *outfile, *sandbox;
+	lcookie_t *lcook, *newcook;
+	struct uclua_gc_policy gcpolicy;
+	struct uclua_output *outs;
+	const char **libdirs, **outpaths;
+	const char *connsock, *outfile, *proffile, *sandbox, *schemafile;
+	const char *docdelim, *errstr, *selpath, *servesock;
 	char *cwd;
-	int ch, ret;
+	size_t ndocs, nlibdirs, nouts;
+	int ch, fpdepth, jobs, ret;
 	uclua_dump_type udump;
+	bool defout, diff, gcstats, lazy, modcache, stream;
 
+	/* Every option could be an output, plus -o. */
+	outs = calloc(argc + 1, sizeof(*outs));
+	outpaths = calloc(argc + 1, sizeof(*outpaths));
+	libdirs = calloc(argc + 1, sizeof(*libdirs));
+	if (outs == NULL || outpaths == NULL || libdirs == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return (1);
+	}
+
+	nlibdirs = nouts = 0;
+	defout = diff = gcstats = lazy = modcache = stream = false;
+	memset(&gcpolicy, 0, sizeof(gcpolicy));
+	lcook = newcook = NULL;
 	udump = UCLUAD_UCL;
 	cwd = NULL;
-	sandbox = outfile = NULL;
+	fpdepth = -1;
+	jobs = 1;
+	sandbox = outfile = proffile = schemafile = selpath = NULL;
+	connsock = docdelim = servesock = NULL;
 	while ((ch = getopt_long(argc, argv, optstr, longopts, NULL)) != -1) {
 		switch (ch) {
+		case CONNECT_OPT:
+			connsock = optarg;
+			break;
+		case DIFF_OPT:
+			diff = true;
+			break;
+		case DOCUMENTS_OPT:
+			docdelim = optarg != NULL ? optarg : DOCUMENT_DELIM;
+			break;
+		case FOOTPRINT_OPT:
+			fpdepth = 1;
+			if (optarg == NULL)
+				break;
+			fpdepth = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL) {
+				fprintf(stderr, "footprint depth %s: %s\n",
+				    optarg, errstr);
+				return (usage());
+			}
+			break;
+		case GC_OPT:
+			if (!gc_opt(optarg, &gcpolicy)) {
+				fprintf(stderr, "unknown gc policy '%s'\n",
+				    optarg);
+				return (usage());
+			}
+			break;
+		case GCSTATS_OPT:
+			gcstats = true;
+			break;
 		case JSON_OPT:
-			udump = UCLUAD_JSON;
+			format_opt(UCLUAD_JSON, &udump, outs, outpaths, &nouts,
+			    &defout);
+			break;
+		case LAZY_OPT:
+			lazy = true;
 			break;
 		case LUA_OPT:
-			udump = UCLUAD_LUA;
+			format_opt(UCLUAD_LUA, &udump, outs, outpaths, &nouts,
+			    &defout);
+			break;
+		case LUAC_OPT:
+			format_opt(UCLUAD_LUAC, &udump, outs, outpaths, &nouts,
+			    &defout);
+			break;
+		case MODCACHE_OPT:
+			modcache = true;
+			if (optarg != NULL)
+				libdirs[nlibdirs++] = optarg;
+			break;
+		case NDJSON_OPT:
+			format_opt(UCLUAD_NDJSON, &udump, outs, outpaths,
+			    &nouts, &defout);
+			break;
+		case PROFILE_OPT:
+			proffile = optarg;
+			break;
+		case SCHEMA_OPT:
+			schemafile = optarg;
+			break;
+		case SELECT_OPT:
+			selpath = optarg;
+			break;
+		case SERVE_OPT:
+			servesock = optarg;
+			break;
+		case SNAPSHOT_OPT:
+			format_opt(UCLUAD_SNAPSHOT, &udump, outs, outpaths,
+			    &nouts, &defout);
+			break;
+		case STREAM_OPT:
+			stream = true;
 			break;
 		case UCL_OPT:
-			udump = UCLUAD_UCL;
+			format_opt(UCLUAD_UCL, &udump, outs, outpaths, &nouts,
+			    &defout);
 			break;
 		case YAML_OPT:
-			udump = UCLUAD_YAML;
+			format_opt(UCLUAD_YAML, &udump, outs, outpaths, &nouts,
+			    &defout);
+			break;
+		case 'j':
+			jobs = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL) {
+				fprintf(stderr, "jobs %s: %s\n", optarg,
+				    errstr);
+				return (usage());
+			}
 			break;
 		case 'o':
 			outfile = optarg;
+			defout = true;
 			break;
 		case 's':
 			sandbox = optarg;
@@ -129,23 +697,80 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (servesock != NULL) {
+		free(libdirs);
+		free(outs);
+		free(outpaths);
+		return (serve(servesock));
+	}
+
 	if (argc == 0 && isatty(STDIN_FILENO)) {
 		fprintf(stderr, "interactive conversion not supported\n");
 		return (usage());
 	}
 
-	if (outfile == NULL || strcmp(outfile, "-") == 0) {
-		outf = stdout;
-	} else {
-		outf = fopen(outfile, "w");
-		if (outf == NULL) {
-			fprintf(stderr, "could not open '%s' for output\n", outfile);
-			return (usage());
+	if (diff && (argc != 2 || proffile != NULL || selpath != NULL ||
+	    fpdepth >= 0))
+		return (usage());
+	/* Cached modules only pay off across documents. */
+	if (modcache && docdelim == NULL)
+		return (usage());
+	/* The daemon takes care of everything past picking the output. */
+	if (connsock != NULL && (diff || lazy || jobs > 1 ||
+	    proffile != NULL || fpdepth >= 0 || schemafile != NULL ||
+	    gcstats || gcpolicy.mode != UCLUA_GC_DEFAULT ||
+	    gcpolicy.flags != 0 || nouts != 0))
+		return (usage());
+
+	if (nouts == 0 || defout) {
+		outs[nouts].type = udump;
+		outpaths[nouts++] = outfile != NULL ? outfile : "-";
+	}
+	/* Streaming writes as it walks the env; only one JSON-ish sink. */
+	if (stream && (diff || connsock != NULL || selpath != NULL ||
+	    schemafile != NULL || nouts != 1 ||
+	    (outs[0].type != UCLUAD_JSON && outs[0].type != UCLUAD_NDJSON)))
+		return (usage());
+	/* Documents are written one record per line as they're evaluated. */
+	if (docdelim != NULL && (diff || stream || connsock != NULL ||
+	    proffile != NULL || fpdepth >= 0 || nouts != 1 ||
+	    outs[0].type != UCLUAD_NDJSON))
+		return (usage());
+
+	for (size_t i = 0; i < nouts; i++) {
+		for (size_t j = 0; j < i; j++) {
+			if (!same_output(outpaths[j], outpaths[i]))
+				continue;
+			fprintf(stderr, "'%s' and '%s' are the same output\n",
+			    outpaths[j], outpaths[i]);
+			ret = usage();
+			goto out;
 		}
 	}
 
+	for (size_t i = 0; i < nouts; i++) {
+		if (strcmp(outpaths[i], "-") == 0)
+			outs[i].file = stdout;
+		else
+			outs[i].file = fopen(outpaths[i], "w");
+		if (outs[i].file == NULL) {
+			fprintf(stderr, "could not open '%s' for output\n",
+			    outpaths[i]);
+			ret = usage();
+			goto out;
+		}
+	}
+
+	if (connsock != NULL) {
+		ret = serve_client(connsock, sandbox, udump, selpath, argc,
+		    argv, outs[0].file);
+		goto out;
+	}
+
 	lcook = uclua_new();
-	if (lcook == NULL) {
+	if (diff)
+		newcook = uclua_new();
+	if (lcook == NULL || (diff && newcook == NULL)) {
 		fprintf(stderr, "out of memory\n");
 		ret = 1;
 		goto out;
@@ -154,7 +779,8 @@ main(int argc, char *argv[])
 	if (sandbox == NULL)
 		sandbox = cwd = getcwd(NULL, 0);
 	if (sandbox != NULL) {
-		if (!uclua_set_sandbox(lcook, sandbox)) {
+		if (!uclua_set_sandbox(lcook, sandbox) ||
+		    (newcook != NULL && !uclua_set_sandbox(newcook, sandbox))) {
 			ret = 1;
 			goto out;
 		}
@@ -163,7 +789,56 @@ main(int argc, char *argv[])
 		cwd = NULL;
 	}
 
-	if (argc == 0) {
+	if (!uclua_set_gc_policy(lcook, &gcpolicy) ||
+	    (newcook != NULL && !uclua_set_gc_policy(newcook, &gcpolicy))) {
+		fprintf(stderr, "gc policy: %s\n",
+		    uclua_error_string(uclua_get_error(lcook)));
+		ret = 1;
+		goto out;
+	}
+	if (proffile != NULL)
+		uclua_set_profile(lcook, PROFILE_INTERVAL);
+	if (fpdepth >= 0)
+		uclua_set_footprint(lcook, true);
+	if (jobs > 1)
+		uclua_set_threads(lcook, jobs);
+	if (lazy) {
+		uclua_set_lazy_require(lcook, true);
+		if (newcook != NULL)
+			uclua_set_lazy_require(newcook, true);
+	}
+	if (modcache) {
+		uclua_set_module_cache(lcook, true);
+		for (size_t i = 0; i < nlibdirs; i++)
+			uclua_add_library(lcook, libdirs[i]);
+	}
+	if (schemafile != NULL && (ret = load_schema(lcook, schemafile)) != 0)
+		goto out;
+
+	if (docdelim != NULL) {
+		ndocs = 0;
+		ret = 0;
+		if (argc == 0)
+			ret = write_documents(lcook, "-", docdelim, selpath,
+			    outs[0].file, &ndocs);
+		for (int i = 0; i < argc; i++) {
+			if (write_documents(lcook, argv[i], docdelim, selpath,
+			    outs[0].file, &ndocs) != 0)
+				ret = 1;
+		}
+		if (gcstats && write_gc_stats(lcook) != 0)
+			ret = 1;
+		goto out;
+	} else if (diff) {
+		if (schemafile != NULL &&
+		    (ret = load_schema(newcook, schemafile)) != 0)
+			goto out;
+		uclua_set_hash(lcook, true);
+		uclua_set_hash(newcook, true);
+		ret = parse_one(lcook, argv[0]);
+		if (ret == 0)
+			ret = parse_one(newcook, argv[1]);
+	} else if (argc == 0) {
 		ret = parse_one(lcook, "-");
 	} else {
 		ret = 0;
@@ -173,15 +848,36 @@ main(int argc, char *argv[])
 		}
 	}
 
-	if (ret == 0 && uclua_dump(lcook, udump, outf) != 0) {
-		fprintf(stderr, "Failed to dump!\n");
+	if (proffile != NULL && write_profile(lcook, proffile) != 0)
 		ret = 1;
+	if (ret == 0 && fpdepth >= 0 && write_footprint(lcook, fpdepth) != 0)
+		ret = 1;
+	if (ret == 0 && gcstats && write_gc_stats(lcook) != 0)
+		ret = 1;
+
+	if (ret == 0 && stream) {
+		if (uclua_dump_stream(lcook, outs[0].type, outs[0].file) != 0) {
+			fprintf(stderr, "Failed to stream to %s: %s\n",
+			    outpaths[0],
+			    uclua_error_string(uclua_get_error(lcook)));
+			ret = 1;
+		}
+	} else if (ret == 0) {
+		ret = dump_outputs(lcook, newcook, selpath, outs, outpaths,
+		    nouts);
 	}
 out:
 	free(cwd);
-	if (outf != stdout)
-		fclose(outf);
+	for (size_t i = 0; i < nouts; i++) {
+		if (outs[i].file != NULL && outs[i].file != stdout)
+			fclose(outs[i].file);
+	}
+	free(libdirs);
+	free(outs);
+	free(outpaths);
 	if (lcook != NULL)
 		uclua_free(lcook);
+	if (newcook != NULL)
+		uclua_free(newcook);
 	return (ret);
 }
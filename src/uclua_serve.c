@@ -0,0 +1,671 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Kyle Evans <kevans@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * --serve and --connect: a conversion daemon on a Unix domain socket, and the
+ * client side of it.  The daemon keeps a small pool of cookies, one per
+ * sandbox, and only uclua_reset()s them between requests, so the Lua state and
+ * the sandbox's module resolution cache stay warm.  Modules marked pure, as for
+ * --module-cache, are run once and their results kept across requests; others
+ * are run again for every request, just as they would be by a fresh uclua.
+ * Should the sandbox directory be replaced or rearranged, what's cached for it
+ * is dropped.
+ *
+ * Each message is a 32-bit big-endian length followed by that many bytes.
+ * Requests are UCL objects:
+ *
+ *   sandbox - absolute path of the sandbox directory
+ *   format  - "json", "lua", "ndjson", "snapshot", "ucl" or
+ *             "yaml"
+ *   select  - optional path, as for --select
+ *   inputs  - array of { path = "..." } or { source = "..." }, evaluated in
+ *             order into the same document
+ *
+ * Responses are a status byte, 0 for success, followed by the output or an
+ * error message.  Requests are served one at a time, so each gets a limited
+ * time to evaluate its inputs in, and a client that keeps us waiting on its
+ * connection is dropped.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ucl.h>
+#include <uclua.h>
+
+#include "uclua_serve.h"
+
+/* Cookies kept warm, least recently used evicted first. */
+#define	SERVE_POOL_SIZE		8
+
+/* Largest request or response we'll take. */
+#define	SERVE_MAX_MESSAGE	(64 * 1024 * 1024)
+
+/* Seconds a request may spend evaluating its inputs. */
+#define	SERVE_TIME_LIMIT	30
+
+/* VM instructions evaluated between checks of the time limit. */
+#define	SERVE_STEP_BUDGET	100000
+
+/* Seconds we'll wait on a client to send or take a message. */
+#define	SERVE_IDLE_LIMIT	5
+
+struct serve_cookie {
+	char		*sandbox;
+	lcookie_t	*lcook;
+	unsigned long	 used;
+	dev_t		 dev;	/* of the sandbox when last used */
+	ino_t		 ino;
+	struct timespec	 mtime;
+};
+
+static const struct {
+	const char	*name;
+	uclua_dump_type	 type;
+} serve_formats[] = {
+	{ "json",	UCLUAD_JSON },
+	{ "lua",	UCLUAD_LUA },
+	{ "luac",	UCLUAD_LUAC },
+	{ "ndjson",	UCLUAD_NDJSON },
+	{ "snapshot",	UCLUAD_SNAPSHOT },
+	{ "ucl",	UCLUAD_UCL },
+	{ "yaml",	UCLUAD_YAML },
+};
+
+static struct serve_cookie serve_pool[SERVE_POOL_SIZE];
+static unsigned long serve_clock;
+
+static bool
+serve_io(int fd, void *buf, size_t len, bool writing)
+{
+	char *p;
+	ssize_t n;
+
+	for (p = buf; len > 0; p += n, len -= n) {
+		if (writing)
+			n = write(fd, p, len);
+		else
+			n = read(fd, p, len);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			return (false);
+	}
+
+	return (true);
+}
+
+static bool
+serve_send(int fd, uint8_t *status, const void *buf, size_t len)
+{
+	uint32_t hdr;
+
+	hdr = htonl((uint32_t)(len + (status != NULL ? 1 : 0)));
+	return (serve_io(fd, &hdr, sizeof(hdr), true) &&
+	    (status == NULL || serve_io(fd, status, 1, true)) &&
+	    (len == 0 || serve_io(fd, __DECONST(void *, buf), len, true)));
+}
+
+/* The caller frees the message; false on EOF or error. */
+static bool
+serve_recv(int fd, char **bufp, size_t *lenp)
+{
+	uint32_t hdr;
+	char *buf;
+	size_t len;
+
+	if (!serve_io(fd, &hdr, sizeof(hdr), false))
+		return (false);
+	len = ntohl(hdr);
+	if (len > SERVE_MAX_MESSAGE)
+		return (false);
+
+	buf = malloc(len + 1);
+	if (buf == NULL)
+		return (false);
+	if (!serve_io(fd, buf, len, false)) {
+		free(buf);
+		return (false);
+	}
+
+	buf[len] = '\0';
+	*bufp = buf;
+	*lenp = len;
+	return (true);
+}
+
+/*
+ * A sandbox that's been replaced needs opening again, while one that's merely
+ * had entries added, removed or renamed may have had its subdirectories
+ * replaced; the cookie's cached fds would still point at the old ones.
+ */
+static bool
+serve_revalidate(struct serve_cookie *sc, const struct stat *st, char **errp)
+{
+
+	if (sc->dev != st->st_dev || sc->ino != st->st_ino) {
+		if (!uclua_set_sandbox(sc->lcook, sc->sandbox)) {
+			asprintf(errp, "%s: %s", sc->sandbox,
+			    uclua_error_string(uclua_get_error(sc->lcook)));
+			return (false);
+		}
+	} else if (sc->mtime.tv_sec != st->st_mtim.tv_sec ||
+	    sc->mtime.tv_nsec != st->st_mtim.tv_nsec) {
+		uclua_sandbox_flush(sc->lcook);
+	}
+
+	sc->dev = st->st_dev;
+	sc->ino = st->st_ino;
+	sc->mtime = st->st_mtim;
+	return (true);
+}
+
+static lcookie_t *
+serve_cookie(const char *sandbox, char **errp)
+{
+	struct serve_cookie *sc, *victim;
+	struct stat st;
+	size_t i;
+
+	if (stat(sandbox, &st) == -1) {
+		asprintf(errp, "%s: %s", sandbox, strerror(errno));
+		return (NULL);
+	}
+
+	victim = &serve_pool[0];
+	for (i = 0; i < nitems(serve_pool); i++) {
+		sc = &serve_pool[i];
+		if (sc->lcook != NULL && strcmp(sc->sandbox, sandbox) == 0) {
+			victim = sc;
+			if (!serve_revalidate(sc, &st, errp))
+				goto fail;
+			sc->used = ++serve_clock;
+			return (sc->lcook);
+		}
+		if (sc->used < victim->used)
+			victim = sc;
+	}
+
+	if (victim->lcook != NULL) {
+		uclua_free(victim->lcook);
+		free(victim->sandbox);
+		memset(victim, 0, sizeof(*victim));
+	}
+
+	victim->lcook = uclua_new();
+	victim->sandbox = strdup(sandbox);
+	if (victim->lcook == NULL || victim->sandbox == NULL) {
+		asprintf(errp, "out of memory");
+		goto fail;
+	}
+
+	if (!uclua_set_sandbox(victim->lcook, sandbox)) {
+		asprintf(errp, "%s: %s", sandbox,
+		    uclua_error_string(uclua_get_error(victim->lcook)));
+		goto fail;
+	}
+	uclua_set_module_cache(victim->lcook, true);
+
+	victim->dev = st.st_dev;
+	victim->ino = st.st_ino;
+	victim->mtime = st.st_mtim;
+	victim->used = ++serve_clock;
+	return (victim->lcook);
+fail:
+	if (victim->lcook != NULL)
+		uclua_free(victim->lcook);
+	free(victim->sandbox);
+	memset(victim, 0, sizeof(*victim));
+	return (NULL);
+}
+
+static bool
+serve_expired(const struct timespec *deadline)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		return (false);
+	return (now.tv_sec > deadline->tv_sec ||
+	    (now.tv_sec == deadline->tv_sec &&
+	    now.tv_nsec >= deadline->tv_nsec));
+}
+
+static bool
+serve_input(lcookie_t *lcook, const ucl_object_t *input,
+    const struct timespec *deadline, char **errp)
+{
+	const ucl_object_t *elt;
+	const char *str;
+	FILE *f;
+	size_t len;
+	uclua_step status;
+	bool ok;
+
+	if ((elt = ucl_object_lookup(input, "path")) != NULL &&
+	    (str = ucl_object_tostring(elt)) != NULL) {
+		f = fopen(str, "r");
+		if (f == NULL) {
+			asprintf(errp, "%s: %s", str, strerror(errno));
+			return (false);
+		}
+	} else if ((elt = ucl_object_lookup(input, "source")) != NULL &&
+	    ucl_object_type(elt) == UCL_STRING) {
+		str = ucl_object_tolstring(elt, &len);
+		if (len == 0)
+			return (true);
+		f = fmemopen(__DECONST(char *, str), len, "r");
+		if (f == NULL) {
+			asprintf(errp, "%s", strerror(errno));
+			return (false);
+		}
+	} else {
+		asprintf(errp, "malformed input");
+		return (false);
+	}
+
+	/*
+	 * The whole input is read in by uclua_parse_begin().  A document left
+	 * in flight is released by the uclua_reset() after the request.
+	 */
+	ok = uclua_parse_begin(lcook, f);
+	fclose(f);
+	status = ok ? UCLUAS_AGAIN : UCLUAS_ERROR;
+	while (status == UCLUAS_AGAIN) {
+		status = uclua_parse_step(lcook, SERVE_STEP_BUDGET);
+		if (status == UCLUAS_AGAIN && serve_expired(deadline)) {
+			asprintf(errp, "time limit of %d seconds exceeded",
+			    SERVE_TIME_LIMIT);
+			return (false);
+		}
+	}
+
+	if (status != UCLUAS_DONE) {
+		asprintf(errp, "failed to evaluate: %s",
+		    uclua_error_string(uclua_get_error(lcook)));
+		return (false);
+	}
+	return (true);
+}
+
+/* Run one request, writing the result to `out`. */
+static bool
+serve_request(const char *req, size_t reqlen, FILE *out, char **errp)
+{
+	struct ucl_parser *parser;
+	struct timespec deadline;
+	ucl_object_iter_t it;
+	lcookie_t *lcook;
+	ucl_object_t *obj, *result;
+	const ucl_object_t *elt, *inputs;
+	const char *format, *sandbox, *selpath;
+	size_t i;
+	bool ok;
+
+	obj = NULL;
+	lcook = NULL;
+	result = NULL;
+	ok = false;
+	parser = ucl_parser_new(UCL_PARSER_DEFAULT);
+	if (parser == NULL ||
+	    !ucl_parser_add_chunk(parser, (const unsigned char *)req, reqlen) ||
+	    (obj = ucl_parser_get_object(parser)) == NULL) {
+		asprintf(errp, "malformed request: %s", parser != NULL ?
+		    ucl_parser_get_error(parser) : "out of memory");
+		goto out;
+	}
+
+	sandbox = ucl_object_tostring(ucl_object_lookup(obj, "sandbox"));
+	format = ucl_object_tostring(ucl_object_lookup(obj, "format"));
+	selpath = ucl_object_tostring(ucl_object_lookup(obj, "select"));
+	inputs = ucl_object_lookup(obj, "inputs");
+	if (sandbox == NULL || format == NULL || inputs == NULL) {
+		asprintf(errp, "malformed request");
+		goto out;
+	}
+
+	for (i = 0; i < nitems(serve_formats); i++) {
+		if (strcmp(format, serve_formats[i].name) == 0)
+			break;
+	}
+	if (i == nitems(serve_formats)) {
+		asprintf(errp, "unknown format '%s'", format);
+		goto out;
+	}
+
+	if ((lcook = serve_cookie(sandbox, errp)) == NULL)
+		goto out;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &deadline) == -1) {
+		asprintf(errp, "clock_gettime: %s", strerror(errno));
+		goto out;
+	}
+	deadline.tv_sec += SERVE_TIME_LIMIT;
+	it = NULL;
+	while ((elt = ucl_object_iterate(inputs, &it, true)) != NULL) {
+		if (!serve_input(lcook, elt, &deadline, errp))
+			goto out;
+	}
+
+	if (selpath != NULL)
+		result = uclua_lookup(lcook, selpath);
+	else if ((result = uclua_ucl(lcook)) != NULL)
+		result = ucl_object_ref(result);
+	if (result == NULL ||
+	    uclua_dump_ucl(lcook, result, serve_formats[i].type, out) != 0) {
+		asprintf(errp, "%s",
+		    uclua_error_string(uclua_get_error(lcook)));
+		goto out;
+	}
+
+	ok = true;
+out:
+	if (result != NULL)
+		ucl_object_unref(result);
+	if (lcook != NULL)
+		uclua_reset(lcook);
+	if (obj != NULL)
+		ucl_object_unref(obj);
+	if (parser != NULL)
+		ucl_parser_free(parser);
+	return (ok);
+}
+
+static void
+serve_conn(int fd)
+{
+	FILE *out;
+	char *buf, *err, *req;
+	size_t buflen, reqlen;
+	uint8_t status;
+	bool ok;
+
+	while (serve_recv(fd, &req, &reqlen)) {
+		buf = err = NULL;
+		buflen = 0;
+		out = open_memstream(&buf, &buflen);
+		if (out == NULL) {
+			free(req);
+			return;
+		}
+
+		ok = serve_request(req, reqlen, out, &err);
+		free(req);
+		if (fclose(out) != 0 && ok) {
+			ok = false;
+			asprintf(&err, "out of memory");
+		}
+
+		status = ok ? 0 : 1;
+		if (ok)
+			ok = serve_send(fd, &status, buf, buflen);
+		else
+			ok = serve_send(fd, &status, err,
+			    err != NULL ? strlen(err) : 0);
+		free(buf);
+		free(err);
+		if (!ok)
+			return;
+	}
+}
+
+int
+serve(const char *path)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	struct timeval tv;
+	mode_t omask;
+	int fd, sfd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return (1);
+	}
+
+	/* Only ever replace a stale socket, never some other file. */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		(void)unlink(path);
+
+	sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sfd == -1) {
+		perror("socket");
+		return (1);
+	}
+
+	/* Requests name arbitrary paths, so only we get to make them. */
+	omask = umask(077);
+	if (bind(sfd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		umask(omask);
+		perror(path);
+		close(sfd);
+		return (1);
+	}
+	umask(omask);
+
+	if (listen(sfd, 16) == -1) {
+		perror("listen");
+		close(sfd);
+		return (1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	tv.tv_sec = SERVE_IDLE_LIMIT;
+	tv.tv_usec = 0;
+	for (;;) {
+		fd = accept(sfd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+
+		/* Clients are served in turn, so none may keep us waiting. */
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof(tv)) == -1 ||
+		    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv,
+		    sizeof(tv)) == -1)
+			perror("setsockopt");
+		else
+			serve_conn(fd);
+		close(fd);
+	}
+
+	close(sfd);
+	return (1);
+}
+
+static bool
+client_input(ucl_object_t *inputs, const char *name)
+{
+	ucl_object_t *input, *val;
+	char *buf, *path;
+	size_t buflen, n;
+
+	input = ucl_object_typed_new(UCL_OBJECT);
+	if (input == NULL)
+		return (false);
+
+	if (strcmp(name, "-") != 0) {
+		/* The daemon doesn't share our working directory. */
+		if ((path = realpath(name, NULL)) == NULL) {
+			perror(name);
+			ucl_object_unref(input);
+			return (false);
+		}
+		val = ucl_object_fromstring(path);
+		free(path);
+		ucl_object_insert_key(input, val, "path", 0, false);
+		return (ucl_array_append(inputs, input));
+	}
+
+	buf = NULL;
+	buflen = 0;
+	for (;;) {
+		path = realloc(buf, buflen + BUFSIZ);
+		if (path == NULL) {
+			free(buf);
+			ucl_object_unref(input);
+			return (false);
+		}
+		buf = path;
+		n = fread(buf + buflen, 1, BUFSIZ, stdin);
+		buflen += n;
+		if (n < BUFSIZ)
+			break;
+	}
+
+	val = ucl_object_fromlstring(buf, buflen);
+	free(buf);
+	ucl_object_insert_key(input, val, "source", 0, false);
+	return (ucl_array_append(inputs, input));
+}
+
+/*
+ * Have the daemon at `sockpath` convert the given files, writing the result to
+ * `outf`.
+ */
+int
+serve_client(const char *sockpath, const char *sandbox, uclua_dump_type udump,
+    const char *selpath, int argc, char *argv[], FILE *outf)
+{
+	struct sockaddr_un sun;
+	ucl_object_t *req, *inputs;
+	char *msg, *resp, *sbpath;
+	size_t i, resplen;
+	int fd, ret;
+
+	fd = -1;
+	msg = resp = sbpath = NULL;
+	ret = 1;
+	req = ucl_object_typed_new(UCL_OBJECT);
+	inputs = ucl_object_typed_new(UCL_ARRAY);
+	if (req == NULL || inputs == NULL) {
+		fprintf(stderr, "out of memory\n");
+		goto out;
+	}
+
+	if (sandbox == NULL)
+		sandbox = ".";
+	if ((sbpath = realpath(sandbox, NULL)) == NULL) {
+		perror(sandbox);
+		goto out;
+	}
+
+	for (i = 0; i < nitems(serve_formats); i++) {
+		if (serve_formats[i].type == udump)
+			break;
+	}
+
+	if (argc == 0) {
+		if (!client_input(inputs, "-"))
+			goto out;
+	}
+	for (int j = 0; j < argc; j++) {
+		if (!client_input(inputs, argv[j]))
+			goto out;
+	}
+
+	ucl_object_insert_key(req, ucl_object_fromstring(sbpath), "sandbox", 0,
+	    false);
+	ucl_object_insert_key(req, ucl_object_fromstring(serve_formats[i].name),
+	    "format", 0, false);
+	if (selpath != NULL)
+		ucl_object_insert_key(req, ucl_object_fromstring(selpath),
+		    "select", 0, false);
+	ucl_object_insert_key(req, inputs, "inputs", 0, false);
+	inputs = NULL;
+
+	msg = (char *)ucl_object_emit(req, UCL_EMIT_JSON_COMPACT);
+	if (msg == NULL) {
+		fprintf(stderr, "out of memory\n");
+		goto out;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, sockpath, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", sockpath);
+		goto out;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 ||
+	    connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		perror(sockpath);
+		goto out;
+	}
+
+	if (!serve_send(fd, NULL, msg, strlen(msg)) ||
+	    !serve_recv(fd, &resp, &resplen) || resplen == 0) {
+		fprintf(stderr, "%s: lost connection to daemon\n", sockpath);
+		goto out;
+	}
+
+	if (resp[0] != 0) {
+		fprintf(stderr, "%.*s\n", (int)(resplen - 1), resp + 1);
+		goto out;
+	}
+
+	if (fwrite(resp + 1, 1, resplen - 1, outf) != resplen - 1) {
+		fprintf(stderr, "Failed to dump!\n");
+		goto out;
+	}
+
+	ret = 0;
+out:
+	if (fd != -1)
+		close(fd);
+	free(resp);
+	free(msg);
+	free(sbpath);
+	if (inputs != NULL)
+		ucl_object_unref(inputs);
+	if (req != NULL)
+		ucl_object_unref(req);
+	return (ret);
+}